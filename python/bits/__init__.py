@@ -34,7 +34,6 @@ import itertools
 from collections import namedtuple
 import string
 import struct
-import time
 
 MOD_SHIFT = 0x01000000
 MOD_CTRL = 0x02000000
@@ -73,36 +72,129 @@ class cpuid_result(namedtuple('cpuid_result', ['eax', 'ebx', 'ecx', 'edx'])):
     def __repr__(self):
         return "cpuid_result(eax={eax:#010x}, ebx={ebx:#010x}, ecx={ecx:#010x}, edx={edx:#010x})".format(**self._asdict())
 
-def cpuid(apicid, eax, ecx=0):
-    """Run CPUID on the specified CPU. Return a namedtuple containing eax, ebx, ecx, and edx."""
+# Leaves that can change after the snapshot: leaf 1 (OSXSAVE, and the APIC
+# ID in EBX), leaf 7 (OSPKE), and leaf 0xD (XSAVE sizes for the features
+# enabled in XCR0).  cpuid and cpuid_all run these on the CPU every time.
+cpuid_uncached_leaves = set([0x1, 0x7, 0xd])
+
+def _cpuid_use_cache(eax, cached):
+    if cached is None:
+        return eax not in cpuid_uncached_leaves
+    return cached
+
+def cpuid(apicid, eax, ecx=0, cached=None):
+    """Run CPUID on the specified CPU. Return a namedtuple containing eax, ebx, ecx, and edx.
+
+    Unless the leaf is in cpuid_uncached_leaves, the result comes from a
+    snapshot of all CPUs taken on first use, without interrupting the CPU.
+    Pass cached=True or cached=False to override."""
+    if _cpuid_use_cache(eax, cached):
+        regs = _smp.cpuid_cached(apicid, eax, ecx)
+        if regs is not None:
+            return cpuid_result(*regs)
     return cpuid_result(*_smp._cpuid(apicid, eax, ecx))
 
+def cpuid_all(eax, ecx=0, cached=None):
+    """Run CPUID concurrently on all CPUs. Return a list of cpuid_result namedtuples, in the same order as cpus().
+
+    Uses the CPUID snapshot as cpuid does."""
+    if _cpuid_use_cache(eax, cached):
+        regs_list = _smp.cpuid_cached_all(eax, ecx)
+        if regs_list is not None:
+            return [cpuid_result(*regs) for regs in regs_list]
+    return [cpuid_result(*regs) for regs in _smp._cpuid_all(eax, ecx)]
+
+cache_info = namedtuple("cache_info", ["level", "type", "size", "line_size", "ways", "sets", "shared_by"])
+
+_cache_types = { 1: "data", 2: "instruction", 3: "unified" }
+
+def cpuid_caches(apicid=None):
+    """Return the caches that CPUID leaf 4 describes for the specified CPU
+    (the BSP if None), as a list of cache_info namedtuples.  shared_by is the
+    maximum number of logical processors sharing the cache."""
+    if apicid is None:
+        apicid = bsp_apicid()
+    if cpuid(apicid, 0).eax < 4:
+        return []
+    caches = []
+    for index in itertools.count():
+        eax, ebx, ecx, edx = cpuid(apicid, 4, index)
+        cache_type = eax & 0x1f
+        if cache_type == 0:
+            break
+        line_size = (ebx & 0xfff) + 1
+        partitions = ((ebx >> 12) & 0x3ff) + 1
+        ways = ((ebx >> 22) & 0x3ff) + 1
+        sets = ecx + 1
+        caches.append(cache_info((eax >> 5) & 0x7, _cache_types.get(cache_type, "unknown"), ways * partitions * line_size * sets, line_size, ways, sets, ((eax >> 14) & 0xfff) + 1))
+    return caches
+
 _grub_command_map = {}
 
 def addr_alignment(addr):
     """Compute the maximum alignment of a specified address, up to 4."""
     return addr & 1 or addr & 2 or 4
 
+REGPROG_NO_SLOT = 0xff
+REGPROG_RMW = 0x1
+_regprog_opcodes = { "rdmsr": 0, "wrmsr": 1, "in": 2, "out": 3, "read": 4, "write": 5 }
+_regprog_op_struct = struct.Struct("<BBBBBBHQQQ")
+
+def regprog_op(op, addr, width=8, dst=None, src=None, base=None, shift=0, mask=~0, value=0, rmw=False):
+    """Pack one operation of a register program for regprog().
+
+    op is one of "rdmsr", "wrmsr", "in", "out", "read", or "write", and width
+    the access size in bytes (8 for MSRs).  The register accessed is addr,
+    plus the value of slot base if given.  Reads store (raw >> shift) & mask
+    in slot dst.  Writes write (v & mask) << shift, where v is slot src if
+    given and value otherwise; with rmw, bits outside mask << shift keep the
+    value read from the register.  Concatenate the results to form a program."""
+    def slot(s):
+        return REGPROG_NO_SLOT if s is None else s
+    return _regprog_op_struct.pack(_regprog_opcodes[op], width, slot(dst), slot(src), slot(base), shift,
+                                   REGPROG_RMW if rmw else 0, addr, mask & (2**64 - 1), value & (2**64 - 1))
+
 PCI_ADDR_PORT = 0xCF8
 PCI_DATA_PORT = 0xCFC
 
+# PCI configuration programs take the CF8 address in slot 0 and the offset of
+# the register within the data dword in slot 1; reads leave the value in slot
+# 2 and writes take it from slot 2.  Running the address and data accesses in
+# one dispatch keeps the pair together.
+_pci_read_programs = {}
+_pci_write_programs = {}
+for _bytes in (1, 2, 4):
+    _pci_read_programs[_bytes] = regprog_op("out", PCI_ADDR_PORT, 4, src=0) + regprog_op("in", PCI_DATA_PORT, _bytes, dst=2, base=1)
+    _pci_write_programs[_bytes] = regprog_op("out", PCI_ADDR_PORT, 4, src=0) + regprog_op("out", PCI_DATA_PORT, _bytes, src=2, base=1)
+del _bytes
+
 def _pci_op(bus, device, function, register, bytes):
     if bytes is None:
         bytes = addr_alignment(register)
     elif bytes not in [1,2,4]:
         raise ValueError("bytes must be 1, 2, or 4")
-    outl(PCI_ADDR_PORT, ((1 << 31) | (bus << 16) | (device << 11) | (function << 8) | register) & ~3)
-    return bytes, PCI_DATA_PORT + (register & 3)
+    return bytes, ((1 << 31) | (bus << 16) | (device << 11) | (function << 8) | register) & ~3
 
 def pci_read(bus, device, function, register, bytes=None):
     """Read a value of the specified size from the PCI device specified by bus:device.function register"""
-    bytes, port = _pci_op(bus, device, function, register, bytes)
-    return { 1: inb, 2: inw, 4: inl }[bytes](port)
+    bytes, address = _pci_op(bus, device, function, register, bytes)
+    return regprog(_pci_read_programs[bytes], (address, register & 3))[1][2]
 
 def pci_write(bus, device, function, register, value, bytes=None):
     """Write a value of the specified size to the PCI device specified by bus:device.function register"""
-    bytes, port = _pci_op(bus, device, function, register, bytes)
-    { 1: outb, 2: outw, 4: outl }[bytes](port, value)
+    bytes, address = _pci_op(bus, device, function, register, bytes)
+    regprog(_pci_write_programs[bytes], (address, register & 3, value))
+
+def pci_poll(bus, device, function, register, mask, expected, timeout, bytes=None, setup=""):
+    """Read the specified PCI register until (value & mask) == expected or
+    timeout TSC counts pass, spinning on the BSP without returning to Python.
+
+    setup is an optional register program run after selecting the register,
+    such as a write that starts the transition being timed.  Returns
+    (elapsed, value), the TSC counts elapsed and the last value read."""
+    bytes, address = _pci_op(bus, device, function, register, bytes)
+    setup = regprog_op("out", PCI_ADDR_PORT, 4, value=address) + setup
+    return poll_port(PCI_DATA_PORT + (register & 3), mask, expected, timeout, bytes, setup=setup)
 
 _pcie_base = None
 
@@ -155,17 +247,20 @@ def _grub_command_callback(args):
 
 _bits._set_grub_command_callback(_grub_command_callback)
 
-# Cache the cpulist since it will never change.
-cpulist = cpus()
+# Cache the cpulist since it will never change.  Fetch it on first use
+# rather than at import, since that waits for the APs to finish starting.
+_cpulist = None
 
 def cpus():
     """cpus() -> list of APIC IDs."""
-    return cpulist
+    global _cpulist
+    if _cpulist is None:
+        _cpulist = _smp.cpus()
+    return _cpulist
 
 def bsp_apicid():
     """Returns the BSP's APIC ID."""
-    global cpulist
-    return cpulist[0]
+    return cpus()[0]
 
 def socket_index(apic_id):
     """Returns the socket portion of the APIC ID"""
@@ -180,19 +275,16 @@ def socket_index(apic_id):
 
 def socket_apic_ids():
     """Returns a mapping to unique socket index with the list of APIC IDs"""
-    global cpulist
     uniques = {}
-    for apicid in sorted(cpulist):
+    for apicid in sorted(cpus()):
         uniques.setdefault(socket_index(apicid), []).append(apicid)
     return uniques
 
 def apicid_to_index():
     """Returns a reverse mapping from APIC ID to CPU number"""
-    global cpulist
-    return dict([(apicid, i) for (i, apicid) in enumerate(cpulist)])
+    return dict([(apicid, i) for (i, apicid) in enumerate(cpus())])
 
 def cpu_frequency():
-    global cpulist
     IA32_MPERF_MSR = 0xE7
     IA32_APERF_MSR = 0xE8
 
@@ -204,7 +296,7 @@ def cpu_frequency():
         # MPERF/APERF MSRs are not supported
         return None
 
-    for apicid in cpulist:
+    for apicid in cpus():
         set_mwait(apicid, True, 0x20)
 
     if wrmsr(bsp_apicid(), IA32_MPERF_MSR, 0) is None:
@@ -215,15 +307,18 @@ def cpu_frequency():
         # Writing of IA32_APERF MSR caused a GPF
         return None
 
-    # Needs to busywait, not sleep
-    start = time.time()
-    while (time.time() - start < 1):
+    # Needs to busywait, not sleep.  With the TSC already calibrated, a tenth
+    # of a second suffices.
+    hz = tsc_hz()
+    start = rdtsc()
+    while rdtsc() - start < hz / 10:
         pass
 
-    mperf_hz = rdmsr(bsp_apicid(), IA32_MPERF_MSR)
-    aperf_hz = rdmsr(bsp_apicid(), IA32_APERF_MSR)
+    mperf = rdmsr(bsp_apicid(), IA32_MPERF_MSR)
+    aperf = rdmsr(bsp_apicid(), IA32_APERF_MSR)
+    elapsed = rdtsc() - start
 
-    return mperf_hz, aperf_hz
+    return mperf * hz / elapsed, aperf * hz / elapsed
 
 def print_hz(hz):
     temp = hz / (1000.0 * 1000 * 1000)
@@ -151,4 +151,9 @@ class pyfs_file(object):
     def xreadlines(self):
         return self
 
-
+def replace_file(basename):
+    """Return a new pyfs_file named basename, first deleting any existing file
+    of that name, such as one written by an earlier run of the same test."""
+    if _pyfs_files.get(basename) is not None:
+        pyfs_del(basename)
+    return pyfs_file(basename)
@@ -157,10 +157,16 @@ def cmd_brandstring(args):
         print "On {0} CPUs: {1}".format(len(cpus), testutil.apicid_list(cpus))
 
 cpu_sleep_argparser = argparse.ArgumentParser(prog='cpu_sleep', description='Sleep using mwait')
+cpu_sleep_argparser.add_argument('-c', '--cpu', type=parse_cpu, help='CPU number (default=BSP)')
 cpu_sleep_argparser.add_argument('usec', type=parse_usec, help='Time to sleep in microseconds')
 
 def cmd_cpu_sleep(args):
-    bits.blocking_sleep(args.usec)
+    if args.cpu is None:
+        bits.blocking_sleep(args.usec)
+    elif args.cpu == ALL_CPUS:
+        print "cpu_sleep sleeps one CPU at a time"
+    else:
+        bits.blocking_sleep(args.usec, bits.cpus()[args.cpu])
 
 cpu_argparser = argparse.ArgumentParser(prog='cpu', description='Set CPU number or optionally list CPU numbers')
 cpu_argparser.add_argument('-e', '--env', action='store_true', help='Set $apicid_list to list of APIC IDs (default=disabled)')
@@ -377,10 +383,14 @@ def cmd_rdmsr(args):
 def parse_hint(s):
     return parse_int(s, "HINT")
 
-set_mwait_argparser = argparse.ArgumentParser(prog='set_mwait', usage='%(prog)s [-c cpu_num] [disable | [-i] enable hint]',
-        description='Set MWAIT disable/enable, hint, and interrupt break event')
+def parse_ticks(s):
+    return parse_int(s, "TICKS", 2**32 - 1)
+
+set_mwait_argparser = argparse.ArgumentParser(prog='set_mwait', usage='%(prog)s [-c cpu_num] [disable | [-i] [-s ticks] enable hint]',
+        description='Set MWAIT disable/enable, hint, interrupt break event, and spin budget')
 set_mwait_argparser.add_argument('-c', '--cpu', type=parse_cpu, help='CPU number')
 set_mwait_argparser.add_argument('-i', '--no-int-break-event', action='store_true', help='Interrupt Break Event Disable (default=enabled)')
+set_mwait_argparser.add_argument('-s', '--spin', default=0, type=parse_ticks, help='TSC counts to spin waiting for work before entering MWAIT (default=0)', metavar='TICKS')
 set_mwait_argparser.add_argument('mwait', type=str, choices=['enable', 'disable'], help='Enable or disable MWAIT')
 set_mwait_argparser.add_argument('hint', nargs='?', type=parse_hint, help='Hint value for MWAIT')
 
@@ -393,7 +403,7 @@ def cmd_set_mwait(args):
         use_mwait = True
 
     if args.mwait == 'disable':
-        if args.hint is not None or args.no_int_break_event:
+        if args.hint is not None or args.no_int_break_event or args.spin:
             set_mwait_argparser.print_usage()
             print '"disable" takes no arguments'
             return
@@ -401,7 +411,7 @@ def cmd_set_mwait(args):
         args.hint = 0
 
     for apicid in each_apicid(args.cpu):
-        bits.set_mwait(apicid, use_mwait, args.hint, not args.no_int_break_event)
+        bits.set_mwait(apicid, use_mwait, args.hint, not args.no_int_break_event, args.spin)
 
 test_cpuid_consistent_argparser = argparse.ArgumentParser(prog='test_cpuid_consistent', description='Test for consistent registers returned by CPUID instructions')
 test_cpuid_consistent_argparser.add_argument('-m', '--mask', default=~0, type=parse_mask, help='Mask to apply to values read (default=~0)')
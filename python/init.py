@@ -34,6 +34,11 @@ def early_init():
     import redirect
     redirect.redirect()
 
+    # Start waking the APs now, so that they come up while the rest of boot
+    # parses ACPI tables and imports modules; the first use of _smp waits.
+    import _smp
+    _smp.start()
+
     # Parse the ACPI SPCR and automatically set up the serial port if present
     serial_cmd = "false"
     try:
@@ -110,6 +115,14 @@ def init():
     testsmrr.register_tests()
     import smilatency
     smilatency.register_tests()
+    import jitter
+    jitter.register_tests()
+    import membw
+    membw.register_tests()
+    import memlatency
+    memlatency.register_tests()
+    import pingpong
+    pingpong.register_tests()
     import mptable
     mptable.register_tests()
 
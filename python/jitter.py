@@ -0,0 +1,108 @@
+# Copyright (c) 2013, Intel Corporation
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+#     * Redistributions of source code must retain the above copyright notice,
+#       this list of conditions and the following disclaimer.
+#     * Redistributions in binary form must reproduce the above copyright notice,
+#       this list of conditions and the following disclaimer in the documentation
+#       and/or other materials provided with the distribution.
+#     * Neither the name of Intel Corporation nor the names of its contributors
+#       may be used to endorse or promote products derived from this software
+#       without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+# ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+# ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+"""Jitter tracer: find time stolen from each CPU over long runs.
+
+The trace file is little-endian binary: a header of struct "<8sIIQQ" with
+the magic "BITSJTR1", the record size (16), reserved, tsc_hz, and the
+threshold in TSC counts; then one chunk per CPU per drain, each a header of
+struct "<IIQ" with the APIC ID, the number of records that follow, and the
+records lost since the previous chunk for that CPU, followed by that many
+records of struct "<QQ" with the TSC at the start of the gap and its length.
+"""
+
+import bits
+import bits.pyfs
+import struct
+import testsuite
+
+MAGIC = "BITSJTR1"
+HEADER = struct.Struct("<8sIIQQ")
+CHUNK = struct.Struct("<IIQ")
+RECORD = struct.Struct("<QQ")
+
+def register_tests():
+    testsuite.add_test("Jitter trace on all APs for 60 seconds", test_jitter_trace, runall=False)
+
+def jitter_trace(filename, duration, threshold, apicids=None, ring_size=4096, wrap=False, drain_usec=10000):
+    """Trace gaps longer than threshold TSC counts on each CPU in apicids
+    (all APs if None) for duration TSC counts, writing them to
+    (python)/filename in the format described in the module docstring.
+
+    The BSP drains the rings every drain_usec microseconds while the trace
+    runs.  Returns the pyfs_file, and a dict mapping each APIC ID to
+    (records, lost).  Replaces any earlier trace written to filename."""
+    f = bits.pyfs.replace_file(filename)
+    f.write(HEADER.pack(MAGIC, RECORD.size, 0, bits.tsc_hz(), threshold))
+    totals = {}
+    trace = bits.jitter_trace_start(apicids, duration, threshold, ring_size, wrap)
+    try:
+        done = False
+        while not done:
+            bits.blocking_sleep(drain_usec)
+            done, rings = bits.jitter_trace_drain(trace)
+            for apicid, records, lost in rings:
+                count = len(records) // RECORD.size
+                if count or lost:
+                    f.write(CHUNK.pack(apicid, count, lost))
+                    f.write(records)
+                total_records, total_lost = totals.get(apicid, (0, 0))
+                totals[apicid] = total_records + count, total_lost + lost
+    finally:
+        bits.jitter_trace_stop(trace)
+        del trace
+    return f, totals
+
+def read_trace(data):
+    """Parse a trace file's contents into (tsc_hz, threshold, {apicid: [(start_tsc, gap)]}, {apicid: lost})."""
+    magic, record_size, reserved, tsc_hz, threshold = HEADER.unpack_from(data)
+    if magic != MAGIC or record_size != RECORD.size:
+        raise ValueError("not a jitter trace")
+    gaps = {}
+    lost = {}
+    offset = HEADER.size
+    while offset < len(data):
+        apicid, count, chunk_lost = CHUNK.unpack_from(data, offset)
+        offset += CHUNK.size
+        values = struct.unpack_from("<{}Q".format(2 * count), data, offset)
+        offset += count * RECORD.size
+        gaps.setdefault(apicid, []).extend(zip(values[0::2], values[1::2]))
+        lost[apicid] = lost.get(apicid, 0) + chunk_lost
+    return tsc_hz, threshold, gaps, lost
+
+def test_jitter_trace():
+    tsc_per_usec = bits.tsc_hz() / (1000 * 1000)
+    threshold = 10 * tsc_per_usec
+    print "Wait here, I will be back in 60 seconds."
+    f, totals = jitter_trace("jitter.bin", 60 * bits.tsc_hz(), threshold)
+    tsc_hz, threshold, gaps, lost = read_trace(f.getvalue())
+    max_gap = max([gap for cpu_gaps in gaps.itervalues() for start, gap in cpu_gaps] or [0])
+    testsuite.test("Time stolen from APs < 150us at a time", max_gap <= 150 * tsc_per_usec)
+    testsuite.print_detail("Trace written to {} ({} bytes)".format(f.filename, f.size))
+    for apicid in sorted(totals):
+        records, cpu_lost = totals[apicid]
+        cpu_max = max([gap for start, gap in gaps.get(apicid, [])] or [0])
+        testsuite.print_detail("APIC ID {:#x}: {} gaps > 10us, {} lost; max {}us".format(apicid, records, cpu_lost, cpu_max / tsc_per_usec))
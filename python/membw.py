@@ -0,0 +1,110 @@
+# Copyright (c) 2013, Intel Corporation
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+#     * Redistributions of source code must retain the above copyright notice,
+#       this list of conditions and the following disclaimer.
+#     * Redistributions in binary form must reproduce the above copyright notice,
+#       this list of conditions and the following disclaimer in the documentation
+#       and/or other materials provided with the distribution.
+#     * Neither the name of Intel Corporation nor the names of its contributors
+#       may be used to endorse or promote products derived from this software
+#       without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+# ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+# ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+"""Memory bandwidth benchmark."""
+
+import bits
+import bitsconfig
+import testsuite
+
+KERNELS = ("read", "write", "copy", "triad")
+
+# Buffers each kernel uses, and bytes of memory traffic per byte of buffer,
+# counting reads and writes as STREAM does.
+_buffers = { "read": 1, "write": 1, "copy": 2, "triad": 3 }
+
+_MB = 1024 * 1024
+
+def register_tests():
+    testsuite.add_test("Memory bandwidth", test_membw)
+
+def default_size(kernel, ncpus):
+    """Size of each buffer for running kernel on ncpus CPUs at once: large
+    enough that the buffers together are four times the last-level cache,
+    and at least 1MB each."""
+    llc = max([c.size for c in bits.cpuid_caches()] or [8 * _MB])
+    size = max(4 * llc // (ncpus * _buffers[kernel]), _MB)
+    return size & ~63
+
+def measure(kernel, apicids, size=None, iterations=10):
+    """Run kernel concurrently on each CPU in apicids, on buffers of size
+    bytes each.  Returns (per_cpu, aggregate) bandwidth in GB/s, with per_cpu
+    in the same order as apicids; aggregate covers the span from the first
+    CPU starting to the last CPU finishing."""
+    if size is None:
+        size = default_size(kernel, len(apicids))
+    nbuffers = _buffers[kernel]
+    pool = bits.malloc(len(apicids) * nbuffers * size + 64)
+    base = (bits.memory_addr(pool) + 63) & ~63
+    jobs = []
+    for i, apicid in enumerate(apicids):
+        addrs = [base + (i * nbuffers + j) * size for j in range(nbuffers)]
+        addrs += addrs[:1] * (3 - nbuffers)
+        jobs.append((apicid,) + tuple(addrs))
+    times = bits.membw(kernel, jobs, size, iterations)
+    del pool
+
+    tsc_hz = float(bits.tsc_hz())
+    cpu_bytes = float(_buffers[kernel] * size * iterations)
+    per_cpu = [cpu_bytes / ((end - start) / tsc_hz) / 1e9 for start, end in times]
+    span = max(end for start, end in times) - min(start for start, end in times)
+    return per_cpu, cpu_bytes * len(times) / (span / tsc_hz) / 1e9
+
+def _cpus_by_socket():
+    sockets = {}
+    for apicid in bits.cpus():
+        sockets.setdefault(bits.socket_index(apicid), []).append(apicid)
+    return [sockets[s] for s in sorted(sockets)]
+
+def test_membw():
+    sockets = _cpus_by_socket()
+    # Add CPUs to the scaling runs one socket at a time, round-robin, so
+    # that every step spreads its load across the memory controllers.
+    order = [cpu for group in map(None, *sockets) for cpu in group if cpu is not None]
+    counts = sorted(set([2**i for i in range(len(order).bit_length()) if 2**i <= len(order)] + [len(order)]))
+
+    try:
+        socket_gbps = {}
+        for kernel in KERNELS:
+            socket_gbps[kernel] = [measure(kernel, [cpus[0]])[0][0] for cpus in sockets]
+        scaling = [(n, measure("triad", order[:n])) for n in counts]
+    except MemoryError:
+        testsuite.test("Memory bandwidth buffers allocated", False)
+        return
+
+    single = socket_gbps["triad"]
+    testsuite.test("Single-CPU memory bandwidth within 20% across sockets", min(single) >= 0.8 * max(single))
+    all_gbps = scaling[-1][1][1]
+    if len(order) > 1:
+        testsuite.test("Memory bandwidth scales beyond one CPU", all_gbps > max(single))
+    min_gbps = bitsconfig.config.get("membw", "min_gbps").strip()
+    if min_gbps:
+        testsuite.test("Aggregate memory bandwidth >= {} GB/s".format(min_gbps), all_gbps >= float(min_gbps))
+
+    for kernel in KERNELS:
+        testsuite.print_detail("{:5}: single CPU per socket: {}".format(kernel, ", ".join("{:.2f} GB/s".format(gbps) for gbps in socket_gbps[kernel])))
+    for n, (per_cpu, aggregate) in scaling:
+        testsuite.print_detail("triad on {:3} CPUs: {:7.2f} GB/s aggregate, {:.2f}-{:.2f} GB/s per CPU".format(n, aggregate, min(per_cpu), max(per_cpu)))
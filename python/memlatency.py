@@ -0,0 +1,137 @@
+# Copyright (c) 2013, Intel Corporation
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+#     * Redistributions of source code must retain the above copyright notice,
+#       this list of conditions and the following disclaimer.
+#     * Redistributions in binary form must reproduce the above copyright notice,
+#       this list of conditions and the following disclaimer in the documentation
+#       and/or other materials provided with the distribution.
+#     * Neither the name of Intel Corporation nor the names of its contributors
+#       may be used to endorse or promote products derived from this software
+#       without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+# ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+# ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+"""Cache and memory latency ladder, measured by pointer chasing."""
+
+import bits
+import testsuite
+
+_KB = 1024
+_MB = 1024 * _KB
+
+def register_tests():
+    testsuite.add_test("Cache and memory latency", test_latency)
+
+def _allocate(max_size):
+    """Allocate the largest buffer of up to max_size bytes, halving on
+    failure; returns (buffer, address, size) with address aligned to 2MB."""
+    size = max_size
+    while True:
+        try:
+            mem = bits.malloc(size + 2 * _MB)
+            break
+        except MemoryError:
+            if size <= 4 * _MB:
+                raise
+            size //= 2
+    address = (bits.memory_addr(mem) + 2 * _MB - 1) & ~(2 * _MB - 1)
+    return mem, address, size
+
+def sizes(max_size):
+    """Working-set sizes from 4KB to max_size: powers of two, and the
+    midpoints between them, so that each cache boundary shows as a step."""
+    size = 4 * _KB
+    while size <= max_size:
+        yield size
+        if size + size // 2 <= max_size:
+            yield size + size // 2
+        size *= 2
+
+def ladder(max_size=None, block=None, apicid=None, loads=1 << 21):
+    """Return a list of (size, ticks per load) for working sets from 4KB to
+    max_size on the specified CPU (the BSP if None).  max_size defaults to
+    16 times the last-level cache, at least 256MB, and shrinks to what can be
+    allocated.  block, if not None, keeps the chase within each block of that
+    many bytes (such as 4096 or 2MB) before moving on, to bound TLB misses."""
+    if apicid is None:
+        apicid = bits.bsp_apicid()
+    if max_size is None:
+        llc = max([c.size for c in bits.cpuid_caches(apicid)] or [8 * _MB])
+        max_size = max(16 * llc, 256 * _MB)
+    mem, address, max_size = _allocate(max_size)
+    results = []
+    for size in sizes(max_size):
+        chase_block = size if block is None or block > size or size % block else block
+        ticks = bits.pointer_chase(address, size, loads, block=chase_block, apicid=apicid)
+        results.append((size, float(ticks) / loads))
+    del mem
+    return results
+
+def latency_at(results, size):
+    """Latency of the smallest measured working set of at least size bytes."""
+    for s, latency in results:
+        if s >= size:
+            return latency
+    return results[-1][1]
+
+def infer_levels(results, step=1.3):
+    """Infer the capacity of each level of the memory hierarchy: the largest
+    working set before each point where latency rises by more than step
+    times, counting consecutive rises as one.  Returns a list of (capacity,
+    ticks per load), ending with (None, latency) for the last level."""
+    levels = []
+    prev_size, prev_latency = results[0]
+    rising = False
+    for size, latency in results[1:]:
+        if latency > step * prev_latency:
+            if not rising:
+                levels.append((prev_size, prev_latency))
+            rising = True
+        else:
+            rising = False
+        prev_size, prev_latency = size, latency
+    levels.append((None, results[-1][1]))
+    return levels
+
+def show_size(size):
+    if size >= _MB:
+        return "{:g}MB".format(float(size) / _MB)
+    return "{:g}KB".format(float(size) / _KB)
+
+def test_latency():
+    tsc_per_ns = bits.tsc_hz() / 1e9
+    results = ladder()
+
+    # Each data or unified cache that CPUID leaf 4 reports should show as a
+    # rise in latency between half its size and four times its size.
+    caches = [c for c in bits.cpuid_caches() if c.type != "instruction"]
+    for c in caches:
+        if 4 * c.size > results[-1][0]:
+            testsuite.print_detail("Could not allocate {} to check the L{} cache".format(show_size(4 * c.size), c.level))
+            continue
+        below = latency_at(results, c.size // 2)
+        above = latency_at(results, 4 * c.size)
+        testsuite.test("L{} {} cache: latency rises beyond the size CPUID leaf 4 reports".format(c.level, show_size(c.size)), above > 1.2 * below)
+
+    levels = infer_levels(results)
+    names = ["L{}".format(c.level) for c in caches] + ["DRAM"]
+    if len(levels) == len(names):
+        for name, (capacity, latency) in zip(names, levels):
+            testsuite.print_detail("{:4}: {:>8}  {:6.1f}ns".format(name, show_size(capacity) if capacity else "", latency / tsc_per_ns))
+    else:
+        testsuite.print_detail("Inferred {} levels from the latency curve, but CPUID leaf 4 reports {} caches".format(len(levels), len(caches)))
+    for size, latency in results:
+        testsuite.print_detail("{:>8}: {:6.1f}ns  {:6.1f} TSC counts".format(show_size(size), latency / tsc_per_ns, latency))
@@ -0,0 +1,136 @@
+# Copyright (c) 2013, Intel Corporation
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+#     * Redistributions of source code must retain the above copyright notice,
+#       this list of conditions and the following disclaimer.
+#     * Redistributions in binary form must reproduce the above copyright notice,
+#       this list of conditions and the following disclaimer in the documentation
+#       and/or other materials provided with the distribution.
+#     * Neither the name of Intel Corporation nor the names of its contributors
+#       may be used to endorse or promote products derived from this software
+#       without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+# ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+# ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+"""Core-to-core latency: a cache line bounced between pairs of CPUs.
+
+Each measurement bounces one cache line between two CPUs with atomic
+exchanges, and reports the round trip in TSC counts.  The matrix of round
+trips follows the socket/core/thread structure of topology.topology(), and
+can be written as CSV to the (python) filesystem.
+"""
+
+import bits
+import bits.pyfs
+import bitsconfig
+import random
+import testsuite
+import topology
+
+def register_tests():
+    testsuite.add_test("Core-to-core cache line latency", test_pingpong)
+
+def cpu_order():
+    """Return (apicids, labels): all CPUs grouped by socket, core within the
+    socket, and thread within the core, with a label "s.c.t" of the indexes
+    of each.  Without CPUID leaf 0xb, the CPUs come in APIC ID order, each
+    labeled as its own socket."""
+    apicids = []
+    labels = []
+    try:
+        sockets = topology.topology()
+    except RuntimeError:
+        for s, apicid in enumerate(sorted(bits.cpus())):
+            apicids.append(apicid)
+            labels.append("{}.0.0".format(s))
+        return apicids, labels
+    for s, cores in enumerate(sockets.itervalues()):
+        for c, threads in enumerate(cores.itervalues()):
+            for t, apicid in enumerate(threads):
+                apicids.append(apicid)
+                labels.append("{}.{}.{}".format(s, c, t))
+    return apicids, labels
+
+def measure(apicid, other, round_trips=1000, samples=3):
+    """Return the round trip of a cache line between two CPUs in TSC counts:
+    the best of samples runs of round_trips round trips each."""
+    return min(bits.ping_pong(apicid, other, round_trips) for i in range(samples)) / float(round_trips)
+
+def matrix(apicids, max_pairs=4096, round_trips=1000, samples=3, seed=0):
+    """Measure the round trip between pairs of CPUs in apicids.  Returns a
+    symmetric matrix (list of lists) of TSC counts, indexed in the order of
+    apicids, with None on the diagonal.  With more than max_pairs pairs,
+    measures a random sample of max_pairs of them, and leaves None for the
+    rest."""
+    n = len(apicids)
+    pairs = [(i, j) for i in range(n) for j in range(i + 1, n)]
+    if max_pairs is not None and len(pairs) > max_pairs:
+        pairs = sorted(random.Random(seed).sample(pairs, max_pairs))
+    m = [[None] * n for i in range(n)]
+    for i, j in pairs:
+        m[i][j] = m[j][i] = measure(apicids[i], apicids[j], round_trips, samples)
+    return m
+
+def write_csv(filename, apicids, labels, m):
+    """Write the matrix as CSV to (python)/filename, with a header row and
+    column of "s.c.t (APIC ID)" and round trips in TSC counts.  Unmeasured
+    pairs are empty.  Replaces any earlier matrix written to filename.
+    Returns the pyfs_file."""
+    names = ["{} ({:#x})".format(label, apicid) for apicid, label in zip(apicids, labels)]
+    f = bits.pyfs.replace_file(filename)
+    f.write(",".join(["cpu"] + names) + "\n")
+    for name, row in zip(names, m):
+        f.write(",".join([name] + ["" if v is None else "{:.1f}".format(v) for v in row]) + "\n")
+    return f
+
+def _relation(a, b):
+    """Where two "s.c.t" labels share hardware."""
+    a = a.split(".")
+    b = b.split(".")
+    if a[0] != b[0]:
+        return "different sockets"
+    if a[1] != b[1]:
+        return "same socket"
+    return "same core"
+
+def test_pingpong():
+    apicids, labels = cpu_order()
+    if len(apicids) < 2:
+        return
+    try:
+        m = matrix(apicids)
+    except RuntimeError as e:
+        testsuite.test("Core-to-core round trips measured", False)
+        testsuite.print_detail(str(e))
+        return
+
+    tsc_per_ns = bits.tsc_hz() / 1e9
+    groups = {}
+    for i in range(len(apicids)):
+        for j in range(i + 1, len(apicids)):
+            if m[i][j] is not None:
+                groups.setdefault(_relation(labels[i], labels[j]), []).append((m[i][j], i, j))
+    worst, i, j = max(max(g) for g in groups.itervalues())
+    max_ns = bitsconfig.config.get("pingpong", "max_round_trip_ns").strip()
+    if max_ns:
+        testsuite.test("Core-to-core round trip <= {} ns".format(max_ns), worst / tsc_per_ns <= float(max_ns))
+
+    f = write_csv("pingpong.csv", apicids, labels, m)
+    testsuite.print_detail("Round trips in TSC counts written to {} ({} bytes)".format(f.filename, f.size))
+    for relation in ("same core", "same socket", "different sockets"):
+        if relation in groups:
+            ticks = [t for t, i, j in groups[relation]]
+            testsuite.print_detail("{:17}: {:4} pairs, round trip {:.0f}-{:.0f} ns, mean {:.0f} ns".format(relation, len(ticks), min(ticks) / tsc_per_ns, max(ticks) / tsc_per_ns, sum(ticks) / len(ticks) / tsc_per_ns))
+    testsuite.print_detail("Slowest: {} ({:#x}) to {} ({:#x}), {:.0f} ns".format(labels[i], apicids[i], labels[j], apicids[j], worst / tsc_per_ns))
@@ -28,45 +28,32 @@
 
 import bits
 from collections import namedtuple
+import struct
 import testsuite
-import time
 import usb
 
+MSR_SMI_COUNT = 0x34
+
 def register_tests():
     testsuite.add_test("SMI latency test", smi_latency);
+    testsuite.add_test("SMI latency test on all CPUs at once", smi_latency_all_cpus, runall=False);
     testsuite.add_test("SMI latency test with USB disabled via BIOS handoff", test_with_usb_disabled, runall=False);
 
-def smi_latency():
-    IA32_TSC_MSR = 0x10
-    MSR_SMI_COUNT = 0x34
-    bsp_apicid = bits.bsp_apicid()
-
-    if bits.rdmsr(bsp_apicid, IA32_TSC_MSR) is None:
-        raise RuntimeError("Reading of IA32_TSC MSR caused a GPF")
+def show_time(tscs):
+    tsc_per_sec = float(bits.tsc_hz())
+    units = [(1000*1000*1000, "ns"), (1000*1000, "us"), (1000, "ms")]
+    for divisor, unit in units:
+        temp = tscs / (tsc_per_sec / divisor)
+        if temp < 10000:
+            return "{}{}".format(int(temp), unit)
+    return "{}s".format(int(tscs / tsc_per_sec))
 
+def smi_latency():
     print "Warning: touching the keyboard can affect the results of this test."
-    print "Starting pass #1.  Calibrating the TSC."
-
-    start = time.time()
-    tsc1 = bits.rdmsr(bsp_apicid, IA32_TSC_MSR)
 
-    while time.time() - start < 1:
-        pass
-
-    stop = time.time()
-    tsc2 = bits.rdmsr(bsp_apicid, IA32_TSC_MSR)
-
-    tsc_per_sec = (tsc2 - tsc1) / (stop - start)
+    tsc_per_sec = float(bits.tsc_hz())
     tsc_per_usec = tsc_per_sec / (1000*1000)
 
-    def show_time(tscs):
-        units = [(1000*1000*1000, "ns"), (1000*1000, "us"), (1000, "ms")]
-        for divisor, unit in units:
-            temp = tscs / (tsc_per_sec / divisor)
-            if temp < 10000:
-                return "{}{}".format(int(temp), unit)
-        return "{}s".format(int(tscs / tsc_per_sec))
-
     bins = [long(tsc_per_usec * 10**i) for i in range(9)]
     bin_descs = [
         "0     < t <=   1us",
@@ -81,7 +68,7 @@ def smi_latency():
         "100s  < t         ",
     ]
 
-    print "Starting pass #2.  Wait here, I will be back in 15 seconds."
+    print "Wait here, I will be back in 15 seconds."
     (max_latency, smi_count_delta, bins) = bits.smi_latency(long(15 * tsc_per_sec), bins)
     BinType = namedtuple('BinType', ("max", "total", "count", "times"))
     bins = [BinType(*b) for b in bins]
@@ -102,6 +89,61 @@ def smi_latency():
 
     testsuite.print_detail("Summary of impact: observed maximum latency = {}".format(show_time(max_latency)))
 
+def _ring_gaps(events, ring):
+    """Unpack a ring from smi_latency_all into a list of (tsc, gap), oldest first."""
+    size = len(ring) // 16
+    values = struct.unpack_from("<{}Q".format(2 * size), ring)
+    gaps = zip(values[0::2], values[1::2])
+    if events <= size:
+        return gaps[:events]
+    oldest = events % size
+    return gaps[oldest:] + gaps[:oldest]
+
+def smi_latency_all_cpus():
+    print "Warning: touching the keyboard can affect the results of this test."
+
+    tsc_per_sec = float(bits.tsc_hz())
+    tsc_per_usec = tsc_per_sec / (1000*1000)
+    threshold = long(10 * tsc_per_usec)
+
+    print "Wait here, I will be back in 15 seconds."
+    results = bits.smi_latency_all(long(15 * tsc_per_sec), threshold)
+    cpus = bits.cpus()
+    max_latency = max(r[0] for r in results)
+
+    testsuite.test("SMI latency < 150us on all CPUs to minimize risk of OS timeouts", max_latency / tsc_per_usec <= 150)
+    if not testsuite.show_detail():
+        return
+
+    # Merge the stalls seen by every CPU, by the TSC interval each one covers,
+    # to tell SMIs that stopped every CPU from those that stopped only some.
+    stalls = []
+    histogram = [0] * 64
+    for apicid, (cpu_max, smi_count_delta, events, buckets, ring) in zip(cpus, results):
+        counts = struct.unpack_from("<128Q", buckets)[0::2]
+        histogram = [a + b for a, b in zip(histogram, counts)]
+        gaps = _ring_gaps(events, ring)
+        stalls.extend((tsc - gap, tsc, apicid) for tsc, gap in gaps)
+        smi_desc = "MSR_SMI_COUNT unreadable" if smi_count_delta is None else "{} SMI".format(smi_count_delta)
+        lost = " ({} not recorded)".format(events - len(gaps)) if events > len(gaps) else ""
+        testsuite.print_detail("APIC ID {:#x}: max latency = {}; {}; {} gaps > {}{}".format(apicid, show_time(cpu_max), smi_desc, events, show_time(threshold), lost))
+
+    for i, count in enumerate(histogram):
+        if count:
+            testsuite.print_detail("{:>6} <= t < {:>6}: count = {}".format(show_time(2**i), show_time(2**(i+1)), count))
+
+    groups = []
+    for start, end, apicid in sorted(stalls):
+        if groups and start <= groups[-1][1]:
+            groups[-1][1] = max(groups[-1][1], end)
+            groups[-1][2].add(apicid)
+        else:
+            groups.append([start, end, set([apicid])])
+    all_cpus = sum(1 for g in groups if len(g[2]) == len(cpus))
+    testsuite.print_detail("{} stalls > {}: {} stopped all {} CPUs at once, {} stopped only some".format(len(groups), show_time(threshold), all_cpus, len(cpus), len(groups) - all_cpus))
+
+    testsuite.print_detail("Summary of impact: observed maximum latency = {}".format(show_time(max_latency)))
+
 def test_with_usb_disabled():
     if usb.handoff_to_os():
         smi_latency()
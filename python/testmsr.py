@@ -49,33 +49,23 @@ def MSR(name, apicid, msr, highbit=63, lowbit=0):
 
 def msr_available(msr):
     """Return True if the specified MSR exists on all CPUs"""
-    return all(bits.rdmsr(cpu_num, msr) is not None for cpu_num in bits.cpus())
+    return None not in bits.rdmsr_all(msr)
 
 def rdmsr_consistent(msr_blacklist=set(), msr_masklist=dict()):
     """Rdmsr for all CPU and verify consistent value"""
 
-    cpulist = sorted(bits.cpus())
-    for r in [range(0, 0x1000), range(0xC0000000, 0xC0001000)]:
-        for msr in r:
-            if msr in msr_blacklist:
-                continue
-            mask = msr_masklist.get(msr, ~0)
-            uniques = {}
-            for cpu in cpulist:
-                value = bits.rdmsr(cpu, msr)
-                if value is not None:
-                    value &= mask
-                uniques.setdefault(value, []).append(cpu)
-            testsuite.test("MSR 0x{0:x} consistent".format(msr), len(uniques) == 1)
-            # Avoid doing any extra work formatting output when not necessary
-            if testsuite.show_detail():
-                testsuite.print_detail("{0} unique values".format(len(uniques)))
-                for value, cpus in uniques.iteritems():
-                    testsuite.print_detail("{0} CPUs: {1}".format(len(cpus), ",".join(str(c) for c in cpus)))
-                    if value is None:
-                        testsuite.print_detail("MSR 0x{0:x}: GPF".format(msr))
-                    else:
-                        testsuite.print_detail("MSR 0x{0:x}: 0x{1:x}".format(msr, value))
+    ranges = [(0, 0x1000), (0xC0000000, 0xC0001000)]
+    for msr, uniques in bits.msr_sweep(ranges, msr_blacklist, msr_masklist):
+        testsuite.test("MSR 0x{0:x} consistent".format(msr), len(uniques) == 1)
+        # Avoid doing any extra work formatting output when not necessary
+        if testsuite.show_detail():
+            testsuite.print_detail("{0} unique values".format(len(uniques)))
+            for value, cpus in uniques:
+                testsuite.print_detail("{0} CPUs: {1}".format(len(cpus), ",".join(str(c) for c in sorted(cpus))))
+                if value is None:
+                    testsuite.print_detail("MSR 0x{0:x}: GPF".format(msr))
+                else:
+                    testsuite.print_detail("MSR 0x{0:x}: 0x{1:x}".format(msr, value))
 
 def rdmsr_helper(msr, cpu=None, shift=0, mask=~0, highbit=63, lowbit=0):
     """Collate the unique values of an MSR across all CPUs.
@@ -89,13 +79,12 @@ def rdmsr_helper(msr, cpu=None, shift=0, mask=~0, highbit=63, lowbit=0):
         raise ValueError('Input parameter usage is limited to \"highbit and lowbit\" OR \"shift and mask\".')
 
     if cpu is None:
-        cpus = bits.cpus()
+        cpu_values = zip(bits.cpus(), bits.rdmsr_all(msr))
     else:
-        cpus = [cpu]
+        cpu_values = [(cpu, bits.rdmsr(cpu, msr))]
 
     uniques = {}
-    for cpu in cpus:
-        value = bits.rdmsr(cpu, msr)
+    for cpu, value in cpu_values:
         if value is not None:
             if highbit != 63 or lowbit != 0:
                 value = (value & ((1 << (highbit + 1)) - 1)) >> lowbit
@@ -30,7 +30,6 @@ import bits
 import os
 import pci
 import sys
-import time
 
 CLASSC_UHCI = 0x0c0300
 CLASSC_OHCI = 0x0c0310
@@ -63,21 +62,23 @@ def do_ehci_handoff(bus, dev, fun, warntime=1, failtime=5, to_os=True):
     count = MAX_HOST_CONTROLLERS = 64
     while eecp and count:
         extcap = bits.pci_read(bus, dev, fun, eecp, bytes=4)
+        failed = False
+        duration = 0
         if extcap & EHCI_EXTCAP_HANDOFF:
-            starttime = time.time()
-            bits.pci_write(bus, dev, fun, eecp + 3, os_desired, bytes=1)
-            while True:
-                bios_semaphore = bits.pci_read(bus, dev, fun, eecp + 2, bytes=1)
-                duration = time.time() - starttime
-                if bios_semaphore == bios_desired:
-                    break
-                if duration > failtime:
-                    ret = False
-                    break
-        if duration > failtime:
-            print "FAIL: USB host controller at PCI {bus:#04x}:{dev:#04x}.{fun:#03x} offset {eecp:#x} failed to hand off {handoff_desc} within {failtime}s (took {duration:0.3f}s)".format(**locals())
+            # Write the OS semaphore and time the BIOS semaphore in one
+            # dispatch; the capability is dword aligned, so both bytes share
+            # the configuration address the poll selects.
+            tsc_hz = bits.tsc_hz()
+            request = bits.regprog_op("out", bits.PCI_DATA_PORT + 3, 1, value=os_desired)
+            elapsed, bios_semaphore = bits.pci_poll(bus, dev, fun, eecp + 2, 0xff, bios_desired, long(failtime * tsc_hz), bytes=1, setup=request)
+            duration = elapsed / float(tsc_hz)
+            failed = bios_semaphore != bios_desired
+            if failed:
+                ret = False
+        if failed:
+            print "FAIL: USB host controller at PCI {bus:#04x}:{dev:#04x}.{fun:#03x} offset {eecp:#x} failed to hand off {handoff_desc} within {failtime}s (took {duration:0.6f}s)".format(**locals())
         elif duration > warntime:
-            print "WARNING: USB host controller at PCI {bus:#04x}:{dev:#04x}.{fun:#03x} offset {eecp:#x} failed to hand off {handoff_desc} within {warntime}s (took {duration:0.3f}s)".format(**locals())
+            print "WARNING: USB host controller at PCI {bus:#04x}:{dev:#04x}.{fun:#03x} offset {eecp:#x} failed to hand off {handoff_desc} within {warntime}s (took {duration:0.6f}s)".format(**locals())
         eecp = (extcap >> 8) & 0xff;
         count -= 1
     if eecp:
@@ -32,13 +32,30 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "datatype.h"
 #include "smprc.h"
 
-/* smp_init returns the number of CPUs, or 0 on error. */
+/* smp_init returns the number of CPUs, or 0 on error.
+ *
+ * The per-CPU stack and arena sizes default to SMP_DEFAULT_STACK_SIZE and
+ * SMP_DEFAULT_ARENA_SIZE, overridden by the smp_stack_size and smp_arena_size
+ * environment variables when the first smp_start or smp_init runs.  Values
+ * below the defaults, above 64KB of stack or 1MB of arena, or not a number
+ * are ignored.
+ */
 U32 smp_init(void);
 
+/* smp_start begins waking the APs in the background; the next smp_init waits
+ * for them.  Returns false on error. */
+bool smp_start(void);
+
 /* smp_phantom_init is required after any module uses an init-sipi-sipi sequence */
 void smp_phantom_init(void);
 
 U32 smp_read_bclk(void);
+U64 smp_read_tsc_hz(void);
+
+bool smp_read_startup_timing(SMP_STARTUP_TIMING *timing);
+
+void *smp_arena_alloc(unsigned long size);
+void smp_arena_reset_by_index(U32 index);
 
 /* Returns the internal array of CPU_INFO structures, or NULL on error.
  *
@@ -48,11 +65,34 @@ U32 smp_read_bclk(void);
 const CPU_INFO *smp_read_cpu_list(void);
 
 U32 smp_function(U32 apicid, CALLBACK function, void *param);
+U32 smp_function_by_index(U32 index, CALLBACK function, void *param);
+U32 smp_function_mask(const U32 *mask, CALLBACK function, void *param);
+U32 smp_function_all(CALLBACK function, void *param);
+
+bool smp_queue(U32 apicid, CALLBACK function, void *param, SMP_HANDLE *handle);
+bool smp_doorbell(U32 apicid);
+bool smp_function_async(U32 apicid, CALLBACK function, void *param, SMP_HANDLE *handle);
+bool smp_queue_by_index(U32 index, CALLBACK function, void *param, SMP_HANDLE *handle);
+bool smp_doorbell_by_index(U32 index);
+bool smp_function_async_by_index(U32 index, CALLBACK function, void *param, SMP_HANDLE *handle);
+bool smp_poll(const SMP_HANDLE *handle);
+void smp_wait(const SMP_HANDLE *handle);
+U32 smp_wait_any(const SMP_HANDLE *handles, U32 count);
+
+bool smp_read_cpu_index(U32 *index);
+bool smp_lookup_cpu_index(U32 apicid, U32 *index);
+
+unsigned long smp_barrier_size(void);
+SMP_BARRIER *smp_barrier_init(void *barrier_memory, const U32 *mask, U64 release_ticks);
+bool smp_barrier_wait(SMP_BARRIER *barrier);
+
+bool smp_read_dispatch_stats(U32 index, SMP_DISPATCH_STATS *stats);
+void smp_reset_dispatch_stats(void);
 
-bool smp_get_mwait(U32 apicid, bool *use_mwait, U32 *mwait_hint, U32 *int_break_event);
-void smp_set_mwait(U32 apicid, bool use_mwait, U32 mwait_hint, U32 int_break_event);
+bool smp_get_mwait(U32 apicid, bool *use_mwait, U32 *mwait_hint, U32 *int_break_event, U32 *spin_ticks);
+void smp_set_mwait(U32 apicid, bool use_mwait, U32 mwait_hint, U32 int_break_event, U32 spin_ticks);
 
 /* Sleep for the specified number of microseconds. */
-void smp_sleep(U32 microseconds);
+U64 smp_sleep(U32 microseconds);
 
 #endif // smp_h
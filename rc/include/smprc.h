@@ -39,22 +39,52 @@ typedef struct cpu_info {
 
 typedef void (*CALLBACK)(void *);
 
+/* Returns the number of enabled processors listed in the MADT, or 0 if it
+ * cannot be read. */
+U32 smp_madt_processor_count(void);
+
+/* Each CPU gets a stack of stack_size bytes for running callbacks, and a
+ * scratch arena of arena_size bytes; both are rounded up to
+ * SMP_WORKING_MEMORY_ALIGN. */
+#define SMP_DEFAULT_STACK_SIZE 2048
+#define SMP_DEFAULT_ARENA_SIZE 16384
+
+/* Sizes of the working memory and reserved MWAIT memory needed to manage up
+ * to max_cpus CPUs.  The working memory must be zeroed before the first call
+ * to smp_init_with_memory. */
+unsigned long smp_working_memory_size(U32 max_cpus, U32 stack_size, U32 arena_size);
+unsigned long smp_reserved_memory_size(U32 max_cpus);
+
 /* smp_init_with_memory returns the number of CPUs, or 0 on error. */
-U32 smp_init_with_memory(void *working_memory, void *page_below_1M, void *reserved_mwait_memory);
+U32 smp_init_with_memory(void *working_memory, U32 max_cpus, U32 stack_size, U32 arena_size, void *page_below_1M, void *reserved_mwait_memory);
+
+/* Start waking the APs and return without waiting for them to check in.  A
+ * later call to smp_init_with_memory, with the same arguments, waits for them
+ * and finishes initialization.  Returns false on error. */
+bool smp_start_with_memory(void *working_memory, U32 max_cpus, U32 stack_size, U32 arena_size, void *page_below_1M, void *reserved_mwait_memory);
 
-#define SMP_MAX_LOGICAL_CPU 384
 #define SMP_MWAIT_ALIGN 64
-#define SMP_WORKING_MEMORY_SIZE (810*1024)
 #define SMP_WORKING_MEMORY_ALIGN 16
 #define SMP_LOW_MEMORY_SIZE 4096
 #define SMP_LOW_MEMORY_ALIGN 4096
-#define SMP_RESERVED_MEMORY_SIZE (SMP_MAX_LOGICAL_CPU*SMP_MWAIT_ALIGN + 512)
+#define SMP_RESERVED_CODE_SIZE 512
 #define SMP_RESERVED_MEMORY_ALIGN SMP_MWAIT_ALIGN
 
 /* smp_phantom_init_with_memory is required after any module uses an init-sipi-sipi sequence */
 void smp_phantom_init_with_memory(void *working_memory);
 
 U32 smp_read_bclk_with_memory(void *working_memory);
+/* TSC frequency in Hz, calibrated once at startup. */
+U64 smp_read_tsc_hz_with_memory(void *working_memory);
+
+/* Time spent in each phase of AP startup, in TSC ticks. */
+typedef struct smp_startup_timing {
+    U64 init_ticks;
+    U64 sipi_ticks;
+    U64 checkin_ticks;
+} SMP_STARTUP_TIMING;
+
+bool smp_read_startup_timing_with_memory(void *working_memory, SMP_STARTUP_TIMING *timing);
 
 /* Returns the internal array of CPU_INFO structures, or NULL on error.
  *
@@ -65,10 +95,118 @@ const CPU_INFO *smp_read_cpu_list_with_memory(void *working_memory);
 
 U32 smp_function_with_memory(void *working_memory, U32 apicid, CALLBACK function, void *param);
 
-bool smp_get_mwait_with_memory(void *working_memory, U32 apicid, bool *use_mwait, U32 *mwait_hint, U32 *int_break_event);
-void smp_set_mwait_with_memory(void *working_memory, U32 apicid, bool use_mwait, U32 mwait_hint, U32 int_break_event);
-
-void smp_sleep_with_memory(void *working_memory, U32 microseconds);
+/* The _by_index variants of the dispatch functions take the position of the
+ * CPU in the list returned by smp_read_cpu_list instead of its APIC ID, for
+ * callers that already know it. */
+U32 smp_function_by_index_with_memory(void *working_memory, U32 index, CALLBACK function, void *param);
+
+/* CPU masks are bitmaps of U32 words, indexed by the position of each CPU in
+ * the list returned by smp_read_cpu_list. */
+#define SMP_MASK_WORDS(ncpus) (((ncpus) + 31) / 32)
+#define SMP_MASK_SET(mask, index) ((mask)[(index) / 32] |= 1U << ((index) % 32))
+#define SMP_MASK_TEST(mask, index) (((mask)[(index) / 32] >> ((index) % 32)) & 1)
+
+/* Run function(param) concurrently on every CPU selected in mask (or on all
+ * CPUs if mask is NULL), including the BSP if selected, and return once all
+ * of them have finished.  Returns the number of CPUs that ran the function,
+ * or 0 on error. */
+U32 smp_function_mask_with_memory(void *working_memory, const U32 *mask, CALLBACK function, void *param);
+U32 smp_function_all_with_memory(void *working_memory, CALLBACK function, void *param);
+
+/* Identifies a call started by smp_queue or smp_function_async. */
+typedef struct smp_handle {
+    U32 processor_id;
+    U32 sequence;
+} SMP_HANDLE;
+
+/* Append function(param) to the specified CPU's command ring without waking
+ * it; smp_doorbell wakes it to run everything queued so far, in order.  If
+ * the ring is full, this wakes the CPU and waits for room.  A call targeting
+ * the BSP runs to completion before this returns.  handle may be NULL.
+ * Returns false if the CPU does not exist. */
+bool smp_queue_with_memory(void *working_memory, U32 apicid, CALLBACK function, void *param, SMP_HANDLE *handle);
+bool smp_doorbell_with_memory(void *working_memory, U32 apicid);
+bool smp_queue_by_index_with_memory(void *working_memory, U32 index, CALLBACK function, void *param, SMP_HANDLE *handle);
+bool smp_doorbell_by_index_with_memory(void *working_memory, U32 index);
+
+/* Start function(param) on the specified CPU and return without waiting for
+ * it to finish; the same as smp_queue followed by smp_doorbell. */
+bool smp_function_async_with_memory(void *working_memory, U32 apicid, CALLBACK function, void *param, SMP_HANDLE *handle);
+bool smp_function_async_by_index_with_memory(void *working_memory, U32 index, CALLBACK function, void *param, SMP_HANDLE *handle);
+
+/* Returns true if the call identified by handle has finished. */
+bool smp_poll_with_memory(void *working_memory, const SMP_HANDLE *handle);
+
+/* Wait for the call identified by handle to finish. */
+void smp_wait_with_memory(void *working_memory, const SMP_HANDLE *handle);
+
+/* Wait for any of count calls to finish, and return the index in handles of
+ * one that has finished, or count on error. */
+U32 smp_wait_any_with_memory(void *working_memory, const SMP_HANDLE *handles, U32 count);
+
+/* Look up the index of the calling CPU in the CPU list; callbacks run by
+ * smp_function_mask can use this to find their slot in a per-CPU array. */
+bool smp_read_cpu_index_with_memory(void *working_memory, U32 *index);
+
+/* Look up the index in the CPU list of the CPU with the specified APIC ID;
+ * returns false if there is no such CPU. */
+bool smp_lookup_cpu_index_with_memory(void *working_memory, U32 apicid, U32 *index);
+
+/* Barrier across the CPUs selected by mask (all CPUs if NULL), for use by
+ * callbacks started with smp_function_mask or smp_function_all.  CPUs meet in
+ * a thread->core->socket tree built from the APIC ID topology, each spinning
+ * on its own cache line.  If release_ticks is nonzero, the last CPU to arrive
+ * sets a release time that many TSC ticks in the future, and every CPU leaves
+ * at that time; make it longer than the release takes to reach every CPU to
+ * bound the skew between them.  The memory must be smp_barrier_size bytes,
+ * aligned to SMP_MWAIT_ALIGN; one barrier can be waited on repeatedly. */
+typedef struct smp_barrier SMP_BARRIER;
+unsigned long smp_barrier_size_with_memory(void *working_memory);
+SMP_BARRIER *smp_barrier_init_with_memory(void *working_memory, void *barrier_memory, const U32 *mask, U64 release_ticks);
+bool smp_barrier_wait_with_memory(void *working_memory, SMP_BARRIER *barrier);
+
+/* Bump allocator over the calling CPU's scratch arena, for callbacks that
+ * produce variable-length results without asking the BSP to size and allocate
+ * them first.  Allocations are aligned to SMP_WORKING_MEMORY_ALIGN and stay
+ * valid until the arena is reset; returns NULL when the arena is full. */
+void *smp_arena_alloc_with_memory(void *working_memory, unsigned long size);
+/* Free everything allocated from the arena of the CPU at index in the CPU
+ * list, once its results have been consumed.  That CPU must be idle. */
+void smp_arena_reset_by_index_with_memory(void *working_memory, U32 index);
+
+/* Dispatch latency statistics, in TSC ticks, kept for each CPU.  Bucket i of
+ * each histogram counts samples with floor(log2(ticks)) == i; the last bucket
+ * also counts everything longer. */
+#define SMP_STATS_BUCKETS 32
+
+typedef struct smp_stage_stats {
+    U64 count;
+    U64 total;
+    U64 max;
+    U32 histogram[SMP_STATS_BUCKETS];
+} SMP_STAGE_STATS;
+
+typedef struct smp_dispatch_stats {
+    SMP_STAGE_STATS wake;     /* BSP rings the doorbell -> AP leaves wait_for_control */
+    SMP_STAGE_STATS start;    /* BSP queues a command -> AP enters the callback */
+    SMP_STAGE_STATS run;      /* callback duration */
+    SMP_STAGE_STATS handback; /* AP finishes -> BSP sees it finished, in smp_wait */
+    U64 spin_wakes;           /* waits for dispatched work satisfied within the spin budget */
+    U64 mwait_wakes;          /* waits for dispatched work that fell back to MWAIT */
+} SMP_DISPATCH_STATS;
+
+/* Copy the statistics for the CPU at index in the CPU list; returns false on error. */
+bool smp_read_dispatch_stats_with_memory(void *working_memory, U32 index, SMP_DISPATCH_STATS *stats);
+void smp_reset_dispatch_stats_with_memory(void *working_memory);
+
+/* With use_mwait, a CPU waiting for work spins for up to spin_ticks TSC counts
+ * before entering MWAIT with mwait_hint. */
+bool smp_get_mwait_with_memory(void *working_memory, U32 apicid, bool *use_mwait, U32 *mwait_hint, U32 *int_break_event, U32 *spin_ticks);
+void smp_set_mwait_with_memory(void *working_memory, U32 apicid, bool use_mwait, U32 mwait_hint, U32 int_break_event, U32 spin_ticks);
+
+/* Sleep the calling CPU, using the TSC-deadline timer where supported.
+ * Returns the TSC ticks slept, or 0 on error. */
+U64 smp_sleep_with_memory(void *working_memory, U32 microseconds);
 
 void cpuid32(U32 func, U32 * eax, U32 * ebx, U32 * ecx, U32 * edx);
 void cpuid32_indexed(U32 func, U32 index, U32 * eax, U32 * ebx, U32 * ecx, U32 * edx);
@@ -77,4 +215,8 @@ void rdmsr64(U32 msr, U64 * data_addr, U32 * status);
 U64 rdtsc64(void);
 void wrmsr64(U32 msr, U64 data, U32 * status);
 
+/* Index of the highest set bit in value, i.e. floor(log2(value)), or 0 if
+ * value is 0. */
+U32 bsr64(U64 value);
+
 #endif /* smprc_h */
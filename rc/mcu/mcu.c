@@ -544,8 +544,8 @@ static grub_err_t WriteUpdatesToCpus(int action, const BUFFER_INFO * const buf_i
         update_opt.update_info = &update_info;
         update_opt.action = action;
         update_opt.revision_check = RevisionCheckEnable;
-        smp_function(cpu[i].apicid, updateCpuCallBack, &update_opt);
-        smp_function(cpu[i].apicid, GetProcInfoCallBack, &new_proc_info);
+        smp_function_by_index(i, updateCpuCallBack, &update_opt);
+        smp_function_by_index(i, GetProcInfoCallBack, &new_proc_info);
 
         if (proc_info.ucode_rev != new_proc_info.ucode_rev)
             replaced++;
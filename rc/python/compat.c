@@ -100,6 +100,25 @@ int atoi(const char *str)
     return grub_strtol(str, NULL, 10);
 }
 
+void *bsearch(const void *key, const void *base_void, size_t nmemb, size_t size, int(*compar)(const void *, const void *))
+{
+    const char *base = base_void;
+    size_t lo = 0, hi = nmemb, mid;
+    int c;
+    grub_errno = GRUB_ERR_NONE;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        c = compar(key, base + mid*size);
+        if (c == 0)
+            return (void *)(base + mid*size);
+        if (c < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return NULL;
+}
+
 void clearerr(FILE *stream)
 {
     (void)stream;
@@ -482,6 +501,9 @@ void qsort(void *base_void, size_t nmemb, size_t size, int(*compar)(const void *
     grub_errno = GRUB_ERR_NONE;
     if (nmemb <= 1)
         return;
+    /* Pivot on the middle element, so that sorted input does not recurse
+     * nmemb deep. */
+    qsort_swap_mem(base, base + (nmemb / 2)*size, size);
     for (i = 1; i < nmemb; i++)
         if (compar(base + i*size, base) < 0)
             qsort_swap_mem(base + (++last)*size, base + i*size, size);
@@ -135,6 +135,7 @@ void _assert(const char *filename, unsigned line, int condition, const char *con
 #define assert(x) _assert(__FILE__, __LINE__, !!(x), #x)
 
 int atoi(const char *str);
+void *bsearch(const void *key, const void *base_void, size_t nmemb, size_t size, int(*compar)(const void *, const void *));
 void clearerr(FILE *stream);
 __attribute__((noreturn)) void exit(int status);
 int fclose(FILE *stream);
@@ -47,6 +47,70 @@ struct memop {
     U64 value;
 };
 
+/* Bulk calls can return their results as Python objects, or as read-only
+ * buffers of little-endian fixed-width fields that share the memory the CPUs
+ * wrote them to: one buffer of structures ("aos"), or one buffer per field
+ * ("soa"). */
+enum result_layout {
+    LAYOUT_OBJECTS,
+    LAYOUT_AOS,
+    LAYOUT_SOA,
+};
+
+/* "O&" converter for a layout argument of None, "aos", or "soa". */
+static int parse_layout(PyObject *obj, void *result)
+{
+    enum result_layout *layout = result;
+    const char *name;
+
+    if (obj == Py_None) {
+        *layout = LAYOUT_OBJECTS;
+        return 1;
+    }
+    name = PyString_AsString(obj);
+    if (!name)
+        return 0;
+    if (!strcmp(name, "aos"))
+        *layout = LAYOUT_AOS;
+    else if (!strcmp(name, "soa"))
+        *layout = LAYOUT_SOA;
+    else {
+        PyErr_Format(PyExc_ValueError, "layout must be None, \"aos\", or \"soa\"");
+        return 0;
+    }
+    return 1;
+}
+
+/* New buffer object of size bytes, zeroed; *data points at its contents. */
+static PyObject *new_result_buffer(Py_ssize_t size, void **data)
+{
+    PyObject *buffer;
+    Py_ssize_t len;
+
+    buffer = PyBuffer_New(size);
+    if (!buffer)
+        return NULL;
+    if (PyObject_AsWriteBuffer(buffer, data, &len) < 0) {
+        Py_DECREF(buffer);
+        return NULL;
+    }
+    memset(*data, 0, len);
+    return buffer;
+}
+
+/* Read-only view of buffer sharing its memory; steals the reference to
+ * buffer, and passes through NULL. */
+static PyObject *read_only_buffer(PyObject *buffer)
+{
+    PyObject *view;
+
+    if (!buffer)
+        return NULL;
+    view = PyBuffer_FromObject(buffer, 0, Py_END_OF_BUFFER);
+    Py_DECREF(buffer);
+    return view;
+}
+
 static PyObject *bits_bclk(PyObject *self, PyObject *args)
 {
     if (!smp_init())
@@ -54,30 +118,123 @@ static PyObject *bits_bclk(PyObject *self, PyObject *args)
     return Py_BuildValue("I", smp_read_bclk());
 }
 
+static PyObject *bits_tsc_hz(PyObject *self, PyObject *args)
+{
+    if (!smp_init())
+        return PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
+    return Py_BuildValue("K", smp_read_tsc_hz());
+}
+
+static PyObject *bits_rdtsc(PyObject *self, PyObject *args)
+{
+    return Py_BuildValue("K", rdtsc64());
+}
+
+static PyObject *bits_start(PyObject *self, PyObject *args)
+{
+    return PyBool_FromLong(smp_start());
+}
+
+static PyObject *bits_startup_timing(PyObject *self, PyObject *args)
+{
+    SMP_STARTUP_TIMING timing;
+
+    if (!smp_init() || !smp_read_startup_timing(&timing))
+        return PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
+    return Py_BuildValue("KKK", timing.init_ticks, timing.sipi_ticks, timing.checkin_ticks);
+}
+
+static PyObject *stage_stats(const SMP_STAGE_STATS *stage)
+{
+    U32 i;
+    PyObject *histogram;
+
+    histogram = PyList_New(SMP_STATS_BUCKETS);
+    if (!histogram)
+        return NULL;
+    for (i = 0; i < SMP_STATS_BUCKETS; i++)
+        PyList_SET_ITEM(histogram, i, PyInt_FromLong(stage->histogram[i]));
+    return Py_BuildValue("KKKN", stage->count, stage->total, stage->max, histogram);
+}
+
+static PyObject *bits_dispatch_stats(PyObject *self, PyObject *args)
+{
+    U32 ncpus, i;
+    SMP_DISPATCH_STATS stats;
+    PyObject *list;
+
+    ncpus = smp_init();
+    if (!ncpus)
+        return PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
+
+    list = PyList_New(ncpus);
+    if (!list)
+        return NULL;
+    for (i = 0; i < ncpus; i++) {
+        PyObject *d;
+        if (!smp_read_dispatch_stats(i, &stats)) {
+            Py_DECREF(list);
+            return PyErr_Format(PyExc_RuntimeError, "Failed to read dispatch statistics for CPU %u", i);
+        }
+        d = Py_BuildValue("{sNsNsNsNsKsK}",
+                          "wake", stage_stats(&stats.wake),
+                          "start", stage_stats(&stats.start),
+                          "run", stage_stats(&stats.run),
+                          "handback", stage_stats(&stats.handback),
+                          "spin_wakes", stats.spin_wakes,
+                          "mwait_wakes", stats.mwait_wakes);
+        if (!d) {
+            Py_DECREF(list);
+            return NULL;
+        }
+        PyList_SET_ITEM(list, i, d);
+    }
+    return list;
+}
+
+static PyObject *bits_reset_dispatch_stats(PyObject *self, PyObject *args)
+{
+    if (!smp_init())
+        return PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
+    smp_reset_dispatch_stats();
+    return Py_BuildValue("");
+}
+
 static U32 bsp_apicid(void) {
     const CPU_INFO *cpu;
     cpu = smp_read_cpu_list();
     return cpu[0].apicid;
 }
 
+struct sleep {
+    U32 usec;
+    U64 ticks;
+};
+
 static void blocking_sleep_callback(void *param)
 {
-    U32 *usec = param;
-    smp_sleep(*usec);
+    struct sleep *s = param;
+    s->ticks = smp_sleep(s->usec);
 }
 
-static PyObject *bits_blocking_sleep(PyObject *self, PyObject *args)
-{
-    U32 usec;
+static char *blocking_sleep_keywords[] = {"usec", "apicid", NULL};
 
-    if (!PyArg_ParseTuple(args, "I", &usec))
-        return NULL;
+static PyObject *bits_blocking_sleep(PyObject *self, PyObject *args, PyObject *keywds)
+{
+    struct sleep s;
+    unsigned apicid;
 
     if (!smp_init())
         return PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
+    apicid = bsp_apicid();
 
-    smp_function(smp_read_cpu_list()[0].apicid, blocking_sleep_callback, &usec);
-    return Py_BuildValue("");
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "I|I", blocking_sleep_keywords, &s.usec, &apicid))
+        return NULL;
+
+    s.ticks = 0;
+    if (!smp_function(apicid, blocking_sleep_callback, &s))
+        return PyErr_Format(PyExc_RuntimeError, "Failed to sleep on apicid %u", apicid);
+    return Py_BuildValue("K", s.ticks);
 }
 
 static void cpuid_callback(void *param)
@@ -110,6 +267,384 @@ static PyObject *bits_cpuid(PyObject *self, PyObject *args)
     return Py_BuildValue("IIII", regs.eax, regs.ebx, regs.ecx, regs.edx);
 }
 
+/* Runs on every CPU; param points to an array of struct dword_regs indexed by
+ * CPU index. */
+static void cpuid_all_callback(void *param)
+{
+    struct dword_regs *regs = param;
+    U32 index;
+    if (smp_read_cpu_index(&index))
+        cpuid_callback(&regs[index]);
+}
+
+static char *cpuid_all_keywords[] = {"eax", "ecx", "layout", NULL};
+
+static PyObject *bits_cpuid_all(PyObject *self, PyObject *args, PyObject *keywds)
+{
+    U32 eax, ecx = 0;
+    U32 ncpus;
+    U32 i;
+    enum result_layout layout = LAYOUT_OBJECTS;
+    struct dword_regs *regs;
+    PyObject *result = NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "I|IO&:_cpuid_all", cpuid_all_keywords, &eax, &ecx, parse_layout, &layout))
+        return NULL;
+
+    ncpus = smp_init();
+    if (!ncpus)
+        return PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
+
+    if (layout == LAYOUT_AOS) {
+        result = new_result_buffer(ncpus * sizeof(*regs), (void **)&regs);
+        if (!result)
+            return NULL;
+    } else {
+        regs = grub_malloc(ncpus * sizeof(*regs));
+        if (!regs)
+            return PyErr_NoMemory();
+    }
+    for (i = 0; i < ncpus; i++) {
+        regs[i].eax = eax;
+        regs[i].ecx = ecx;
+    }
+
+    if (!smp_function_all(cpuid_all_callback, regs)) {
+        if (result)
+            Py_DECREF(result);
+        else
+            grub_free(regs);
+        return PyErr_Format(PyExc_RuntimeError, "SMP function returned an error");
+    }
+    if (layout == LAYOUT_AOS)
+        return read_only_buffer(result);
+
+    if (layout == LAYOUT_SOA) {
+        PyObject *column[4];
+        U32 *data[4];
+        U32 j;
+        for (j = 0; j < 4; j++)
+            column[j] = new_result_buffer(ncpus * sizeof(U32), (void **)&data[j]);
+        if (column[0] && column[1] && column[2] && column[3]) {
+            for (i = 0; i < ncpus; i++) {
+                data[0][i] = regs[i].eax;
+                data[1][i] = regs[i].ebx;
+                data[2][i] = regs[i].ecx;
+                data[3][i] = regs[i].edx;
+            }
+            for (j = 0; j < 4; j++)
+                column[j] = read_only_buffer(column[j]);
+        }
+        if (column[0] && column[1] && column[2] && column[3])
+            result = Py_BuildValue("NNNN", column[0], column[1], column[2], column[3]);
+        else
+            for (j = 0; j < 4; j++)
+                Py_XDECREF(column[j]);
+    } else {
+        result = PyList_New(ncpus);
+        if (result)
+            for (i = 0; i < ncpus; i++)
+                PyList_SET_ITEM(result, i, Py_BuildValue("IIII", regs[i].eax, regs[i].ebx, regs[i].ecx, regs[i].edx));
+    }
+    grub_free(regs);
+    return result;
+}
+
+/* Snapshot of the CPUID leaves of every CPU, captured once in parallel so
+ * that repeated queries for values that never change cost no IPIs.  Each CPU
+ * fills in its own list in its arena, sorted by leaf and subleaf; the BSP
+ * then packs them into one table indexed by CPU. */
+#define CPUID_SNAPSHOT_MAX 512
+#define CPUID_MAX_LEAVES 0x100
+#define CPUID_MAX_SUBLEAVES 64
+#define CPUID_NOT_INDEXED 0xffffffff
+
+struct cpuid_entry {
+    U32 leaf;
+    U32 subleaf;        /* CPUID_NOT_INDEXED if captured once, with ECX = 0 */
+    struct dword_regs regs;
+};
+
+enum subleaf_rule {
+    SUBLEAF_COUNT,      /* EAX of subleaf 0 is the last subleaf */
+    SUBLEAF_CACHE,      /* up to the cache with type 0 in EAX[4:0] */
+    SUBLEAF_TOPOLOGY,   /* up to the level with type 0 in ECX[15:8] */
+    SUBLEAF_FIXED,      /* a fixed number of subleaves */
+};
+
+static const struct {
+    U32 leaf;
+    enum subleaf_rule rule;
+    U32 count;
+} cpuid_indexed_leaves[] = {
+    { 0x4, SUBLEAF_CACHE, 0 },
+    { 0x7, SUBLEAF_COUNT, 0 },
+    { 0xb, SUBLEAF_TOPOLOGY, 0 },
+    { 0xd, SUBLEAF_FIXED, 64 },
+    { 0xf, SUBLEAF_FIXED, 2 },
+    { 0x10, SUBLEAF_FIXED, 8 },
+    { 0x12, SUBLEAF_FIXED, 16 },
+    { 0x14, SUBLEAF_COUNT, 0 },
+    { 0x17, SUBLEAF_COUNT, 0 },
+    { 0x18, SUBLEAF_COUNT, 0 },
+    { 0x1d, SUBLEAF_COUNT, 0 },
+    { 0x1f, SUBLEAF_TOPOLOGY, 0 },
+    { 0x20, SUBLEAF_COUNT, 0 },
+    { 0x8000001d, SUBLEAF_CACHE, 0 },
+    { 0x80000020, SUBLEAF_FIXED, 4 },
+    { 0x80000026, SUBLEAF_TOPOLOGY, 0 },
+};
+
+/* Leaves documented to ignore ECX, so that a snapshot of subleaf 0 answers
+ * for any ECX.  Other leaves outside cpuid_indexed_leaves may take a subleaf
+ * the snapshot does not know about, so only ECX = 0 hits the snapshot. */
+static const U32 cpuid_flat_leaves[] = {
+    0x0, 0x1, 0x2, 0x3, 0x5, 0x6, 0xa, 0x15, 0x16,
+    0x80000000, 0x80000001, 0x80000002, 0x80000003, 0x80000004,
+    0x80000005, 0x80000006, 0x80000007, 0x80000008,
+};
+
+static bool cpuid_leaf_is_flat(U32 leaf)
+{
+    U32 i;
+
+    for (i = 0; i < sizeof(cpuid_flat_leaves) / sizeof(cpuid_flat_leaves[0]); i++)
+        if (cpuid_flat_leaves[i] == leaf)
+            return true;
+    return false;
+}
+
+static struct {
+    U32 ncpus;
+    U32 *first;                 /* ncpus + 1 offsets into entries */
+    struct cpuid_entry *entries;
+} cpuid_snapshot;
+
+struct cpuid_capture {
+    struct cpuid_entry **entries;
+    U32 *count;
+};
+
+static struct dword_regs *cpuid_capture_add(struct cpuid_entry *entries, U32 *count, U32 leaf, U32 subleaf)
+{
+    struct cpuid_entry *e;
+
+    if (*count == CPUID_SNAPSHOT_MAX)
+        return NULL;
+    e = &entries[(*count)++];
+    e->leaf = leaf;
+    e->subleaf = subleaf;
+    cpuid32_indexed(leaf, subleaf == CPUID_NOT_INDEXED ? 0 : subleaf, &e->regs.eax, &e->regs.ebx, &e->regs.ecx, &e->regs.edx);
+    return &e->regs;
+}
+
+static void cpuid_capture_range(struct cpuid_entry *entries, U32 *count, U32 base)
+{
+    U32 max, leaf, subleaf, last, i, dummy;
+    struct dword_regs *regs;
+
+    cpuid32(base, &max, &dummy, &dummy, &dummy);
+    if (max < base || max - base >= CPUID_MAX_LEAVES)
+        max = base;
+
+    for (leaf = base; leaf <= max; leaf++) {
+        for (i = 0; i < sizeof(cpuid_indexed_leaves) / sizeof(cpuid_indexed_leaves[0]); i++)
+            if (cpuid_indexed_leaves[i].leaf == leaf)
+                break;
+        if (i == sizeof(cpuid_indexed_leaves) / sizeof(cpuid_indexed_leaves[0])) {
+            cpuid_capture_add(entries, count, leaf, CPUID_NOT_INDEXED);
+            continue;
+        }
+
+        last = CPUID_MAX_SUBLEAVES - 1;
+        for (subleaf = 0; subleaf <= last; subleaf++) {
+            regs = cpuid_capture_add(entries, count, leaf, subleaf);
+            if (!regs)
+                return;
+            switch (cpuid_indexed_leaves[i].rule) {
+            case SUBLEAF_COUNT:
+                if (subleaf == 0 && regs->eax < last)
+                    last = regs->eax;
+                break;
+            case SUBLEAF_CACHE:
+                if ((regs->eax & 0x1f) == 0)
+                    last = subleaf;
+                break;
+            case SUBLEAF_TOPOLOGY:
+                if (((regs->ecx >> 8) & 0xff) == 0)
+                    last = subleaf;
+                break;
+            case SUBLEAF_FIXED:
+                last = cpuid_indexed_leaves[i].count - 1;
+                break;
+            }
+        }
+    }
+}
+
+static void cpuid_capture_callback(void *param)
+{
+    struct cpuid_capture *c = param;
+    struct cpuid_entry *entries;
+    U32 index;
+
+    if (!smp_read_cpu_index(&index))
+        return;
+    entries = smp_arena_alloc(CPUID_SNAPSHOT_MAX * sizeof(*entries));
+    if (!entries)
+        return;
+    c->count[index] = 0;
+    cpuid_capture_range(entries, &c->count[index], 0);
+    cpuid_capture_range(entries, &c->count[index], 0x80000000);
+    c->entries[index] = entries;
+}
+
+/* Capture a new snapshot, replacing any previous one.  A CPU whose arena
+ * cannot hold its list gets no entries, so queries for it miss.  Returns
+ * false with a Python exception set on error. */
+static bool cpuid_take_snapshot(void)
+{
+    struct cpuid_capture c;
+    struct cpuid_entry *entries;
+    U32 *first;
+    U32 ncpus, i, total = 0;
+
+    ncpus = smp_init();
+    if (!ncpus) {
+        PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
+        return false;
+    }
+
+    c.entries = grub_zalloc(ncpus * sizeof(*c.entries));
+    c.count = grub_zalloc(ncpus * sizeof(*c.count));
+    first = grub_malloc((ncpus + 1) * sizeof(*first));
+    if (!c.entries || !c.count || !first) {
+        grub_free(c.entries);
+        grub_free(c.count);
+        grub_free(first);
+        PyErr_NoMemory();
+        return false;
+    }
+
+    if (!smp_function_all(cpuid_capture_callback, &c)) {
+        grub_free(c.entries);
+        grub_free(c.count);
+        grub_free(first);
+        PyErr_Format(PyExc_RuntimeError, "SMP function returned an error");
+        return false;
+    }
+
+    for (i = 0; i < ncpus; i++) {
+        first[i] = total;
+        if (c.entries[i])
+            total += c.count[i];
+    }
+    first[ncpus] = total;
+
+    entries = grub_malloc((total ? total : 1) * sizeof(*entries));
+    if (entries)
+        for (i = 0; i < ncpus; i++)
+            if (c.entries[i])
+                memcpy(&entries[first[i]], c.entries[i], c.count[i] * sizeof(*entries));
+    for (i = 0; i < ncpus; i++)
+        smp_arena_reset_by_index(i);
+    grub_free(c.entries);
+    grub_free(c.count);
+    if (!entries) {
+        grub_free(first);
+        PyErr_NoMemory();
+        return false;
+    }
+
+    grub_free(cpuid_snapshot.first);
+    grub_free(cpuid_snapshot.entries);
+    cpuid_snapshot.ncpus = ncpus;
+    cpuid_snapshot.first = first;
+    cpuid_snapshot.entries = entries;
+    return true;
+}
+
+/* Returns the snapshot of the specified leaf and subleaf on the CPU at index,
+ * or NULL if the snapshot does not have it, so the caller runs CPUID. */
+static const struct dword_regs *cpuid_snapshot_lookup(U32 index, U32 leaf, U32 subleaf)
+{
+    U32 lo, hi, mid;
+    const struct cpuid_entry *e;
+
+    if (index >= cpuid_snapshot.ncpus)
+        return NULL;
+
+    // Find the first entry for the leaf, then its subleaf
+    lo = cpuid_snapshot.first[index];
+    hi = cpuid_snapshot.first[index + 1];
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (cpuid_snapshot.entries[mid].leaf < leaf)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (; lo < cpuid_snapshot.first[index + 1]; lo++) {
+        e = &cpuid_snapshot.entries[lo];
+        if (e->leaf != leaf)
+            break;
+        if (e->subleaf == subleaf)
+            return &e->regs;
+        if (e->subleaf == CPUID_NOT_INDEXED && (subleaf == 0 || cpuid_leaf_is_flat(leaf)))
+            return &e->regs;
+    }
+    return NULL;
+}
+
+static PyObject *bits_cpuid_snapshot(PyObject *self, PyObject *args)
+{
+    if (!cpuid_take_snapshot())
+        return NULL;
+    return Py_BuildValue("I", cpuid_snapshot.first[cpuid_snapshot.ncpus]);
+}
+
+static PyObject *bits_cpuid_cached(PyObject *self, PyObject *args)
+{
+    U32 apicid, eax, ecx = 0, index;
+    const struct dword_regs *regs;
+
+    if (!PyArg_ParseTuple(args, "II|I:cpuid_cached", &apicid, &eax, &ecx))
+        return NULL;
+    if (!cpuid_snapshot.entries && !cpuid_take_snapshot())
+        return NULL;
+
+    if (!smp_lookup_cpu_index(apicid, &index))
+        return PyErr_Format(PyExc_RuntimeError, "SMP function returned an error; does apicid 0x%x exist?", apicid);
+    regs = cpuid_snapshot_lookup(index, eax, ecx);
+    if (!regs)
+        return Py_BuildValue("");
+    return Py_BuildValue("IIII", regs->eax, regs->ebx, regs->ecx, regs->edx);
+}
+
+static PyObject *bits_cpuid_cached_all(PyObject *self, PyObject *args)
+{
+    U32 eax, ecx = 0, i;
+    const struct dword_regs *regs;
+    PyObject *list;
+
+    if (!PyArg_ParseTuple(args, "I|I:cpuid_cached_all", &eax, &ecx))
+        return NULL;
+    if (!cpuid_snapshot.entries && !cpuid_take_snapshot())
+        return NULL;
+
+    for (i = 0; i < cpuid_snapshot.ncpus; i++)
+        if (!cpuid_snapshot_lookup(i, eax, ecx))
+            return Py_BuildValue("");
+
+    list = PyList_New(cpuid_snapshot.ncpus);
+    if (list)
+        for (i = 0; i < cpuid_snapshot.ncpus; i++) {
+            regs = cpuid_snapshot_lookup(i, eax, ecx);
+            PyList_SET_ITEM(list, i, Py_BuildValue("IIII", regs->eax, regs->ebx, regs->ecx, regs->edx));
+        }
+    return list;
+}
+
 static PyObject *bits_cpus(PyObject *self, PyObject *args)
 {
     int ncpus;
@@ -180,113 +715,1217 @@ static bool smp_wrmsr(U32 apicid, struct msr *msr)
     return !msr->status;
 }
 
-static PyObject *bits_wrmsr(PyObject *self, PyObject *args)
+/* Runs on every CPU; param points to an array of struct msr indexed by CPU
+ * index. */
+static void rdmsr_all_callback(void *param)
 {
-    struct msr msr;
-    unsigned apicid;
-    int ncpus;
-
-    if (!PyArg_ParseTuple(args, "IIK", &apicid, &msr.num, &msr.value))
-        return NULL;
-
-    ncpus = smp_init();
-    if (!ncpus)
-        return PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
-
-    if (!smp_wrmsr(apicid, &msr))
-        return Py_BuildValue("");
-    return PyBool_FromLong(!msr.status);
+    struct msr *msrs = param;
+    U32 index;
+    if (smp_read_cpu_index(&index))
+        rdmsr_callback(&msrs[index]);
 }
 
-static void inb_callback(void *param)
+static void wrmsr_all_callback(void *param)
 {
-    struct memop *m = param;
-    m->value = grub_inb(m->addr);
+    struct msr *msrs = param;
+    U32 index;
+    if (smp_read_cpu_index(&index))
+        wrmsr_callback(&msrs[index]);
 }
 
-static char *in_keywords[] = {"port", "apicid", NULL};
-
-static PyObject *bits_inb(PyObject *self, PyObject *args, PyObject *keywds)
+/* Run an MSR operation on all CPUs at once, with the results in msrs, an
+ * array of ncpus entries indexed by CPU.  Returns false with a Python
+ * exception set on failure. */
+static bool smp_msr_all(struct msr *msrs, U32 ncpus, U32 num, U64 value, CALLBACK callback)
 {
-    struct memop m;
-    U16 port;
-    unsigned apicid;
+    U32 i;
 
-    if (!smp_init())
-        return PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
-    apicid = bsp_apicid();
+    for (i = 0; i < ncpus; i++) {
+        msrs[i].num = num;
+        msrs[i].status = -1;
+        msrs[i].value = value;
+    }
 
-    if (!PyArg_ParseTupleAndKeywords(args, keywds, "H|I", in_keywords, &port, &apicid))
-        return NULL;
-    m.addr = port;
+    if (!smp_function_all(callback, msrs)) {
+        PyErr_Format(PyExc_RuntimeError, "SMP function returned an error");
+        return false;
+    }
 
-    if (!smp_function(apicid, inb_callback, &m))
-        return Py_BuildValue("");
-    return Py_BuildValue("B", (U8)m.value);
+    return true;
 }
 
-static void inw_callback(void *param)
-{
-    struct memop *m = param;
-    m->value = grub_inw(m->addr);
-}
+static char *rdmsr_all_keywords[] = {"msr", "layout", NULL};
 
-static PyObject *bits_inw(PyObject *self, PyObject *args, PyObject *keywds)
+static PyObject *bits_rdmsr_all(PyObject *self, PyObject *args, PyObject *keywds)
 {
-    struct memop m;
-    U16 port;
-    unsigned apicid;
+    U32 num;
+    U32 ncpus;
+    U32 i;
+    enum result_layout layout = LAYOUT_OBJECTS;
+    struct msr *msrs;
+    PyObject *result = NULL;
 
-    if (!smp_init())
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "I|O&:rdmsr_all", rdmsr_all_keywords, &num, parse_layout, &layout))
+        return NULL;
+
+    ncpus = smp_init();
+    if (!ncpus)
         return PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
-    apicid = bsp_apicid();
 
-    if (!PyArg_ParseTupleAndKeywords(args, keywds, "H|I", in_keywords, &port, &apicid))
+    if (layout == LAYOUT_AOS) {
+        result = new_result_buffer(ncpus * sizeof(*msrs), (void **)&msrs);
+        if (!result)
+            return NULL;
+        if (!smp_msr_all(msrs, ncpus, num, 0, rdmsr_all_callback)) {
+            Py_DECREF(result);
+            return NULL;
+        }
+        return read_only_buffer(result);
+    }
+
+    msrs = grub_malloc(ncpus * sizeof(*msrs));
+    if (!msrs)
+        return PyErr_NoMemory();
+    if (!smp_msr_all(msrs, ncpus, num, 0, rdmsr_all_callback)) {
+        grub_free(msrs);
         return NULL;
-    m.addr = port;
+    }
 
-    if (!smp_function(apicid, inw_callback, &m))
-        return Py_BuildValue("");
-    return Py_BuildValue("H", (U16)m.value);
+    if (layout == LAYOUT_SOA) {
+        PyObject *values, *status;
+        U64 *value_data;
+        U32 *status_data;
+        values = read_only_buffer(new_result_buffer(ncpus * sizeof(U64), (void **)&value_data));
+        status = read_only_buffer(new_result_buffer(ncpus * sizeof(U32), (void **)&status_data));
+        if (values && status) {
+            for (i = 0; i < ncpus; i++) {
+                value_data[i] = msrs[i].value;
+                status_data[i] = msrs[i].status;
+            }
+            result = Py_BuildValue("NN", values, status);
+        } else {
+            Py_XDECREF(values);
+            Py_XDECREF(status);
+        }
+    } else {
+        result = PyList_New(ncpus);
+        if (result)
+            for (i = 0; i < ncpus; i++)
+                PyList_SET_ITEM(result, i, msrs[i].status ? Py_BuildValue("") : PyLong_FromUnsignedLongLong(msrs[i].value));
+    }
+    grub_free(msrs);
+    return result;
 }
 
-static void inl_callback(void *param)
+struct rendezvous {
+    SMP_BARRIER *barrier;
+    U64 *tsc;
+};
+
+static void rendezvous_callback(void *param)
 {
-    struct memop *m = param;
-    m->value = grub_inl(m->addr);
+    struct rendezvous *r = param;
+    U32 index;
+    if (smp_read_cpu_index(&index) && smp_barrier_wait(r->barrier))
+        r->tsc[index] = rdtsc64();
 }
 
-static PyObject *bits_inl(PyObject *self, PyObject *args, PyObject *keywds)
-{
-    struct memop m;
-    U16 port;
-    unsigned apicid;
+static char *rendezvous_keywords[] = {"release_ticks", "layout", NULL};
+
+static PyObject *bits_rendezvous(PyObject *self, PyObject *args, PyObject *keywds)
+{
+    struct rendezvous r;
+    void *barrier_memory;
+    U64 release_ticks = 0;
+    enum result_layout layout = LAYOUT_OBJECTS;
+    PyObject *result = NULL;
+    U32 ncpus, i;
+
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "|KO&:rendezvous", rendezvous_keywords, &release_ticks, parse_layout, &layout))
+        return NULL;
+
+    ncpus = smp_init();
+    if (!ncpus)
+        return PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
+
+    barrier_memory = grub_memalign(SMP_MWAIT_ALIGN, smp_barrier_size());
+    if (layout == LAYOUT_OBJECTS)
+        r.tsc = grub_zalloc(ncpus * sizeof(*r.tsc));
+    else
+        result = new_result_buffer(ncpus * sizeof(*r.tsc), (void **)&r.tsc);
+    if (!barrier_memory || (layout == LAYOUT_OBJECTS ? !r.tsc : !result)) {
+        grub_free(barrier_memory);
+        if (layout == LAYOUT_OBJECTS)
+            grub_free(r.tsc);
+        else if (result)
+            Py_DECREF(result);
+        return PyErr_NoMemory();
+    }
+    r.barrier = smp_barrier_init(barrier_memory, NULL, release_ticks);
+
+    if (!smp_function_all(rendezvous_callback, &r)) {
+        grub_free(barrier_memory);
+        if (layout == LAYOUT_OBJECTS)
+            grub_free(r.tsc);
+        else
+            Py_DECREF(result);
+        return PyErr_Format(PyExc_RuntimeError, "SMP function returned an error");
+    }
+    grub_free(barrier_memory);
+    if (layout != LAYOUT_OBJECTS)
+        return read_only_buffer(result);
+
+    result = PyList_New(ncpus);
+    if (result)
+        for (i = 0; i < ncpus; i++)
+            PyList_SET_ITEM(result, i, PyLong_FromUnsignedLongLong(r.tsc[i]));
+    grub_free(r.tsc);
+    return result;
+}
+
+static PyObject *bits_wrmsr(PyObject *self, PyObject *args)
+{
+    struct msr msr;
+    unsigned apicid;
+    int ncpus;
+
+    if (!PyArg_ParseTuple(args, "IIK", &apicid, &msr.num, &msr.value))
+        return NULL;
+
+    ncpus = smp_init();
+    if (!ncpus)
+        return PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
+
+    if (!smp_wrmsr(apicid, &msr))
+        return Py_BuildValue("");
+    return PyBool_FromLong(!msr.status);
+}
+
+static PyObject *bits_wrmsr_all(PyObject *self, PyObject *args)
+{
+    U32 num;
+    U64 value;
+    U32 ncpus;
+    U32 i;
+    struct msr *msrs;
+    PyObject *list;
+
+    if (!PyArg_ParseTuple(args, "IK", &num, &value))
+        return NULL;
+
+    ncpus = smp_init();
+    if (!ncpus)
+        return PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
+
+    msrs = grub_malloc(ncpus * sizeof(*msrs));
+    if (!msrs)
+        return PyErr_NoMemory();
+    if (!smp_msr_all(msrs, ncpus, num, value, wrmsr_all_callback)) {
+        grub_free(msrs);
+        return NULL;
+    }
+
+    list = PyList_New(ncpus);
+    if (list)
+        for (i = 0; i < ncpus; i++)
+            PyList_SET_ITEM(list, i, PyBool_FromLong(!msrs[i].status));
+    grub_free(msrs);
+    return list;
+}
+
+/* One rdmsr_many or wrmsr_many call.  Each selected CPU runs the whole MSR
+ * list in one callback and fills in its own row of each result table; rows
+ * of the GPF and mismatch bitmaps are whole bytes so that no two CPUs write
+ * the same byte. */
+struct msr_many {
+    U32 nrows;
+    U32 nmsrs;
+    U32 *msrs;
+    U64 *write_values;   /* NULL to read */
+    U64 *masks;          /* applied to values read; NULL for none */
+    U32 *row;            /* row for each CPU index, or MSR_MANY_NO_ROW */
+    U32 *mask;
+    U64 *values;         /* nrows x nmsrs, read values or read-back values */
+    U8 *gpf;             /* nrows x MSR_MANY_BITMAP_BYTES(nmsrs) */
+    U8 *mismatch;        /* as gpf; NULL unless verifying writes */
+    U8 *readback_gpf;    /* as gpf, for the verifying reads; NULL unless verifying writes */
+};
+
+#define MSR_MANY_NO_ROW ((U32)-1)
+#define MSR_MANY_BITMAP_BYTES(nmsrs) (((nmsrs) + 7) / 8)
+
+static void msr_many_callback(void *param)
+{
+    struct msr_many *m = param;
+    U32 index, row, i, status;
+    U64 value;
+    U8 *gpf, *mismatch = NULL, *readback_gpf = NULL;
+
+    if (!smp_read_cpu_index(&index) || m->row[index] == MSR_MANY_NO_ROW)
+        return;
+    row = m->row[index];
+    gpf = m->gpf + row * MSR_MANY_BITMAP_BYTES(m->nmsrs);
+    if (m->mismatch) {
+        mismatch = m->mismatch + row * MSR_MANY_BITMAP_BYTES(m->nmsrs);
+        readback_gpf = m->readback_gpf + row * MSR_MANY_BITMAP_BYTES(m->nmsrs);
+    }
+
+    for (i = 0; i < m->nmsrs; i++) {
+        value = 0;
+        if (m->write_values) {
+            wrmsr64(m->msrs[i], m->write_values[i], &status);
+            // A GPF reading back a written MSR means it is write-only, not
+            // that the write failed
+            if (!status && mismatch) {
+                rdmsr64(m->msrs[i], &value, &status);
+                if (status) {
+                    readback_gpf[i / 8] |= 1 << (i % 8);
+                    value = 0;
+                    status = 0;
+                } else if (value != m->write_values[i])
+                    mismatch[i / 8] |= 1 << (i % 8);
+            }
+        } else {
+            rdmsr64(m->msrs[i], &value, &status);
+            if (m->masks)
+                value &= m->masks[i];
+        }
+        if (status) {
+            gpf[i / 8] |= 1 << (i % 8);
+            value = 0;
+        }
+        if (m->values)
+            m->values[row * m->nmsrs + i] = value;
+    }
+}
+
+/* Convert a sequence of integers no larger than max to a new array; returns
+ * NULL with a Python exception set on error. */
+static U64 *parse_u64_sequence(PyObject *obj, U32 *count, U64 max, const char *what)
+{
+    PyObject *seq, *num;
+    Py_ssize_t n, i;
+    U64 *array;
+
+    seq = PySequence_Fast(obj, what);
+    if (!seq)
+        return NULL;
+    n = PySequence_Fast_GET_SIZE(seq);
+    array = grub_malloc((n ? n : 1) * sizeof(*array));
+    if (!array) {
+        Py_DECREF(seq);
+        return (U64 *)PyErr_NoMemory();
+    }
+    for (i = 0; i < n; i++) {
+        num = PyNumber_Long(PySequence_Fast_GET_ITEM(seq, i));
+        if (!num)
+            break;
+        array[i] = PyLong_AsUnsignedLongLong(num);
+        Py_DECREF(num);
+        if (PyErr_Occurred())
+            break;
+        if (array[i] > max) {
+            PyErr_Format(PyExc_ValueError, "value 0x%llx out of range: %s", (unsigned long long)array[i], what);
+            break;
+        }
+    }
+    Py_DECREF(seq);
+    if (i < n) {
+        grub_free(array);
+        return NULL;
+    }
+    *count = n;
+    return array;
+}
+
+static void msr_many_free(struct msr_many *m)
+{
+    grub_free(m->msrs);
+    grub_free(m->write_values);
+    grub_free(m->row);
+    grub_free(m->mask);
+}
+
+/* Parse the CPU and MSR lists shared by rdmsr_many and wrmsr_many; returns
+ * false with a Python exception set on error. */
+static bool msr_many_setup(struct msr_many *m, PyObject *apicids_obj, PyObject *msrs_obj)
+{
+    U64 *apicids = NULL, *msrs;
+    U32 ncpus, i, index;
+
+    memset(m, 0, sizeof(*m));
+
+    ncpus = smp_init();
+    if (!ncpus) {
+        PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
+        return false;
+    }
+
+    msrs = parse_u64_sequence(msrs_obj, &m->nmsrs, 0xffffffff, "expected a sequence of MSR numbers");
+    if (!msrs)
+        return false;
+    m->msrs = grub_malloc((m->nmsrs ? m->nmsrs : 1) * sizeof(*m->msrs));
+    if (m->msrs)
+        for (i = 0; i < m->nmsrs; i++)
+            m->msrs[i] = msrs[i];
+    grub_free(msrs);
+
+    if (apicids_obj == Py_None)
+        m->nrows = ncpus;
+    else {
+        apicids = parse_u64_sequence(apicids_obj, &m->nrows, 0xffffffff, "expected a sequence of APIC IDs");
+        if (!apicids) {
+            msr_many_free(m);
+            return false;
+        }
+    }
+
+    m->row = grub_malloc(ncpus * sizeof(*m->row));
+    m->mask = grub_zalloc(SMP_MASK_WORDS(ncpus) * sizeof(*m->mask));
+    if (!m->msrs || !m->row || !m->mask) {
+        grub_free(apicids);
+        msr_many_free(m);
+        PyErr_NoMemory();
+        return false;
+    }
+
+    for (index = 0; index < ncpus; index++)
+        m->row[index] = apicids ? MSR_MANY_NO_ROW : index;
+    for (i = 0; apicids && i < m->nrows; i++) {
+        bool found = smp_lookup_cpu_index(apicids[i], &index);
+        if (!found || m->row[index] != MSR_MANY_NO_ROW) {
+            PyErr_Format(PyExc_ValueError, !found ? "apicid 0x%llx not found" : "apicid 0x%llx listed twice", (unsigned long long)apicids[i]);
+            grub_free(apicids);
+            msr_many_free(m);
+            return false;
+        }
+        m->row[index] = i;
+    }
+    grub_free(apicids);
+
+    for (index = 0; index < ncpus; index++)
+        if (m->row[index] != MSR_MANY_NO_ROW)
+            SMP_MASK_SET(m->mask, index);
+    return true;
+}
+
+static PyObject *bits_rdmsr_many(PyObject *self, PyObject *args)
+{
+    PyObject *apicids_obj, *msrs_obj, *values, *gpf;
+    struct msr_many m;
+
+    if (!PyArg_ParseTuple(args, "OO:rdmsr_many", &apicids_obj, &msrs_obj))
+        return NULL;
+    if (!msr_many_setup(&m, apicids_obj, msrs_obj))
+        return NULL;
+
+    values = new_result_buffer((Py_ssize_t)m.nrows * m.nmsrs * sizeof(U64), (void **)&m.values);
+    gpf = new_result_buffer((Py_ssize_t)m.nrows * MSR_MANY_BITMAP_BYTES(m.nmsrs), (void **)&m.gpf);
+    if (values && gpf && m.nrows && m.nmsrs)
+        smp_function_mask(m.mask, msr_many_callback, &m);
+    msr_many_free(&m);
+    if (!values || !gpf) {
+        Py_XDECREF(values);
+        Py_XDECREF(gpf);
+        return NULL;
+    }
+    values = read_only_buffer(values);
+    gpf = read_only_buffer(gpf);
+    if (!values || !gpf) {
+        Py_XDECREF(values);
+        Py_XDECREF(gpf);
+        return NULL;
+    }
+    return Py_BuildValue("NN", values, gpf);
+}
+
+static char *wrmsr_many_keywords[] = {"apicids", "msrs", "values", "verify", NULL};
+
+static PyObject *bits_wrmsr_many(PyObject *self, PyObject *args, PyObject *keywds)
+{
+    PyObject *apicids_obj, *msrs_obj, *values_obj, *verify_obj = NULL;
+    PyObject *values = NULL, *gpf, *mismatch = NULL, *readback_gpf = NULL;
+    struct msr_many m;
+    int verify = 0;
+    U32 nvalues;
+
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "OOO|O:wrmsr_many", wrmsr_many_keywords, &apicids_obj, &msrs_obj, &values_obj, &verify_obj))
+        return NULL;
+    if (verify_obj) {
+        verify = PyObject_IsTrue(verify_obj);
+        if (verify < 0)
+            return NULL;
+    }
+    if (!msr_many_setup(&m, apicids_obj, msrs_obj))
+        return NULL;
+
+    m.write_values = parse_u64_sequence(values_obj, &nvalues, ~0ULL, "expected a sequence of MSR values");
+    if (!m.write_values) {
+        msr_many_free(&m);
+        return NULL;
+    }
+    if (nvalues != m.nmsrs) {
+        msr_many_free(&m);
+        return PyErr_Format(PyExc_ValueError, "wrmsr_many needs one value per MSR");
+    }
+
+    gpf = new_result_buffer((Py_ssize_t)m.nrows * MSR_MANY_BITMAP_BYTES(m.nmsrs), (void **)&m.gpf);
+    if (verify) {
+        mismatch = new_result_buffer((Py_ssize_t)m.nrows * MSR_MANY_BITMAP_BYTES(m.nmsrs), (void **)&m.mismatch);
+        readback_gpf = new_result_buffer((Py_ssize_t)m.nrows * MSR_MANY_BITMAP_BYTES(m.nmsrs), (void **)&m.readback_gpf);
+        values = new_result_buffer((Py_ssize_t)m.nrows * m.nmsrs * sizeof(U64), (void **)&m.values);
+    }
+    if (gpf && (!verify || (mismatch && readback_gpf && values)) && m.nrows && m.nmsrs)
+        smp_function_mask(m.mask, msr_many_callback, &m);
+    msr_many_free(&m);
+    if (!gpf || (verify && (!mismatch || !readback_gpf || !values))) {
+        Py_XDECREF(gpf);
+        Py_XDECREF(mismatch);
+        Py_XDECREF(readback_gpf);
+        Py_XDECREF(values);
+        return NULL;
+    }
+    gpf = read_only_buffer(gpf);
+    if (!verify)
+        return gpf ? Py_BuildValue("NOOO", gpf, Py_None, Py_None, Py_None) : NULL;
+    mismatch = read_only_buffer(mismatch);
+    values = read_only_buffer(values);
+    readback_gpf = read_only_buffer(readback_gpf);
+    if (!gpf || !mismatch || !values || !readback_gpf) {
+        Py_XDECREF(gpf);
+        Py_XDECREF(mismatch);
+        Py_XDECREF(values);
+        Py_XDECREF(readback_gpf);
+        return NULL;
+    }
+    return Py_BuildValue("NNNN", gpf, mismatch, values, readback_gpf);
+}
+
+#define MSR_SWEEP_CHUNK 512
+
+static bool msr_many_gpf(const struct msr_many *m, U32 row, U32 i)
+{
+    return (m->gpf[row * MSR_MANY_BITMAP_BYTES(m->nmsrs) + i / 8] >> (i % 8)) & 1;
+}
+
+/* Group the CPUs by what they read from m->msrs[i], in order of the first CPU
+ * to read each value.  Returns a tuple of (value or None if GPF, tuple of APIC
+ * IDs); a single group shares all_cpus.  leader and group_of are scratch
+ * arrays of nrows entries. */
+static PyObject *msr_sweep_groups(const struct msr_many *m, U32 i, const CPU_INFO *cpu, PyObject *all_cpus, U32 *leader, U32 *group_of)
+{
+    U32 ngroups = 0, row, g, k, count;
+    PyObject *groups, *apicids, *value;
+
+    for (row = 0; row < m->nrows; row++) {
+        // A GPF reads as 0, so the GPF bit and value together identify the result
+        for (g = 0; g < ngroups; g++)
+            if (msr_many_gpf(m, leader[g], i) == msr_many_gpf(m, row, i)
+                && m->values[leader[g] * m->nmsrs + i] == m->values[row * m->nmsrs + i])
+                break;
+        if (g == ngroups)
+            leader[ngroups++] = row;
+        group_of[row] = g;
+    }
+
+    groups = PyTuple_New(ngroups);
+    if (!groups)
+        return NULL;
+    for (g = 0; g < ngroups; g++) {
+        if (ngroups == 1) {
+            apicids = all_cpus;
+            Py_INCREF(apicids);
+        } else {
+            for (row = 0, count = 0; row < m->nrows; row++)
+                if (group_of[row] == g)
+                    count++;
+            apicids = PyTuple_New(count);
+            if (!apicids) {
+                Py_DECREF(groups);
+                return NULL;
+            }
+            for (row = 0, k = 0; row < m->nrows; row++)
+                if (group_of[row] == g)
+                    PyTuple_SET_ITEM(apicids, k++, PyInt_FromLong(cpu[row].apicid));
+        }
+        if (msr_many_gpf(m, leader[g], i))
+            value = Py_BuildValue("");
+        else
+            value = PyLong_FromUnsignedLongLong(m->values[leader[g] * m->nmsrs + i]);
+        PyTuple_SET_ITEM(groups, g, Py_BuildValue("NN", value, apicids));
+    }
+    return groups;
+}
+
+struct msr_sweep_mask {
+    U64 msr;
+    U64 mask;
+};
+
+/* Sorts U64s, and struct msr_sweep_mask by its leading msr. */
+static int msr_sweep_compare(const void *a, const void *b)
+{
+    U64 x = *(const U64 *)a, y = *(const U64 *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Expand ranges, less the blacklist, into the list of MSRs to sweep, with
+ * the mask for each from the masks dict.  Returns false with a Python
+ * exception set on error. */
+static bool msr_sweep_list(PyObject *ranges_obj, PyObject *blacklist_obj, PyObject *masks_obj, U32 **msrs_ret, U64 **masks_ret, U32 *count_ret)
+{
+    PyObject *ranges, *key, *mask_value;
+    Py_ssize_t nranges, r, pos = 0;
+    U64 *start, *stop, *blacklist = NULL;
+    struct msr_sweep_mask *mask_list = NULL, *found;
+    U32 nblacklist = 0, nmasks = 0, count = 0, j;
+    U64 msr, total = 0;
+    U32 *msrs;
+    U64 *masks;
+
+    ranges = PySequence_Fast(ranges_obj, "expected a sequence of (start, stop) MSR ranges");
+    if (!ranges)
+        return false;
+    nranges = PySequence_Fast_GET_SIZE(ranges);
+    start = grub_malloc((nranges ? nranges : 1) * sizeof(*start));
+    stop = grub_malloc((nranges ? nranges : 1) * sizeof(*stop));
+    if (!start || !stop) {
+        PyErr_NoMemory();
+        goto err;
+    }
+    for (r = 0; r < nranges; r++) {
+        if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(ranges, r), "KK:msr_sweep range", &start[r], &stop[r]))
+            goto err;
+        if (start[r] > stop[r] || stop[r] > 0x100000000ULL) {
+            PyErr_Format(PyExc_ValueError, "invalid MSR range 0x%llx-0x%llx", (unsigned long long)start[r], (unsigned long long)stop[r]);
+            goto err;
+        }
+        total += stop[r] - start[r];
+    }
+    if (total > 0xffffffff || total > (grub_size_t)-1 / sizeof(U64)) {
+        PyErr_Format(PyExc_ValueError, "too many MSRs to sweep: 0x%llx", (unsigned long long)total);
+        goto err;
+    }
+
+    if (blacklist_obj && blacklist_obj != Py_None) {
+        blacklist = parse_u64_sequence(blacklist_obj, &nblacklist, ~0ULL, "expected a collection of MSR numbers to skip");
+        if (!blacklist)
+            goto err;
+        qsort(blacklist, nblacklist, sizeof(*blacklist), msr_sweep_compare);
+    }
+
+    if (masks_obj && masks_obj != Py_None) {
+        if (!PyDict_Check(masks_obj)) {
+            PyErr_Format(PyExc_TypeError, "expected a dict mapping MSR numbers to masks");
+            goto err;
+        }
+        nmasks = PyDict_Size(masks_obj);
+        mask_list = grub_malloc((nmasks ? nmasks : 1) * sizeof(*mask_list));
+        if (!mask_list) {
+            PyErr_NoMemory();
+            goto err;
+        }
+        for (j = 0; PyDict_Next(masks_obj, &pos, &key, &mask_value); j++) {
+            mask_list[j].msr = PyInt_AsUnsignedLongLongMask(key);
+            mask_list[j].mask = PyInt_AsUnsignedLongLongMask(mask_value);
+            if (PyErr_Occurred())
+                goto err;
+        }
+        qsort(mask_list, nmasks, sizeof(*mask_list), msr_sweep_compare);
+    }
+
+    msrs = grub_malloc((total ? total : 1) * sizeof(*msrs));
+    masks = grub_malloc((total ? total : 1) * sizeof(*masks));
+    if (!msrs || !masks) {
+        grub_free(msrs);
+        grub_free(masks);
+        PyErr_NoMemory();
+        goto err;
+    }
+    for (r = 0; r < nranges; r++)
+        for (msr = start[r]; msr < stop[r]; msr++) {
+            if (bsearch(&msr, blacklist, nblacklist, sizeof(*blacklist), msr_sweep_compare))
+                continue;
+            found = bsearch(&msr, mask_list, nmasks, sizeof(*mask_list), msr_sweep_compare);
+            msrs[count] = msr;
+            masks[count] = found ? found->mask : ~0ULL;
+            count++;
+        }
+
+    *msrs_ret = msrs;
+    *masks_ret = masks;
+    *count_ret = count;
+    Py_DECREF(ranges);
+    grub_free(start);
+    grub_free(stop);
+    grub_free(blacklist);
+    grub_free(mask_list);
+    return true;
+
+err:
+    Py_DECREF(ranges);
+    grub_free(start);
+    grub_free(stop);
+    grub_free(blacklist);
+    grub_free(mask_list);
+    return false;
+}
+
+static char *msr_sweep_keywords[] = {"ranges", "blacklist", "masks", NULL};
+
+static PyObject *bits_msr_sweep(PyObject *self, PyObject *args, PyObject *keywds)
+{
+    PyObject *ranges_obj, *blacklist_obj = NULL, *masks_obj = NULL;
+    PyObject *all_cpus = NULL, *list = NULL, *groups;
+    const CPU_INFO *cpu;
+    struct msr_many m;
+    U32 *msrs = NULL, *leader = NULL, *group_of = NULL;
+    U64 *masks = NULL;
+    U32 ncpus, count, done, i;
+
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "O|OO:msr_sweep", msr_sweep_keywords, &ranges_obj, &blacklist_obj, &masks_obj))
+        return NULL;
+
+    ncpus = smp_init();
+    if (!ncpus)
+        return PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
+    cpu = smp_read_cpu_list();
+
+    if (!msr_sweep_list(ranges_obj, blacklist_obj, masks_obj, &msrs, &masks, &count))
+        return NULL;
+
+    // Sweep a chunk of MSRs at a time to bound the result table
+    memset(&m, 0, sizeof(m));
+    m.nrows = ncpus;
+    m.row = grub_malloc(ncpus * sizeof(*m.row));
+    m.values = grub_malloc(ncpus * MSR_SWEEP_CHUNK * sizeof(*m.values));
+    m.gpf = grub_malloc(ncpus * MSR_MANY_BITMAP_BYTES(MSR_SWEEP_CHUNK));
+    leader = grub_malloc(ncpus * sizeof(*leader));
+    group_of = grub_malloc(ncpus * sizeof(*group_of));
+    if (!m.row || !m.values || !m.gpf || !leader || !group_of) {
+        PyErr_NoMemory();
+        goto err;
+    }
+    for (i = 0; i < ncpus; i++)
+        m.row[i] = i;
+
+    all_cpus = PyTuple_New(ncpus);
+    list = PyList_New(count);
+    if (!all_cpus || !list)
+        goto err;
+    for (i = 0; i < ncpus; i++)
+        PyTuple_SET_ITEM(all_cpus, i, PyInt_FromLong(cpu[i].apicid));
+
+    for (done = 0; done < count; done += m.nmsrs) {
+        m.msrs = msrs + done;
+        m.masks = masks + done;
+        m.nmsrs = count - done < MSR_SWEEP_CHUNK ? count - done : MSR_SWEEP_CHUNK;
+        memset(m.gpf, 0, ncpus * MSR_MANY_BITMAP_BYTES(m.nmsrs));
+        if (!smp_function_all(msr_many_callback, &m)) {
+            PyErr_Format(PyExc_RuntimeError, "SMP function returned an error");
+            goto err;
+        }
+        for (i = 0; i < m.nmsrs; i++) {
+            groups = msr_sweep_groups(&m, i, cpu, all_cpus, leader, group_of);
+            if (!groups)
+                goto err;
+            PyList_SET_ITEM(list, done + i, Py_BuildValue("IN", m.msrs[i], groups));
+        }
+    }
+
+    Py_DECREF(all_cpus);
+    grub_free(msrs);
+    grub_free(masks);
+    grub_free(m.row);
+    grub_free(m.values);
+    grub_free(m.gpf);
+    grub_free(leader);
+    grub_free(group_of);
+    return list;
+
+err:
+    Py_XDECREF(all_cpus);
+    Py_XDECREF(list);
+    grub_free(msrs);
+    grub_free(masks);
+    grub_free(m.row);
+    grub_free(m.values);
+    grub_free(m.gpf);
+    grub_free(leader);
+    grub_free(group_of);
+    return NULL;
+}
+
+enum pending_op {
+    PENDING_CPUID,
+    PENDING_RDMSR,
+    PENDING_WRMSR,
+};
+
+/* State for a call started with one of the *_async functions; lives in a
+ * capsule so that it stays allocated until the AP has finished with it. */
+struct pending {
+    SMP_HANDLE handle;
+    enum pending_op op;
+    union {
+        struct dword_regs regs;
+        struct msr msr;
+    } u;
+};
+
+#define PENDING_CAPSULE_NAME "_smp.pending"
+
+static void pending_destructor(PyObject *capsule)
+{
+    struct pending *p = PyCapsule_GetPointer(capsule, PENDING_CAPSULE_NAME);
+    if (!p)
+        return;
+    smp_wait(&p->handle);
+    grub_free(p);
+}
+
+static PyObject *start_pending(U32 apicid, struct pending *p, CALLBACK callback, void *param)
+{
+    PyObject *capsule;
+
+    if (!smp_function_async(apicid, callback, param, &p->handle)) {
+        grub_free(p);
+        return PyErr_Format(PyExc_RuntimeError, "SMP function returned an error; does apicid 0x%x exist?", apicid);
+    }
+
+    capsule = PyCapsule_New(p, PENDING_CAPSULE_NAME, pending_destructor);
+    if (!capsule) {
+        smp_wait(&p->handle);
+        grub_free(p);
+    }
+    return capsule;
+}
+
+static struct pending *new_pending(enum pending_op op)
+{
+    struct pending *p;
+
+    p = grub_zalloc(sizeof(*p));
+    if (!p) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    p->op = op;
+    return p;
+}
+
+static PyObject *bits_cpuid_async(PyObject *self, PyObject *args)
+{
+    struct pending *p;
+    U32 apicid, eax, ecx = 0;
+
+    if (!PyArg_ParseTuple(args, "II|I", &apicid, &eax, &ecx))
+        return NULL;
+
+    if (!smp_init())
+        return PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
+
+    p = new_pending(PENDING_CPUID);
+    if (!p)
+        return NULL;
+    p->u.regs.eax = eax;
+    p->u.regs.ecx = ecx;
+    return start_pending(apicid, p, cpuid_callback, &p->u.regs);
+}
+
+static PyObject *bits_rdmsr_async(PyObject *self, PyObject *args)
+{
+    struct pending *p;
+    U32 apicid, num;
+
+    if (!PyArg_ParseTuple(args, "II", &apicid, &num))
+        return NULL;
+
+    if (!smp_init())
+        return PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
+
+    p = new_pending(PENDING_RDMSR);
+    if (!p)
+        return NULL;
+    p->u.msr.num = num;
+    p->u.msr.status = -1;
+    return start_pending(apicid, p, rdmsr_callback, &p->u.msr);
+}
+
+static PyObject *bits_wrmsr_async(PyObject *self, PyObject *args)
+{
+    struct pending *p;
+    U32 apicid, num;
+    U64 value;
+
+    if (!PyArg_ParseTuple(args, "IIK", &apicid, &num, &value))
+        return NULL;
+
+    if (!smp_init())
+        return PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
+
+    p = new_pending(PENDING_WRMSR);
+    if (!p)
+        return NULL;
+    p->u.msr.num = num;
+    p->u.msr.value = value;
+    p->u.msr.status = -1;
+    return start_pending(apicid, p, wrmsr_callback, &p->u.msr);
+}
+
+static struct pending *get_pending(PyObject *capsule)
+{
+    return PyCapsule_GetPointer(capsule, PENDING_CAPSULE_NAME);
+}
+
+static PyObject *pending_result(struct pending *p)
+{
+    switch (p->op) {
+    case PENDING_CPUID:
+        return Py_BuildValue("IIII", p->u.regs.eax, p->u.regs.ebx, p->u.regs.ecx, p->u.regs.edx);
+    case PENDING_RDMSR:
+        if (p->u.msr.status)
+            return Py_BuildValue("");
+        return Py_BuildValue("K", p->u.msr.value);
+    case PENDING_WRMSR:
+        return PyBool_FromLong(!p->u.msr.status);
+    }
+    return PyErr_Format(PyExc_RuntimeError, "Internal error: unknown pending operation %u", p->op);
+}
+
+static PyObject *bits_wait(PyObject *self, PyObject *args)
+{
+    PyObject *capsule;
+    struct pending *p;
+
+    if (!PyArg_ParseTuple(args, "O:wait", &capsule))
+        return NULL;
+    p = get_pending(capsule);
+    if (!p)
+        return NULL;
+
+    smp_wait(&p->handle);
+    return pending_result(p);
+}
+
+static PyObject *bits_poll(PyObject *self, PyObject *args)
+{
+    PyObject *capsule;
+    struct pending *p;
+
+    if (!PyArg_ParseTuple(args, "O:poll", &capsule))
+        return NULL;
+    p = get_pending(capsule);
+    if (!p)
+        return NULL;
+
+    return PyBool_FromLong(smp_poll(&p->handle));
+}
+
+static PyObject *bits_wait_any(PyObject *self, PyObject *args)
+{
+    PyObject *seq_obj;
+    PyObject *seq;
+    SMP_HANDLE *handles;
+    Py_ssize_t count, i;
+    U32 done;
+
+    if (!PyArg_ParseTuple(args, "O:wait_any", &seq_obj))
+        return NULL;
+    seq = PySequence_Fast(seq_obj, "expected a sequence of pending calls");
+    if (!seq)
+        return NULL;
+    count = PySequence_Fast_GET_SIZE(seq);
+    if (!count) {
+        Py_DECREF(seq);
+        return PyErr_Format(PyExc_ValueError, "wait_any needs at least one pending call");
+    }
+
+    handles = grub_malloc(count * sizeof(*handles));
+    if (!handles) {
+        Py_DECREF(seq);
+        return PyErr_NoMemory();
+    }
+    for (i = 0; i < count; i++) {
+        struct pending *p = get_pending(PySequence_Fast_GET_ITEM(seq, i));
+        if (!p) {
+            grub_free(handles);
+            Py_DECREF(seq);
+            return NULL;
+        }
+        handles[i] = p->handle;
+    }
+    Py_DECREF(seq);
+
+    done = smp_wait_any(handles, count);
+    grub_free(handles);
+    if (done == count)
+        return PyErr_Format(PyExc_RuntimeError, "SMP wait_any returned an error");
+    return Py_BuildValue("I", done);
+}
+
+static void inb_callback(void *param)
+{
+    struct memop *m = param;
+    m->value = grub_inb(m->addr);
+}
+
+static char *in_keywords[] = {"port", "apicid", NULL};
+
+static PyObject *bits_inb(PyObject *self, PyObject *args, PyObject *keywds)
+{
+    struct memop m;
+    U16 port;
+    unsigned apicid;
+
+    if (!smp_init())
+        return PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
+    apicid = bsp_apicid();
+
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "H|I", in_keywords, &port, &apicid))
+        return NULL;
+    m.addr = port;
+
+    if (!smp_function(apicid, inb_callback, &m))
+        return Py_BuildValue("");
+    return Py_BuildValue("B", (U8)m.value);
+}
+
+static void inw_callback(void *param)
+{
+    struct memop *m = param;
+    m->value = grub_inw(m->addr);
+}
+
+static PyObject *bits_inw(PyObject *self, PyObject *args, PyObject *keywds)
+{
+    struct memop m;
+    U16 port;
+    unsigned apicid;
+
+    if (!smp_init())
+        return PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
+    apicid = bsp_apicid();
+
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "H|I", in_keywords, &port, &apicid))
+        return NULL;
+    m.addr = port;
+
+    if (!smp_function(apicid, inw_callback, &m))
+        return Py_BuildValue("");
+    return Py_BuildValue("H", (U16)m.value);
+}
+
+static void inl_callback(void *param)
+{
+    struct memop *m = param;
+    m->value = grub_inl(m->addr);
+}
+
+static PyObject *bits_inl(PyObject *self, PyObject *args, PyObject *keywds)
+{
+    struct memop m;
+    U16 port;
+    unsigned apicid;
+
+    if (!smp_init())
+        return PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
+    apicid = bsp_apicid();
+
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "H|I", in_keywords, &port, &apicid))
+        return NULL;
+    m.addr = port;
+
+    if (!smp_function(apicid, inl_callback, &m))
+        return Py_BuildValue("");
+    return Py_BuildValue("I", (U32)m.value);
+}
+
+static void outb_callback(void *param)
+{
+    struct memop *m = param;
+    grub_outb(m->value, m->addr);
+}
+
+static char *out_keywords[] = {"port", "value", "apicid", NULL};
+
+static PyObject *bits_outb(PyObject *self, PyObject *args, PyObject *keywds)
+{
+    struct memop m;
+    U16 port;
+    U8 value;
+    unsigned apicid;
+
+    if (!smp_init())
+        return PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
+    apicid = bsp_apicid();
+
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "HB|I", out_keywords, &port, &value, &apicid))
+        return NULL;
+    m.addr = port;
+    m.value = value;
+
+    smp_function(apicid, outb_callback, &m);
+    return Py_BuildValue("");
+}
+
+static void outw_callback(void *param)
+{
+    struct memop *m = param;
+    grub_outw(m->value, m->addr);
+}
+
+static PyObject *bits_outw(PyObject *self, PyObject *args, PyObject *keywds)
+{
+    struct memop m;
+    U16 port;
+    U16 value;
+    unsigned apicid;
+
+    if (!smp_init())
+        return PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
+    apicid = bsp_apicid();
+
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "HH|I", out_keywords, &port, &value, &apicid))
+        return NULL;
+    m.addr = port;
+    m.value = value;
+
+    smp_function(apicid, outw_callback, &m);
+    return Py_BuildValue("");
+}
+
+static void outl_callback(void *param)
+{
+    struct memop *m = param;
+    grub_outl(m->value, m->addr);
+}
+
+static PyObject *bits_outl(PyObject *self, PyObject *args, PyObject *keywds)
+{
+    struct memop m;
+    U16 port;
+    U32 value;
+    unsigned apicid;
+
+    if (!smp_init())
+        return PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
+    apicid = bsp_apicid();
+
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "HI|I", out_keywords, &port, &value, &apicid))
+        return NULL;
+    m.addr = port;
+    m.value = value;
+
+    smp_function(apicid, outl_callback, &m);
+    return Py_BuildValue("");
+}
+
+static void readb_callback(void *param)
+{
+    struct memop *m = param;
+    m->value = *(U8 *)(m->addr);
+}
+
+static char *read_keywords[] = {"address", "apicid", NULL};
+
+static PyObject *bits_readb(PyObject *self, PyObject *args, PyObject *keywds)
+{
+    struct memop m;
+    unsigned apicid;
+
+    if (!smp_init())
+        return PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
+    apicid = bsp_apicid();
+
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "k|I", read_keywords, &m.addr, &apicid))
+        return NULL;
+
+    if (!smp_function(apicid, readb_callback, &m))
+        return Py_BuildValue("");
+    return Py_BuildValue("B", (U8)m.value);
+}
+
+static void readw_callback(void *param)
+{
+    struct memop *m = param;
+    m->value = *(U16 *)(m->addr);
+}
+
+static PyObject *bits_readw(PyObject *self, PyObject *args, PyObject *keywds)
+{
+    struct memop m;
+    unsigned apicid;
+
+    if (!smp_init())
+        return PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
+    apicid = bsp_apicid();
+
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "k|I", read_keywords, &m.addr, &apicid))
+        return NULL;
+
+    if (!smp_function(apicid, readw_callback, &m))
+        return Py_BuildValue("");
+    return Py_BuildValue("H", (U16)m.value);
+}
+
+static void readl_callback(void *param)
+{
+    struct memop *m = param;
+    m->value = *(U32 *)(m->addr);
+}
+
+static PyObject *bits_readl(PyObject *self, PyObject *args, PyObject *keywds)
+{
+    struct memop m;
+    unsigned apicid;
+
+    if (!smp_init())
+        return PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
+    apicid = bsp_apicid();
+
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "k|I", read_keywords, &m.addr, &apicid))
+        return NULL;
+
+    if (!smp_function(apicid, readl_callback, &m))
+        return Py_BuildValue("");
+    return Py_BuildValue("I", (U32)m.value);
+}
+
+static void readq_callback(void *param)
+{
+    struct memop *m = param;
+    m->value = *(U64 *)m->addr;
+}
+
+static PyObject *bits_readq(PyObject *self, PyObject *args, PyObject *keywds)
+{
+    struct memop m;
+    unsigned apicid;
 
     if (!smp_init())
         return PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
     apicid = bsp_apicid();
 
-    if (!PyArg_ParseTupleAndKeywords(args, keywds, "H|I", in_keywords, &port, &apicid))
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "k|I", read_keywords, &m.addr, &apicid))
         return NULL;
-    m.addr = port;
 
-    if (!smp_function(apicid, inl_callback, &m))
+    if (!smp_function(apicid, readq_callback, &m))
         return Py_BuildValue("");
-    return Py_BuildValue("I", (U32)m.value);
+    return Py_BuildValue("K", m.value);
 }
 
-static void outb_callback(void *param)
+static void writeb_callback(void *param)
 {
     struct memop *m = param;
-    grub_outb(m->value, m->addr);
+    *(U8 *)(m->addr) = m->value;
 }
 
-static char *out_keywords[] = {"port", "value", "apicid", NULL};
+static char *write_keywords[] = {"address", "value", "apicid", NULL};
 
-static PyObject *bits_outb(PyObject *self, PyObject *args, PyObject *keywds)
+static PyObject *bits_writeb(PyObject *self, PyObject *args, PyObject *keywds)
 {
     struct memop m;
-    U16 port;
     U8 value;
     unsigned apicid;
 
@@ -294,25 +1933,23 @@ static PyObject *bits_outb(PyObject *self, PyObject *args, PyObject *keywds)
         return PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
     apicid = bsp_apicid();
 
-    if (!PyArg_ParseTupleAndKeywords(args, keywds, "HB|I", out_keywords, &port, &value, &apicid))
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "kB|I", write_keywords, &m.addr, &value, &apicid))
         return NULL;
-    m.addr = port;
     m.value = value;
 
-    smp_function(apicid, outb_callback, &m);
+    smp_function(apicid, writeb_callback, &m);
     return Py_BuildValue("");
 }
 
-static void outw_callback(void *param)
+static void writew_callback(void *param)
 {
     struct memop *m = param;
-    grub_outw(m->value, m->addr);
+    *(U16 *)(m->addr) = m->value;
 }
 
-static PyObject *bits_outw(PyObject *self, PyObject *args, PyObject *keywds)
+static PyObject *bits_writew(PyObject *self, PyObject *args, PyObject *keywds)
 {
     struct memop m;
-    U16 port;
     U16 value;
     unsigned apicid;
 
@@ -320,25 +1957,23 @@ static PyObject *bits_outw(PyObject *self, PyObject *args, PyObject *keywds)
         return PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
     apicid = bsp_apicid();
 
-    if (!PyArg_ParseTupleAndKeywords(args, keywds, "HH|I", out_keywords, &port, &value, &apicid))
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "kH|I", write_keywords, &m.addr, &value, &apicid))
         return NULL;
-    m.addr = port;
     m.value = value;
 
-    smp_function(apicid, outw_callback, &m);
+    smp_function(apicid, writew_callback, &m);
     return Py_BuildValue("");
 }
 
-static void outl_callback(void *param)
+static void writel_callback(void *param)
 {
     struct memop *m = param;
-    grub_outl(m->value, m->addr);
+    *(U32 *)(m->addr) = m->value;
 }
 
-static PyObject *bits_outl(PyObject *self, PyObject *args, PyObject *keywds)
+static PyObject *bits_writel(PyObject *self, PyObject *args, PyObject *keywds)
 {
     struct memop m;
-    U16 port;
     U32 value;
     unsigned apicid;
 
@@ -346,24 +1981,21 @@ static PyObject *bits_outl(PyObject *self, PyObject *args, PyObject *keywds)
         return PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
     apicid = bsp_apicid();
 
-    if (!PyArg_ParseTupleAndKeywords(args, keywds, "HI|I", out_keywords, &port, &value, &apicid))
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "kI|I", write_keywords, &m.addr, &value, &apicid))
         return NULL;
-    m.addr = port;
     m.value = value;
 
-    smp_function(apicid, outl_callback, &m);
+    smp_function(apicid, writel_callback, &m);
     return Py_BuildValue("");
 }
 
-static void readb_callback(void *param)
+static void writeq_callback(void *param)
 {
     struct memop *m = param;
-    m->value = *(U8 *)(m->addr);
+    *(U64 *)(m->addr) = m->value;
 }
 
-static char *read_keywords[] = {"address", "apicid", NULL};
-
-static PyObject *bits_readb(PyObject *self, PyObject *args, PyObject *keywds)
+static PyObject *bits_writeq(PyObject *self, PyObject *args, PyObject *keywds)
 {
     struct memop m;
     unsigned apicid;
@@ -372,200 +2004,1090 @@ static PyObject *bits_readb(PyObject *self, PyObject *args, PyObject *keywds)
         return PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
     apicid = bsp_apicid();
 
-    if (!PyArg_ParseTupleAndKeywords(args, keywds, "k|I", read_keywords, &m.addr, &apicid))
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "kK|I", write_keywords, &m.addr, &m.value, &apicid))
         return NULL;
 
-    if (!smp_function(apicid, readb_callback, &m))
-        return Py_BuildValue("");
-    return Py_BuildValue("B", (U8)m.value);
+    smp_function(apicid, writeq_callback, &m);
+    return Py_BuildValue("");
 }
 
-static void readw_callback(void *param)
+/* Memory bandwidth kernels, in the style of STREAM: read streams through a,
+ * write fills a, copy copies b to a, and triad sets a = b + 3.0 * c in
+ * doubles.  They use SSE2 with non-temporal stores, so that writes do not
+ * first read each line into the cache.  AP startup enables SSE in CR4, but
+ * nothing does so on the BSP, so each CPU sets CR4.OSFXSR and OSXMMEXCPT
+ * around the kernels and then restores CR4.  Buffers must be 64-byte
+ * aligned and a multiple of 64 bytes long. */
+enum membw_kernel {
+    MEMBW_READ,
+    MEMBW_WRITE,
+    MEMBW_COPY,
+    MEMBW_TRIAD,
+};
+
+static const char *membw_kernel_names[] = { "read", "write", "copy", "triad", NULL };
+
+#define MEMBW_ALIGN 64
+#define MEMBW_NO_JOB 0xffffffff
+#define MEMBW_CR4_SSE 0x600     /* OSFXSR and OSXMMEXCPT */
+
+static unsigned long membw_read_cr4(void)
 {
-    struct memop *m = param;
-    m->value = *(U16 *)(m->addr);
+    unsigned long cr4;
+    __asm__ __volatile__ ("mov %%cr4, %0" : "=r" (cr4));
+    return cr4;
 }
 
-static PyObject *bits_readw(PyObject *self, PyObject *args, PyObject *keywds)
+static void membw_write_cr4(unsigned long cr4)
 {
-    struct memop m;
+    __asm__ __volatile__ ("mov %0, %%cr4" : : "r" (cr4) : "memory");
+}
+
+/* Code built without SSE never allocates the XMM registers, and the compiler
+ * refuses clobbers of them. */
+#ifdef __SSE__
+#define MEMBW_XMM_CLOBBERS "xmm0", "xmm1", "xmm2", "xmm3", "xmm4",
+#else
+#define MEMBW_XMM_CLOBBERS
+#endif
+
+static const U64 membw_triad_scalar[2] __attribute__((aligned(16))) = { 0x4008000000000000ULL, 0x4008000000000000ULL }; /* 3.0, 3.0 */
+
+static void membw_read(unsigned long a, unsigned long size)
+{
+    __asm__ __volatile__ ("1:\n\t"
+                          "movdqa (%[a]), %%xmm0\n\t"
+                          "movdqa 16(%[a]), %%xmm1\n\t"
+                          "movdqa 32(%[a]), %%xmm2\n\t"
+                          "movdqa 48(%[a]), %%xmm3\n\t"
+                          "add $64, %[a]\n\t"
+                          "sub $64, %[size]\n\t"
+                          "jnz 1b"
+                          : [a] "+r" (a), [size] "+r" (size)
+                          :
+                          : MEMBW_XMM_CLOBBERS "cc", "memory");
+}
+
+static void membw_write(unsigned long a, unsigned long size)
+{
+    __asm__ __volatile__ ("pxor %%xmm0, %%xmm0\n\t"
+                          "1:\n\t"
+                          "movntdq %%xmm0, (%[a])\n\t"
+                          "movntdq %%xmm0, 16(%[a])\n\t"
+                          "movntdq %%xmm0, 32(%[a])\n\t"
+                          "movntdq %%xmm0, 48(%[a])\n\t"
+                          "add $64, %[a]\n\t"
+                          "sub $64, %[size]\n\t"
+                          "jnz 1b"
+                          : [a] "+r" (a), [size] "+r" (size)
+                          :
+                          : MEMBW_XMM_CLOBBERS "cc", "memory");
+}
+
+static void membw_copy(unsigned long a, unsigned long b, unsigned long size)
+{
+    __asm__ __volatile__ ("1:\n\t"
+                          "movdqa (%[b]), %%xmm0\n\t"
+                          "movdqa 16(%[b]), %%xmm1\n\t"
+                          "movdqa 32(%[b]), %%xmm2\n\t"
+                          "movdqa 48(%[b]), %%xmm3\n\t"
+                          "movntdq %%xmm0, (%[a])\n\t"
+                          "movntdq %%xmm1, 16(%[a])\n\t"
+                          "movntdq %%xmm2, 32(%[a])\n\t"
+                          "movntdq %%xmm3, 48(%[a])\n\t"
+                          "add $64, %[a]\n\t"
+                          "add $64, %[b]\n\t"
+                          "sub $64, %[size]\n\t"
+                          "jnz 1b"
+                          : [a] "+r" (a), [b] "+r" (b), [size] "+r" (size)
+                          :
+                          : MEMBW_XMM_CLOBBERS "cc", "memory");
+}
+
+static void membw_triad(unsigned long a, unsigned long b, unsigned long c, unsigned long size)
+{
+    __asm__ __volatile__ ("movapd %[scalar], %%xmm4\n\t"
+                          "1:\n\t"
+                          "movapd (%[b]), %%xmm0\n\t"
+                          "movapd 16(%[b]), %%xmm1\n\t"
+                          "movapd (%[c]), %%xmm2\n\t"
+                          "movapd 16(%[c]), %%xmm3\n\t"
+                          "mulpd %%xmm4, %%xmm2\n\t"
+                          "mulpd %%xmm4, %%xmm3\n\t"
+                          "addpd %%xmm2, %%xmm0\n\t"
+                          "addpd %%xmm3, %%xmm1\n\t"
+                          "movntpd %%xmm0, (%[a])\n\t"
+                          "movntpd %%xmm1, 16(%[a])\n\t"
+                          "movapd 32(%[b]), %%xmm0\n\t"
+                          "movapd 48(%[b]), %%xmm1\n\t"
+                          "movapd 32(%[c]), %%xmm2\n\t"
+                          "movapd 48(%[c]), %%xmm3\n\t"
+                          "mulpd %%xmm4, %%xmm2\n\t"
+                          "mulpd %%xmm4, %%xmm3\n\t"
+                          "addpd %%xmm2, %%xmm0\n\t"
+                          "addpd %%xmm3, %%xmm1\n\t"
+                          "movntpd %%xmm0, 32(%[a])\n\t"
+                          "movntpd %%xmm1, 48(%[a])\n\t"
+                          "add $64, %[a]\n\t"
+                          "add $64, %[b]\n\t"
+                          "add $64, %[c]\n\t"
+                          "sub $64, %[size]\n\t"
+                          "jnz 1b"
+                          : [a] "+r" (a), [b] "+r" (b), [c] "+r" (c), [size] "+r" (size)
+                          : [scalar] "m" (membw_triad_scalar)
+                          : MEMBW_XMM_CLOBBERS "cc", "memory");
+}
+
+struct membw_job {
+    unsigned long a, b, c;
+    U64 start;
+    U64 end;
+    bool done;
+};
+
+struct membw {
+    enum membw_kernel kernel;
+    unsigned long size;
+    U32 iterations;
+    SMP_BARRIER *barrier;
+    U32 *job;               /* job for each CPU index, or MEMBW_NO_JOB */
+    struct membw_job *jobs;
+};
+
+static void membw_callback(void *param)
+{
+    struct membw *m = param;
+    struct membw_job *j;
+    unsigned long cr4;
+    U32 index, i;
+
+    if (!smp_read_cpu_index(&index) || m->job[index] == MEMBW_NO_JOB)
+        return;
+    j = &m->jobs[m->job[index]];
+
+    cr4 = membw_read_cr4();
+    if ((cr4 & MEMBW_CR4_SSE) != MEMBW_CR4_SSE)
+        membw_write_cr4(cr4 | MEMBW_CR4_SSE);
+    if (!smp_barrier_wait(m->barrier))
+        goto out;
+    j->start = rdtsc64();
+    for (i = 0; i < m->iterations; i++) {
+        switch (m->kernel) {
+        case MEMBW_READ:
+            membw_read(j->a, m->size);
+            break;
+        case MEMBW_WRITE:
+            membw_write(j->a, m->size);
+            break;
+        case MEMBW_COPY:
+            membw_copy(j->a, j->b, m->size);
+            break;
+        case MEMBW_TRIAD:
+            membw_triad(j->a, j->b, j->c, m->size);
+            break;
+        }
+    }
+    __asm__ __volatile__ ("sfence" ::: "memory");
+    j->end = rdtsc64();
+    j->done = true;
+out:
+    if ((cr4 & MEMBW_CR4_SSE) != MEMBW_CR4_SSE)
+        membw_write_cr4(cr4);
+}
+
+static char *membw_keywords[] = {"kernel", "jobs", "size", "iterations", NULL};
+
+static PyObject *bits_membw(PyObject *self, PyObject *args, PyObject *keywds)
+{
+    struct membw m;
+    const char *kernel;
+    PyObject *jobs_obj, *seq = NULL, *list = NULL;
+    void *barrier_memory = NULL;
+    U32 *mask = NULL;
+    U32 ncpus, njobs = 0, i, index;
+    unsigned long size;
+    U32 iterations = 1;
+
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "sOk|I:membw", membw_keywords, &kernel, &jobs_obj, &size, &iterations))
+        return NULL;
+    for (i = 0; membw_kernel_names[i]; i++)
+        if (!strcmp(kernel, membw_kernel_names[i]))
+            break;
+    if (!membw_kernel_names[i])
+        return PyErr_Format(PyExc_ValueError, "kernel must be \"read\", \"write\", \"copy\", or \"triad\"");
+    m.kernel = i;
+    if (!size || size % MEMBW_ALIGN)
+        return PyErr_Format(PyExc_ValueError, "size must be a nonzero multiple of %u bytes", MEMBW_ALIGN);
+    m.size = size;
+    m.iterations = iterations;
+
+    ncpus = smp_init();
+    if (!ncpus)
+        return PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
+
+    seq = PySequence_Fast(jobs_obj, "expected a sequence of (apicid, a, b, c)");
+    if (!seq)
+        return NULL;
+    njobs = PySequence_Fast_GET_SIZE(seq);
+    m.job = grub_malloc(ncpus * sizeof(*m.job));
+    m.jobs = grub_zalloc((njobs ? njobs : 1) * sizeof(*m.jobs));
+    mask = grub_zalloc(SMP_MASK_WORDS(ncpus) * sizeof(*mask));
+    barrier_memory = grub_memalign(SMP_MWAIT_ALIGN, smp_barrier_size());
+    if (!m.job || !m.jobs || !mask || !barrier_memory) {
+        PyErr_NoMemory();
+        goto out;
+    }
+    for (index = 0; index < ncpus; index++)
+        m.job[index] = MEMBW_NO_JOB;
+
+    for (i = 0; i < njobs; i++) {
+        struct membw_job *j = &m.jobs[i];
+        U32 apicid;
+        bool found;
+        if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(seq, i), "Ikkk:membw", &apicid, &j->a, &j->b, &j->c))
+            goto out;
+        found = smp_lookup_cpu_index(apicid, &index);
+        if (!found || m.job[index] != MEMBW_NO_JOB) {
+            PyErr_Format(PyExc_ValueError, !found ? "apicid 0x%x not found" : "apicid 0x%x listed twice", apicid);
+            goto out;
+        }
+        if ((j->a | j->b | j->c) % MEMBW_ALIGN) {
+            PyErr_Format(PyExc_ValueError, "buffers must be aligned to %u bytes", MEMBW_ALIGN);
+            goto out;
+        }
+        m.job[index] = i;
+        SMP_MASK_SET(mask, index);
+    }
+
+    m.barrier = smp_barrier_init(barrier_memory, mask, 0);
+    if (njobs && !smp_function_mask(mask, membw_callback, &m)) {
+        PyErr_Format(PyExc_RuntimeError, "SMP function returned an error");
+        goto out;
+    }
+
+    list = PyList_New(njobs);
+    if (!list)
+        goto out;
+    for (i = 0; i < njobs; i++) {
+        PyObject *times;
+        if (!m.jobs[i].done) {
+            Py_CLEAR(list);
+            PyErr_Format(PyExc_RuntimeError, "CPU for job %u did not run the benchmark", i);
+            goto out;
+        }
+        times = Py_BuildValue("KK", m.jobs[i].start, m.jobs[i].end);
+        if (!times) {
+            Py_CLEAR(list);
+            goto out;
+        }
+        PyList_SET_ITEM(list, i, times);
+    }
+
+out:
+    Py_XDECREF(seq);
+    grub_free(barrier_memory);
+    grub_free(mask);
+    grub_free(m.jobs);
+    grub_free(m.job);
+    return list;
+}
+
+/* Pointer chase: a chain of dependent loads through a buffer, in random
+ * order so that neither the prefetchers nor the out-of-order core can hide
+ * the latency of each load.  The buffer holds one pointer every stride
+ * bytes.  The chain visits every element of each block of block bytes, in a
+ * random order, before it moves on to another block, with the blocks in a
+ * random order too.  A block of a page or a large page bounds the TLB misses;
+ * a block of the whole buffer makes the chain fully random. */
+struct chase {
+    unsigned long base;
+    unsigned long size;
+    unsigned long stride;
+    unsigned long block;
+    U32 seed;
+    U64 loads;
+    U64 ticks;
+    unsigned long end;          /* where the chase stopped; keeps it live */
+    bool done;
+};
+
+static U32 chase_random(U32 *state)
+{
+    /* xorshift32 */
+    U32 x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+#define CHASE_SLOT(c, index) (*(unsigned long *)((c)->base + (unsigned long)(index) * (c)->stride))
+
+/* Sattolo's algorithm: a random permutation of the n slots starting at first
+ * that forms a single cycle, stored as the index of each slot's successor,
+ * relative to first. */
+static void chase_cycle(struct chase *c, U32 first, U32 n, U32 *state)
+{
+    U32 i, j;
+    unsigned long tmp;
+
+    for (i = 0; i < n; i++)
+        CHASE_SLOT(c, first + i) = i;
+    for (i = n - 1; i > 0; i--) {
+        j = chase_random(state) % i;
+        tmp = CHASE_SLOT(c, first + i);
+        CHASE_SLOT(c, first + i) = CHASE_SLOT(c, first + j);
+        CHASE_SLOT(c, first + j) = tmp;
+    }
+}
+
+static void chase_build(struct chase *c)
+{
+    U32 per_block = c->block / c->stride;
+    U32 nblocks = c->size / c->block;
+    U32 state = c->seed ? c->seed : 1;
+    U32 block, next_block, e, s;
+
+    /* Order the blocks by a cycle through the first slot of each; each
+     * block then replaces that with its own cycle, just before it is
+     * converted, so the first slot of every later block still holds the
+     * block cycle. */
+    for (block = 0; block < nblocks; block++)
+        CHASE_SLOT(c, block * per_block) = block;
+    for (block = nblocks - 1; block > 0; block--) {
+        U32 j = chase_random(&state) % block;
+        unsigned long tmp = CHASE_SLOT(c, block * per_block);
+        CHASE_SLOT(c, block * per_block) = CHASE_SLOT(c, j * per_block);
+        CHASE_SLOT(c, j * per_block) = tmp;
+    }
+
+    block = 0;
+    do {
+        next_block = CHASE_SLOT(c, block * per_block);
+        chase_cycle(c, block * per_block, per_block, &state);
+        /* Walk the cycle from its first slot, turning indices into
+         * pointers, and send its last slot on to the next block. */
+        for (e = 0; ; e = s) {
+            s = CHASE_SLOT(c, block * per_block + e);
+            if (s == 0) {
+                CHASE_SLOT(c, block * per_block + e) = c->base + (unsigned long)next_block * c->block;
+                break;
+            }
+            CHASE_SLOT(c, block * per_block + e) = c->base + (unsigned long)(block * per_block + s) * c->stride;
+        }
+        block = next_block;
+    } while (block != 0);
+}
+
+static unsigned long chase_loads(unsigned long p, U64 loads)
+{
+    for (; loads >= 8; loads -= 8) {
+        p = *(volatile unsigned long *)p;
+        p = *(volatile unsigned long *)p;
+        p = *(volatile unsigned long *)p;
+        p = *(volatile unsigned long *)p;
+        p = *(volatile unsigned long *)p;
+        p = *(volatile unsigned long *)p;
+        p = *(volatile unsigned long *)p;
+        p = *(volatile unsigned long *)p;
+    }
+    for (; loads; loads--)
+        p = *(volatile unsigned long *)p;
+    return p;
+}
+
+static void chase_callback(void *param)
+{
+    struct chase *c = param;
+    unsigned long p;
+    U64 start;
+
+    chase_build(c);
+    /* One untimed pass to bring the chain into whatever level of cache it
+     * fits in. */
+    p = chase_loads(c->base, c->size / c->stride);
+    start = rdtsc64();
+    p = chase_loads(p, c->loads);
+    c->ticks = rdtsc64() - start;
+    c->end = p;
+    c->done = true;
+}
+
+static char *pointer_chase_keywords[] = {"address", "size", "loads", "stride", "block", "seed", "apicid", NULL};
+
+static PyObject *bits_pointer_chase(PyObject *self, PyObject *args, PyObject *keywds)
+{
+    struct chase c;
     unsigned apicid;
 
     if (!smp_init())
         return PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
     apicid = bsp_apicid();
 
-    if (!PyArg_ParseTupleAndKeywords(args, keywds, "k|I", read_keywords, &m.addr, &apicid))
+    memset(&c, 0, sizeof(c));
+    c.stride = 64;
+    c.seed = 1;
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "kkK|kkII:pointer_chase", pointer_chase_keywords, &c.base, &c.size, &c.loads, &c.stride, &c.block, &c.seed, &apicid))
         return NULL;
+    if (!c.block)
+        c.block = c.size;
+    if (c.stride < sizeof(unsigned long) || c.stride % sizeof(unsigned long) || c.base % sizeof(unsigned long))
+        return PyErr_Format(PyExc_ValueError, "stride and address must be multiples of the pointer size");
+    if (!c.size || c.block % c.stride || c.size % c.block)
+        return PyErr_Format(PyExc_ValueError, "size must be a nonzero multiple of block, and block of stride");
+    if (c.size / c.stride > 0xffffffff)
+        return PyErr_Format(PyExc_ValueError, "size / stride must fit in 32 bits");
+
+    if (!smp_function(apicid, chase_callback, &c) || !c.done)
+        return PyErr_Format(PyExc_RuntimeError, "SMP function returned an error; does apicid 0x%x exist?", apicid);
+    return Py_BuildValue("K", c.ticks);
+}
 
-    if (!smp_function(apicid, readw_callback, &m))
-        return Py_BuildValue("");
-    return Py_BuildValue("H", (U16)m.value);
+/* Ping-pong: two CPUs bounce one cache line between them with atomic
+ * exchanges.  The first CPU stores an odd sequence number and waits for the
+ * second to answer with the next even one, so each round trip moves the line
+ * to the other CPU and back.  The line sits alone in a 128-byte block, so
+ * that the adjacent-line prefetcher does not drag a neighbour along. */
+#define PING_PONG_ALIGN 128
+#define PING_PONG_WARMUP 16
+#define PING_PONG_MAX_ROUND_TRIPS 0x3fffffff
+
+struct ping_pong {
+    volatile U32 *line;
+    U32 pinger;             /* CPU index of the CPU that starts each round trip */
+    U32 round_trips;
+    SMP_BARRIER *barrier;
+    U64 ticks;
+    bool done;
+};
+
+static U32 ping_pong_xchg(volatile U32 *p, U32 value)
+{
+    __asm__ __volatile__ ("xchg %0, %1" : "+r" (value), "+m" (*p) : : "memory");
+    return value;
 }
 
-static void readl_callback(void *param)
+static void ping_pong_callback(void *param)
 {
-    struct memop *m = param;
-    m->value = *(U32 *)(m->addr);
+    struct ping_pong *p = param;
+    volatile U32 *line = p->line;
+    U32 index, i, seq;
+    U64 start = 0;
+    bool pinger;
+
+    if (!smp_read_cpu_index(&index))
+        return;
+    pinger = index == p->pinger;
+    if (!smp_barrier_wait(p->barrier))
+        return;
+    /* The first round trips also wait for the other CPU to leave the
+     * barrier, so leave them out of the time. */
+    for (i = 0; i < PING_PONG_WARMUP + p->round_trips; i++) {
+        seq = 2 * i + 1;
+        if (pinger) {
+            if (i == PING_PONG_WARMUP)
+                start = rdtsc64();
+            ping_pong_xchg(line, seq);
+            while (*line != seq + 1)
+                __asm__ __volatile__ ("pause");
+        } else {
+            while (*line != seq)
+                __asm__ __volatile__ ("pause");
+            ping_pong_xchg(line, seq + 1);
+        }
+    }
+    /* The last answer means the other CPU has finished too. */
+    if (pinger) {
+        p->ticks = rdtsc64() - start;
+        p->done = true;
+    }
 }
 
-static PyObject *bits_readl(PyObject *self, PyObject *args, PyObject *keywds)
+static char *ping_pong_keywords[] = {"apicid", "other", "round_trips", NULL};
+
+static PyObject *bits_ping_pong(PyObject *self, PyObject *args, PyObject *keywds)
 {
-    struct memop m;
+    struct ping_pong p;
+    PyObject *ret = NULL;
+    void *barrier_memory = NULL;
+    U32 *mask = NULL;
+    U32 ncpus, apicid, other, other_index;
+
+    memset(&p, 0, sizeof(p));
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "III:ping_pong", ping_pong_keywords, &apicid, &other, &p.round_trips))
+        return NULL;
+    if (!p.round_trips || p.round_trips > PING_PONG_MAX_ROUND_TRIPS)
+        return PyErr_Format(PyExc_ValueError, "round_trips must be between 1 and %u", PING_PONG_MAX_ROUND_TRIPS);
+
+    ncpus = smp_init();
+    if (!ncpus)
+        return PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
+    if (!smp_lookup_cpu_index(apicid, &p.pinger))
+        return PyErr_Format(PyExc_ValueError, "apicid 0x%x not found", apicid);
+    if (!smp_lookup_cpu_index(other, &other_index))
+        return PyErr_Format(PyExc_ValueError, "apicid 0x%x not found", other);
+    if (other_index == p.pinger)
+        return PyErr_Format(PyExc_ValueError, "ping_pong needs two different CPUs");
+
+    p.line = grub_memalign(PING_PONG_ALIGN, PING_PONG_ALIGN);
+    mask = grub_zalloc(SMP_MASK_WORDS(ncpus) * sizeof(*mask));
+    barrier_memory = grub_memalign(SMP_MWAIT_ALIGN, smp_barrier_size());
+    if (!p.line || !mask || !barrier_memory) {
+        PyErr_NoMemory();
+        goto out;
+    }
+    *p.line = 0;
+    SMP_MASK_SET(mask, p.pinger);
+    SMP_MASK_SET(mask, other_index);
+    p.barrier = smp_barrier_init(barrier_memory, mask, 0);
+
+    if (!smp_function_mask(mask, ping_pong_callback, &p) || !p.done) {
+        PyErr_Format(PyExc_RuntimeError, "SMP function returned an error");
+        goto out;
+    }
+    ret = Py_BuildValue("K", p.ticks);
+
+out:
+    grub_free(barrier_memory);
+    grub_free(mask);
+    grub_free((void *)p.line);
+    return ret;
+}
+
+/* Register programs: a sequence of register accesses that Python packs once
+ * and one CPU runs in a single dispatch.  Each operation is 32 bytes,
+ * little-endian:
+ *
+ *     U8 op, width, dst, src, base, shift; U16 flags; U64 addr, mask, value
+ *
+ * The register accessed is addr, plus slots[base] unless base is
+ * REGPROG_NO_SLOT.  A read stores (raw >> shift) & mask in slots[dst], or
+ * discards it if dst is REGPROG_NO_SLOT.  A write takes slots[src], or value
+ * if src is REGPROG_NO_SLOT, and writes (v & mask) << shift; with
+ * REGPROG_RMW, it first reads the register and keeps the bits outside
+ * mask << shift.  A GPF on an MSR access stops the program. */
+#define REGPROG_SLOTS 16
+#define REGPROG_NO_SLOT 0xff
+#define REGPROG_RMW 0x1
+#define REGPROG_MAX_OPS 256
+
+/* Reads and writes of each address space alternate, so that op & 1 says
+ * whether an op writes and op >> 1 which space it accesses. */
+enum regprog_opcode {
+    REGPROG_RDMSR,
+    REGPROG_WRMSR,
+    REGPROG_IN,
+    REGPROG_OUT,
+    REGPROG_READ,
+    REGPROG_WRITE,
+    REGPROG_OPCODES
+};
+
+#define REGPROG_IS_WRITE(op) ((op) & 1)
+#define REGPROG_SPACE(op) ((op) >> 1)
+#define REGPROG_SPACE_MSR 0
+#define REGPROG_SPACE_IO 1
+#define REGPROG_SPACE_MEM 2
+
+struct regprog_op {
+    U8 op;
+    U8 width;
+    U8 dst;
+    U8 src;
+    U8 base;
+    U8 shift;
+    U16 flags;
+    U64 addr;
+    U64 mask;
+    U64 value;
+};
+
+struct regprog {
+    const struct regprog_op *ops;
+    U32 count;
+    U32 completed;      /* less than count if op[completed] GPFd */
+    U64 slots[REGPROG_SLOTS];
+};
+
+static U64 regprog_read(const struct regprog_op *op, unsigned long addr, U32 *status)
+{
+    U64 value = 0;
+
+    *status = 0;
+    switch (REGPROG_SPACE(op->op)) {
+    case REGPROG_SPACE_MSR:
+        rdmsr64(addr, &value, status);
+        break;
+    case REGPROG_SPACE_IO:
+        if (op->width == 1)
+            value = grub_inb(addr);
+        else if (op->width == 2)
+            value = grub_inw(addr);
+        else
+            value = grub_inl(addr);
+        break;
+    case REGPROG_SPACE_MEM:
+        if (op->width == 1)
+            value = *(volatile U8 *)addr;
+        else if (op->width == 2)
+            value = *(volatile U16 *)addr;
+        else if (op->width == 4)
+            value = *(volatile U32 *)addr;
+        else
+            value = *(volatile U64 *)addr;
+        break;
+    }
+    return value;
+}
+
+static void regprog_write(const struct regprog_op *op, unsigned long addr, U64 value, U32 *status)
+{
+    *status = 0;
+    switch (REGPROG_SPACE(op->op)) {
+    case REGPROG_SPACE_MSR:
+        wrmsr64(addr, value, status);
+        break;
+    case REGPROG_SPACE_IO:
+        if (op->width == 1)
+            grub_outb(value, addr);
+        else if (op->width == 2)
+            grub_outw(value, addr);
+        else
+            grub_outl(value, addr);
+        break;
+    case REGPROG_SPACE_MEM:
+        if (op->width == 1)
+            *(volatile U8 *)addr = value;
+        else if (op->width == 2)
+            *(volatile U16 *)addr = value;
+        else if (op->width == 4)
+            *(volatile U32 *)addr = value;
+        else
+            *(volatile U64 *)addr = value;
+        break;
+    }
+}
+
+static void regprog_callback(void *param)
+{
+    struct regprog *p = param;
+    const struct regprog_op *op;
+    unsigned long addr;
+    U64 value, mask;
+    U32 status;
+
+    for (p->completed = 0; p->completed < p->count; p->completed++) {
+        op = &p->ops[p->completed];
+        addr = op->addr;
+        if (op->base != REGPROG_NO_SLOT)
+            addr += p->slots[op->base];
+        if (!REGPROG_IS_WRITE(op->op)) {
+            value = regprog_read(op, addr, &status);
+            if (status)
+                return;
+            if (op->dst != REGPROG_NO_SLOT)
+                p->slots[op->dst] = (value >> op->shift) & op->mask;
+            continue;
+        }
+        value = op->src == REGPROG_NO_SLOT ? op->value : p->slots[op->src];
+        mask = op->mask << op->shift;
+        value = (value << op->shift) & mask;
+        if (op->flags & REGPROG_RMW) {
+            value |= regprog_read(op, addr, &status) & ~mask;
+            if (status)
+                return;
+        }
+        regprog_write(op, addr, value, &status);
+        if (status)
+            return;
+    }
+}
+
+static bool regprog_valid_slot(U8 slot)
+{
+    return slot < REGPROG_SLOTS || slot == REGPROG_NO_SLOT;
+}
+
+/* Check every operation once on the BSP, so that the target CPU can run the
+ * program without checking anything. */
+static bool regprog_validate(const struct regprog_op *ops, U32 count)
+{
+    U32 i;
+
+    for (i = 0; i < count; i++) {
+        const struct regprog_op *op = &ops[i];
+        U8 width = op->width;
+        bool valid_width;
+
+        if (op->op >= REGPROG_OPCODES) {
+            PyErr_Format(PyExc_ValueError, "register program op %u: unknown opcode %u", i, op->op);
+            return false;
+        }
+        switch (REGPROG_SPACE(op->op)) {
+        case REGPROG_SPACE_MSR:
+            valid_width = width == 8;
+            break;
+        case REGPROG_SPACE_IO:
+            valid_width = width == 1 || width == 2 || width == 4;
+            break;
+        default:
+            valid_width = width == 1 || width == 2 || width == 4 || width == 8;
+            break;
+        }
+        if (!valid_width) {
+            PyErr_Format(PyExc_ValueError, "register program op %u: invalid width %u", i, width);
+            return false;
+        }
+        if (!regprog_valid_slot(op->dst) || !regprog_valid_slot(op->src) || !regprog_valid_slot(op->base)) {
+            PyErr_Format(PyExc_ValueError, "register program op %u: slot out of range", i);
+            return false;
+        }
+        if (op->shift >= 64) {
+            PyErr_Format(PyExc_ValueError, "register program op %u: shift out of range", i);
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Copy a packed register program out of a string, which need not be
+ * aligned, and validate it.  Returns an array for the caller to free, or
+ * NULL with a Python exception set. */
+static struct regprog_op *regprog_parse(const char *program, int program_len, U32 *count)
+{
+    struct regprog_op *ops;
+
+    if (program_len % sizeof(struct regprog_op)) {
+        PyErr_Format(PyExc_ValueError, "register program length must be a multiple of %u bytes", (unsigned)sizeof(struct regprog_op));
+        return NULL;
+    }
+    *count = program_len / sizeof(struct regprog_op);
+    if (*count > REGPROG_MAX_OPS) {
+        PyErr_Format(PyExc_ValueError, "register program has more than %u operations", REGPROG_MAX_OPS);
+        return NULL;
+    }
+    ops = grub_malloc((*count ? *count : 1) * sizeof(*ops));
+    if (!ops)
+        return (struct regprog_op *)PyErr_NoMemory();
+    memcpy(ops, program, *count * sizeof(*ops));
+    if (!regprog_validate(ops, *count)) {
+        grub_free(ops);
+        return NULL;
+    }
+    return ops;
+}
+
+static char *regprog_keywords[] = {"program", "slots", "apicid", NULL};
+
+static PyObject *bits_regprog(PyObject *self, PyObject *args, PyObject *keywds)
+{
+    const char *program;
+    int program_len;
+    PyObject *slots_obj = NULL;
+    PyObject *slots;
+    struct regprog p;
+    struct regprog_op *ops;
+    U64 *initial = NULL;
+    U32 ninitial = 0;
     unsigned apicid;
+    U32 i;
 
     if (!smp_init())
         return PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
     apicid = bsp_apicid();
 
-    if (!PyArg_ParseTupleAndKeywords(args, keywds, "k|I", read_keywords, &m.addr, &apicid))
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "s#|OI:regprog", regprog_keywords, &program, &program_len, &slots_obj, &apicid))
         return NULL;
 
-    if (!smp_function(apicid, readl_callback, &m))
-        return Py_BuildValue("");
-    return Py_BuildValue("I", (U32)m.value);
-}
+    memset(p.slots, 0, sizeof(p.slots));
+    if (slots_obj && slots_obj != Py_None) {
+        initial = parse_u64_sequence(slots_obj, &ninitial, ~0ULL, "expected a sequence of slot values");
+        if (!initial)
+            return NULL;
+        if (ninitial > REGPROG_SLOTS) {
+            grub_free(initial);
+            return PyErr_Format(PyExc_ValueError, "register programs have %u slots", REGPROG_SLOTS);
+        }
+        for (i = 0; i < ninitial; i++)
+            p.slots[i] = initial[i];
+        grub_free(initial);
+    }
 
-static void readq_callback(void *param)
-{
-    struct memop *m = param;
-    m->value = *(U64 *)m->addr;
+    ops = regprog_parse(program, program_len, &p.count);
+    if (!ops)
+        return NULL;
+    p.ops = ops;
+    p.completed = 0;
+
+    if (!smp_function(apicid, regprog_callback, &p)) {
+        grub_free(ops);
+        return PyErr_Format(PyExc_RuntimeError, "SMP function returned an error; does apicid 0x%x exist?", apicid);
+    }
+    grub_free(ops);
+
+    slots = PyTuple_New(REGPROG_SLOTS);
+    if (!slots)
+        return NULL;
+    for (i = 0; i < REGPROG_SLOTS; i++) {
+        PyObject *value = PyLong_FromUnsignedLongLong(p.slots[i]);
+        if (!value) {
+            Py_DECREF(slots);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(slots, i, value);
+    }
+    return Py_BuildValue("IN", p.completed, slots);
 }
 
-static PyObject *bits_readq(PyObject *self, PyObject *args, PyObject *keywds)
+/* Spin on one register on the target CPU until (value & mask) == expected
+ * or timeout TSC counts pass, after running an optional register program to
+ * set up the access (such as selecting a PCI configuration register). */
+struct poll {
+    struct regprog_op reg;      /* the register to read */
+    U64 mask;
+    U64 expected;
+    U64 timeout;
+    struct regprog setup;
+    U64 value;
+    U64 elapsed;
+    U32 status;                 /* nonzero if the setup or a read GPFd */
+};
+
+static void poll_callback(void *param)
 {
-    struct memop m;
-    unsigned apicid;
-
-    if (!smp_init())
-        return PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
-    apicid = bsp_apicid();
+    struct poll *p = param;
+    U64 start, now;
 
-    if (!PyArg_ParseTupleAndKeywords(args, keywds, "k|I", read_keywords, &m.addr, &apicid))
-        return NULL;
+    if (p->setup.count) {
+        regprog_callback(&p->setup);
+        if (p->setup.completed != p->setup.count)
+            return;
+    }
 
-    if (!smp_function(apicid, readq_callback, &m))
-        return Py_BuildValue("");
-    return Py_BuildValue("K", m.value);
+    start = rdtsc64();
+    for (;;) {
+        p->value = regprog_read(&p->reg, p->reg.addr, &p->status);
+        now = rdtsc64();
+        if (p->status || (p->value & p->mask) == p->expected || now - start >= p->timeout)
+            break;
+        __asm__ __volatile__ ("pause");
+    }
+    p->elapsed = now - start;
 }
 
-static void writeb_callback(void *param)
+/* Run a poll set up by the caller on apicid; returns (elapsed, value), or
+ * None if an MSR access GPFd. */
+static PyObject *smp_poll_register(struct poll *p, U32 apicid, const char *setup, int setup_len)
 {
-    struct memop *m = param;
-    *(U8 *)(m->addr) = m->value;
-}
+    struct regprog_op *ops = NULL;
+
+    p->setup.count = 0;
+    p->setup.completed = 0;
+    memset(p->setup.slots, 0, sizeof(p->setup.slots));
+    if (setup) {
+        ops = regprog_parse(setup, setup_len, &p->setup.count);
+        if (!ops)
+            return NULL;
+    }
+    p->setup.ops = ops;
+    p->status = -1;
+    p->value = 0;
+    p->elapsed = 0;
 
-static char *write_keywords[] = {"address", "value", "apicid", NULL};
+    if (!smp_function(apicid, poll_callback, p)) {
+        grub_free(ops);
+        return PyErr_Format(PyExc_RuntimeError, "SMP function returned an error; does apicid 0x%x exist?", apicid);
+    }
+    grub_free(ops);
+    if (p->status || p->setup.completed != p->setup.count)
+        return Py_BuildValue("");
+    return Py_BuildValue("KK", p->elapsed, p->value);
+}
 
-static PyObject *bits_writeb(PyObject *self, PyObject *args, PyObject *keywds)
+/* Returns false with a Python exception set if width is invalid for op. */
+static bool poll_init(struct poll *p, U8 op, U8 width, U64 addr, U64 mask, U64 expected, U64 timeout)
 {
-    struct memop m;
-    U8 value;
-    unsigned apicid;
-
-    if (!smp_init())
-        return PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
-    apicid = bsp_apicid();
+    bool valid;
 
-    if (!PyArg_ParseTupleAndKeywords(args, keywds, "kB|I", write_keywords, &m.addr, &value, &apicid))
-        return NULL;
-    m.value = value;
+    if (REGPROG_SPACE(op) == REGPROG_SPACE_IO)
+        valid = width == 1 || width == 2 || width == 4;
+    else
+        valid = width == 1 || width == 2 || width == 4 || width == 8;
+    if (!valid) {
+        PyErr_Format(PyExc_ValueError, REGPROG_SPACE(op) == REGPROG_SPACE_IO ? "bytes must be 1, 2, or 4" : "bytes must be 1, 2, 4, or 8");
+        return false;
+    }
 
-    smp_function(apicid, writeb_callback, &m);
-    return Py_BuildValue("");
+    memset(p, 0, sizeof(*p));
+    p->reg.op = op;
+    p->reg.width = width;
+    p->reg.addr = addr;
+    p->mask = mask;
+    p->expected = expected;
+    p->timeout = timeout;
+    return true;
 }
 
-static void writew_callback(void *param)
-{
-    struct memop *m = param;
-    *(U16 *)(m->addr) = m->value;
-}
+static char *poll_msr_keywords[] = {"msr", "mask", "expected", "timeout", "apicid", "setup", NULL};
 
-static PyObject *bits_writew(PyObject *self, PyObject *args, PyObject *keywds)
+static PyObject *bits_poll_msr(PyObject *self, PyObject *args, PyObject *keywds)
 {
-    struct memop m;
-    U16 value;
+    struct poll p;
+    U32 msr;
+    U64 mask, expected, timeout;
     unsigned apicid;
+    const char *setup = NULL;
+    int setup_len = 0;
 
     if (!smp_init())
         return PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
     apicid = bsp_apicid();
 
-    if (!PyArg_ParseTupleAndKeywords(args, keywds, "kH|I", write_keywords, &m.addr, &value, &apicid))
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "IKKK|Iz#:poll_msr", poll_msr_keywords, &msr, &mask, &expected, &timeout, &apicid, &setup, &setup_len))
         return NULL;
-    m.value = value;
-
-    smp_function(apicid, writew_callback, &m);
-    return Py_BuildValue("");
+    if (!poll_init(&p, REGPROG_RDMSR, 8, msr, mask, expected, timeout))
+        return NULL;
+    return smp_poll_register(&p, apicid, setup, setup_len);
 }
 
-static void writel_callback(void *param)
-{
-    struct memop *m = param;
-    *(U32 *)(m->addr) = m->value;
-}
+static char *poll_mmio_keywords[] = {"address", "mask", "expected", "timeout", "bytes", "apicid", "setup", NULL};
 
-static PyObject *bits_writel(PyObject *self, PyObject *args, PyObject *keywds)
+static PyObject *bits_poll_mmio(PyObject *self, PyObject *args, PyObject *keywds)
 {
-    struct memop m;
-    U32 value;
+    struct poll p;
+    unsigned long address;
+    U64 mask, expected, timeout;
+    U8 bytes = 4;
     unsigned apicid;
+    const char *setup = NULL;
+    int setup_len = 0;
 
     if (!smp_init())
         return PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
     apicid = bsp_apicid();
 
-    if (!PyArg_ParseTupleAndKeywords(args, keywds, "kI|I", write_keywords, &m.addr, &value, &apicid))
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "kKKK|BIz#:poll_mmio", poll_mmio_keywords, &address, &mask, &expected, &timeout, &bytes, &apicid, &setup, &setup_len))
         return NULL;
-    m.value = value;
-
-    smp_function(apicid, writel_callback, &m);
-    return Py_BuildValue("");
+    if (!poll_init(&p, REGPROG_READ, bytes, address, mask, expected, timeout))
+        return NULL;
+    return smp_poll_register(&p, apicid, setup, setup_len);
 }
 
-static void writeq_callback(void *param)
-{
-    struct memop *m = param;
-    *(U64 *)(m->addr) = m->value;
-}
+static char *poll_port_keywords[] = {"port", "mask", "expected", "timeout", "bytes", "apicid", "setup", NULL};
 
-static PyObject *bits_writeq(PyObject *self, PyObject *args, PyObject *keywds)
+static PyObject *bits_poll_port(PyObject *self, PyObject *args, PyObject *keywds)
 {
-    struct memop m;
+    struct poll p;
+    U16 port;
+    U64 mask, expected, timeout;
+    U8 bytes = 1;
     unsigned apicid;
+    const char *setup = NULL;
+    int setup_len = 0;
 
     if (!smp_init())
         return PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
     apicid = bsp_apicid();
 
-    if (!PyArg_ParseTupleAndKeywords(args, keywds, "kK|I", write_keywords, &m.addr, &m.value, &apicid))
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "HKKK|BIz#:poll_port", poll_port_keywords, &port, &mask, &expected, &timeout, &bytes, &apicid, &setup, &setup_len))
         return NULL;
-
-    smp_function(apicid, writeq_callback, &m);
-    return Py_BuildValue("");
+    if (!poll_init(&p, REGPROG_IN, bytes, port, mask, expected, timeout))
+        return NULL;
+    return smp_poll_register(&p, apicid, setup, setup_len);
 }
 
 #define LATENCY_RECENT_COUNT 6
+
+/* With layout="aos", smi_latency returns these directly; reserved keeps the
+ * layout the same 80 bytes on i386 and x86_64. */
 struct latency_bin {
     U64 max;
     U64 total;
     U64 count;
     U32 recent_index;
+    U32 reserved;
     U64 recent_absolute[LATENCY_RECENT_COUNT];
 };
 
+/* Struct-of-arrays form of bins for layout="soa": (max, total, count,
+ * recent_count, recent). */
+static PyObject *latency_bins_soa(const struct latency_bin *bin, U32 bin_len)
+{
+    PyObject *column[5];
+    U64 *max, *total, *count, *recent;
+    U32 *recent_count;
+    U32 i, j;
+
+    column[0] = read_only_buffer(new_result_buffer(bin_len * sizeof(U64), (void **)&max));
+    column[1] = read_only_buffer(new_result_buffer(bin_len * sizeof(U64), (void **)&total));
+    column[2] = read_only_buffer(new_result_buffer(bin_len * sizeof(U64), (void **)&count));
+    column[3] = read_only_buffer(new_result_buffer(bin_len * sizeof(U32), (void **)&recent_count));
+    column[4] = read_only_buffer(new_result_buffer(bin_len * LATENCY_RECENT_COUNT * sizeof(U64), (void **)&recent));
+    if (!column[0] || !column[1] || !column[2] || !column[3] || !column[4]) {
+        for (i = 0; i < 5; i++)
+            Py_XDECREF(column[i]);
+        return NULL;
+    }
+    for (i = 0; i < bin_len; i++) {
+        max[i] = bin[i].max;
+        total[i] = bin[i].total;
+        count[i] = bin[i].count;
+        recent_count[i] = bin[i].recent_index;
+        for (j = 0; j < LATENCY_RECENT_COUNT; j++)
+            recent[i * LATENCY_RECENT_COUNT + j] = bin[i].recent_absolute[j];
+    }
+    return Py_BuildValue("NNNNN", column[0], column[1], column[2], column[3], column[4]);
+}
+
+static PyObject *latency_bins_list(const struct latency_bin *bin, U32 bin_len)
+{
+    PyObject *bin_obj;
+    U32 i;
+
+    bin_obj = PyList_New(bin_len);
+    if (!bin_obj)
+        return NULL;
+    for(i = 0; i < bin_len; i++) {
+        PyObject *recent_list;
+        PyObject *bin_tuple;
+        U32 j;
+        recent_list = PyList_New(bin[i].recent_index);
+        if (!recent_list)
+            goto err;
+        for (j = 0; j < bin[i].recent_index; j++) {
+            PyObject *long_obj = PyLong_FromUnsignedLongLong(bin[i].recent_absolute[j]);
+            if (!long_obj) {
+                Py_DECREF(recent_list);
+                goto err;
+            }
+            PyList_SET_ITEM(recent_list, j, long_obj);
+        }
+        bin_tuple = Py_BuildValue("KKKN", bin[i].max, bin[i].total, bin[i].count, recent_list);
+        if (!bin_tuple)
+            goto err;
+        PyList_SET_ITEM(bin_obj, i, bin_tuple);
+    }
+    return bin_obj;
+
+err:
+    Py_DECREF(bin_obj);
+    return NULL;
+}
+
+static char *smi_latency_keywords[] = {"duration", "bin_maxes", "layout", NULL};
+
 #define MSR_SMI_COUNT 0x34
-static PyObject *bits_smi_latency(PyObject *self, PyObject *args)
+static PyObject *bits_smi_latency(PyObject *self, PyObject *args, PyObject *keywds)
 {
     U64 test_duration_tscs;
     PyObject *bin_maxes;
     PyObject *bin_obj = NULL;
-    PyObject *recent_list = NULL;
+    enum result_layout layout = LAYOUT_OBJECTS;
     U32 bsp;
     struct msr smi_count1, smi_count2;
     PyObject *smi_count_obj;
     struct latency_bin *bin;
-    U32 bin_len;
+    Py_ssize_t bin_len;
     U64 test_start;
     U64 tsc1, tsc2;
     U64 current;
@@ -577,7 +3099,7 @@ static PyObject *bits_smi_latency(PyObject *self, PyObject *args)
     bsp = bsp_apicid();
     smi_count1.num = smi_count2.num = MSR_SMI_COUNT;
 
-    if (!PyArg_ParseTuple(args, "KO:smi_latency", &test_duration_tscs, &bin_maxes))
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "KO|O&:smi_latency", smi_latency_keywords, &test_duration_tscs, &bin_maxes, parse_layout, &layout))
         return NULL;
     if (!PySequence_Check(bin_maxes))
         return PyErr_Format(PyExc_TypeError, "expected a sequence");
@@ -585,9 +3107,20 @@ static PyObject *bits_smi_latency(PyObject *self, PyObject *args)
     if (bin_len == -1)
         return PyErr_Format(PyExc_ValueError, "failed to get length of sequence");
 
-    bin = grub_zalloc((bin_len + 1) * sizeof(*bin));
+    /* With layout="aos" the bins live in the result buffer itself. */
+    if (layout == LAYOUT_AOS) {
+        bin_obj = new_result_buffer((bin_len + 1) * sizeof(*bin), (void **)&bin);
+        if (!bin_obj)
+            return NULL;
+    } else {
+        bin = grub_zalloc((bin_len + 1) * sizeof(*bin));
+        if (!bin)
+            return PyErr_NoMemory();
+    }
     for (i = 0; i < bin_len; i++) {
         PyObject *bin_max_obj = PySequence_GetItem(bin_maxes, i);
+        if (!bin_max_obj)
+            goto err;
         if (PyLong_Check(bin_max_obj)) {
             bin[i].max = PyLong_AsUnsignedLongLong(bin_max_obj);
         } else if (PyInt_Check(bin_max_obj)) {
@@ -626,26 +3159,14 @@ static PyObject *bits_smi_latency(PyObject *self, PyObject *args)
 
     smp_rdmsr(bsp, &smi_count2);
 
-    bin_obj = PyList_New(bin_len);
-    if (!bin_obj)
-        goto err;
-    for(i = 0; i < bin_len; i++) {
-        PyObject *bin_tuple;
-        U32 j;
-        recent_list = PyList_New(bin[i].recent_index);
-        if (!recent_list)
-            goto err;
-        for (j = 0; j < bin[i].recent_index; j++) {
-            PyObject *long_obj = PyLong_FromUnsignedLongLong(bin[i].recent_absolute[j]);
-            if (!long_obj)
-                goto err;
-            PyList_SET_ITEM(recent_list, j, long_obj);
-        }
-        bin_tuple = Py_BuildValue("KKKN", bin[i].max, bin[i].total, bin[i].count, recent_list);
-        if (!bin_tuple)
-            goto err;
-        PyList_SET_ITEM(bin_obj, i, bin_tuple);
+    if (layout == LAYOUT_AOS) {
+        bin_obj = read_only_buffer(bin_obj);
+    } else {
+        bin_obj = layout == LAYOUT_SOA ? latency_bins_soa(bin, bin_len) : latency_bins_list(bin, bin_len);
+        grub_free(bin);
     }
+    if (!bin_obj)
+        return NULL;
 
     if (smi_count1.status == 0 && smi_count2.status == 0)
         smi_count_obj = PyLong_FromUnsignedLongLong(smi_count2.value - smi_count1.value);
@@ -655,62 +3176,547 @@ static PyObject *bits_smi_latency(PyObject *self, PyObject *args)
     return Py_BuildValue("KNN", max, smi_count_obj, bin_obj);
 
 err:
-    Py_XDECREF(recent_list);
-    Py_XDECREF(bin_obj);
-    grub_free(bin);
+    if (layout == LAYOUT_AOS)
+        Py_DECREF(bin_obj);
+    else
+        grub_free(bin);
+    return NULL;
+}
+
+/* All-CPU SMI latency detector.  Every CPU leaves a barrier together and
+ * watches for gaps between consecutive TSC reads, binned by floor(log2(gap))
+ * and with every gap longer than threshold kept in a per-CPU ring, so that
+ * stalls can be matched across CPUs by their TSC timestamps. */
+#define SMI_LATENCY_BUCKETS 64
+#define SMI_LATENCY_RING_SIZE 1024
+#define SMI_LATENCY_MAX_RING_SIZE (1 << 24)
+
+struct smi_bucket {
+    U64 count;
+    U64 total;
+};
+
+struct smi_gap {
+    U64 tsc;            /* TSC at the end of the gap */
+    U64 ticks;
+};
+
+struct smi_latency_cpu {
+    struct smi_bucket *buckets;
+    struct smi_gap *ring;
+    U64 max;
+    U64 events;         /* gaps longer than the threshold; the ring keeps the last ring_size */
+    U64 smi_count_start;
+    U64 smi_count_end;
+    U32 smi_count_status;
+    bool done;
+};
+
+struct smi_latency_all {
+    SMP_BARRIER *barrier;
+    U64 duration;
+    U64 threshold;
+    U32 ring_size;
+    struct smi_latency_cpu *cpus;
+};
+
+static void smi_latency_all_callback(void *param)
+{
+    struct smi_latency_all *s = param;
+    struct smi_latency_cpu *c;
+    struct smi_bucket *buckets, *bucket;
+    struct smi_gap *ring;
+    U64 test_start, tsc1, tsc2, gap;
+    U64 max = 0, events = 0;
+    U32 index, head = 0, status;
+
+    if (!smp_read_cpu_index(&index))
+        return;
+    c = &s->cpus[index];
+    buckets = c->buckets;
+    ring = c->ring;
+
+    rdmsr64(MSR_SMI_COUNT, &c->smi_count_start, &c->smi_count_status);
+    if (!smp_barrier_wait(s->barrier))
+        return;
+
+    for (test_start = tsc1 = rdtsc64(), tsc2 = rdtsc64(); tsc2 - test_start < s->duration; tsc1 = tsc2, tsc2 = rdtsc64()) {
+        gap = tsc2 - tsc1;
+        bucket = &buckets[bsr64(gap)];
+        bucket->count++;
+        bucket->total += gap;
+        if (gap > max)
+            max = gap;
+        if (gap > s->threshold) {
+            ring[head].tsc = tsc2;
+            ring[head].ticks = gap;
+            if (++head == s->ring_size)
+                head = 0;
+            events++;
+        }
+    }
+
+    rdmsr64(MSR_SMI_COUNT, &c->smi_count_end, &status);
+    c->smi_count_status |= status;
+    c->max = max;
+    c->events = events;
+    c->done = true;
+}
+
+static char *smi_latency_all_keywords[] = {"duration", "threshold", "ring_size", NULL};
+
+static PyObject *bits_smi_latency_all(PyObject *self, PyObject *args, PyObject *keywds)
+{
+    struct smi_latency_all s;
+    void *barrier_memory;
+    PyObject **buckets, **rings;
+    PyObject *list = NULL;
+    U32 ncpus, i;
+
+    s.ring_size = SMI_LATENCY_RING_SIZE;
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "KK|I:smi_latency_all", smi_latency_all_keywords, &s.duration, &s.threshold, &s.ring_size))
+        return NULL;
+    if (!s.ring_size || s.ring_size > SMI_LATENCY_MAX_RING_SIZE)
+        return PyErr_Format(PyExc_ValueError, "ring_size must be between 1 and %u", SMI_LATENCY_MAX_RING_SIZE);
+
+    ncpus = smp_init();
+    if (!ncpus)
+        return PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
+
+    barrier_memory = grub_memalign(SMP_MWAIT_ALIGN, smp_barrier_size());
+    s.cpus = grub_zalloc(ncpus * sizeof(*s.cpus));
+    buckets = grub_zalloc(ncpus * sizeof(*buckets));
+    rings = grub_zalloc(ncpus * sizeof(*rings));
+    if (!barrier_memory || !s.cpus || !buckets || !rings) {
+        PyErr_NoMemory();
+        goto out;
+    }
+    /* Each CPU fills in buffers of its own, so the results need no copying
+     * and no two CPUs share a cache line while timing. */
+    for (i = 0; i < ncpus; i++) {
+        buckets[i] = new_result_buffer(SMI_LATENCY_BUCKETS * sizeof(struct smi_bucket), (void **)&s.cpus[i].buckets);
+        if (!buckets[i])
+            goto out;
+        rings[i] = new_result_buffer((Py_ssize_t)s.ring_size * sizeof(struct smi_gap), (void **)&s.cpus[i].ring);
+        if (!rings[i])
+            goto out;
+    }
+    s.barrier = smp_barrier_init(barrier_memory, NULL, smp_read_tsc_hz() / 10000);
+
+    if (!smp_function_all(smi_latency_all_callback, &s)) {
+        PyErr_Format(PyExc_RuntimeError, "SMP function returned an error");
+        goto out;
+    }
+
+    list = PyList_New(ncpus);
+    if (!list)
+        goto out;
+    for (i = 0; i < ncpus; i++) {
+        struct smi_latency_cpu *c = &s.cpus[i];
+        PyObject *smi_count_obj, *cpu_tuple;
+        if (!c->done) {
+            Py_CLEAR(list);
+            PyErr_Format(PyExc_RuntimeError, "CPU %u did not run the SMI latency test", i);
+            goto out;
+        }
+        if (c->smi_count_status)
+            smi_count_obj = Py_BuildValue("");
+        else
+            smi_count_obj = PyLong_FromUnsignedLongLong(c->smi_count_end - c->smi_count_start);
+        cpu_tuple = Py_BuildValue("KNKNN", c->max, smi_count_obj, c->events, read_only_buffer(buckets[i]), read_only_buffer(rings[i]));
+        buckets[i] = rings[i] = NULL;
+        if (!cpu_tuple) {
+            Py_CLEAR(list);
+            goto out;
+        }
+        PyList_SET_ITEM(list, i, cpu_tuple);
+    }
+
+out:
+    for (i = 0; buckets && rings && i < ncpus; i++) {
+        Py_XDECREF(buckets[i]);
+        Py_XDECREF(rings[i]);
+    }
+    grub_free(rings);
+    grub_free(buckets);
+    grub_free(s.cpus);
+    grub_free(barrier_memory);
+    return list;
+}
+
+/* Jitter tracer.  Each traced CPU spins reading the TSC and pushes a record
+ * for every gap longer than the threshold into a ring of its own, while the
+ * BSP drains the rings into Python.  The BSP does the draining, so it cannot
+ * trace itself.  The counters wrap modulo 2^32 and both sides compare only
+ * their difference; ring sizes are powers of two so that slots stay in step
+ * across the wrap.  In wrap mode the traced CPU never looks at tail, and
+ * the BSP detects and discards records overwritten before it drained them.
+ * Otherwise a full ring drops new records until the BSP drains it. */
+#define JITTER_RING_SIZE 4096
+#define JITTER_MAX_RING_SIZE (1 << 24)
+
+struct jitter_record {
+    U64 start_tsc;      /* TSC at the start of the gap */
+    U64 gap;
+};
+
+struct jitter_ring {
+    volatile U32 head;          /* records written; traced CPU */
+    volatile U32 tail;          /* records drained; BSP */
+    volatile U32 dropped;       /* records dropped when full; traced CPU */
+    U32 dropped_seen;           /* BSP */
+    U64 lost;                   /* lost since the last drain; BSP */
+    U32 apicid;
+    U32 index;
+    struct jitter_record *records;
+    SMP_HANDLE handle;
+    struct jitter_trace *trace;
+};
+
+struct jitter_trace {
+    U64 duration;
+    U64 threshold;
+    U32 ring_size;
+    bool wrap;
+    volatile bool stop;
+    U32 nrings;
+    U32 nstarted;
+    struct jitter_ring *rings;
+};
+
+#define JITTER_TRACE_CAPSULE_NAME "_smp.jitter_trace"
+
+static void jitter_trace_callback(void *param)
+{
+    struct jitter_ring *r = param;
+    const struct jitter_trace *t = r->trace;
+    struct jitter_record *records = r->records;
+    U64 test_start, tsc1, tsc2, gap;
+    U32 head = r->head;
+    U32 slot = 0;
+
+    for (test_start = tsc1 = rdtsc64(), tsc2 = rdtsc64(); tsc2 - test_start < t->duration && !t->stop; tsc1 = tsc2, tsc2 = rdtsc64()) {
+        gap = tsc2 - tsc1;
+        if (gap <= t->threshold)
+            continue;
+        if (!t->wrap && head - r->tail == t->ring_size) {
+            r->dropped++;
+            continue;
+        }
+        records[slot].start_tsc = tsc1;
+        records[slot].gap = gap;
+        slot = (slot + 1) & (t->ring_size - 1);
+        /* Publish the record only after writing it. */
+        __asm__ __volatile__ ("" ::: "memory");
+        r->head = ++head;
+    }
+}
+
+/* Copy the undrained records of r into a new string, oldest first. */
+static PyObject *jitter_ring_drain(const struct jitter_trace *t, struct jitter_ring *r)
+{
+    PyObject *str;
+    struct jitter_record *out;
+    U32 head, tail, count, i, dropped, overwritten;
+
+    head = r->head;
+    tail = r->tail;
+    __asm__ __volatile__ ("" ::: "memory");
+    if (head - tail > t->ring_size) {
+        r->lost += head - tail - t->ring_size;
+        tail = head - t->ring_size;
+    }
+    count = head - tail;
+
+    str = PyString_FromStringAndSize(NULL, (Py_ssize_t)count * sizeof(*out));
+    if (!str)
+        return NULL;
+    out = (struct jitter_record *)PyString_AS_STRING(str);
+    for (i = 0; i < count; i++)
+        out[i] = r->records[(tail + i) & (t->ring_size - 1)];
+
+    if (t->wrap) {
+        /* The traced CPU may have overwritten the oldest records while they
+         * were being copied, including the slot of the record it is writing
+         * but has not yet published; drop any it could have reached. */
+        __asm__ __volatile__ ("" ::: "memory");
+        overwritten = r->head + 1 - tail;
+        if (overwritten > t->ring_size) {
+            overwritten -= t->ring_size;
+            if (overwritten > count)
+                overwritten = count;
+            r->lost += overwritten;
+            memmove(out, out + overwritten, (count - overwritten) * sizeof(*out));
+            if (_PyString_Resize(&str, (Py_ssize_t)(count - overwritten) * sizeof(*out)) < 0)
+                return NULL;
+        }
+    }
+
+    __asm__ __volatile__ ("" ::: "memory");
+    r->tail = head;
+    dropped = r->dropped;
+    r->lost += dropped - r->dropped_seen;
+    r->dropped_seen = dropped;
+    return str;
+}
+
+static void jitter_trace_free(struct jitter_trace *t)
+{
+    U32 i;
+
+    t->stop = true;
+    for (i = 0; i < t->nstarted; i++)
+        smp_wait(&t->rings[i].handle);
+    for (i = 0; i < t->nrings; i++)
+        grub_free(t->rings[i].records);
+    grub_free(t->rings);
+    grub_free(t);
+}
+
+static void jitter_trace_destructor(PyObject *capsule)
+{
+    struct jitter_trace *t = PyCapsule_GetPointer(capsule, JITTER_TRACE_CAPSULE_NAME);
+    if (t)
+        jitter_trace_free(t);
+}
+
+static char *jitter_trace_start_keywords[] = {"apicids", "duration", "threshold", "ring_size", "wrap", NULL};
+
+static PyObject *bits_jitter_trace_start(PyObject *self, PyObject *args, PyObject *keywds)
+{
+    PyObject *apicids_obj, *wrap_obj = NULL, *capsule;
+    struct jitter_trace *t;
+    const CPU_INFO *cpus;
+    U64 *apicids = NULL;
+    U64 duration, threshold;
+    U32 ring_size = JITTER_RING_SIZE;
+    U32 ncpus, i, index;
+    int wrap = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "OKK|IO:jitter_trace_start", jitter_trace_start_keywords, &apicids_obj, &duration, &threshold, &ring_size, &wrap_obj))
+        return NULL;
+    if (wrap_obj) {
+        wrap = PyObject_IsTrue(wrap_obj);
+        if (wrap < 0)
+            return NULL;
+    }
+    if (!ring_size || (ring_size & (ring_size - 1)) || ring_size > JITTER_MAX_RING_SIZE)
+        return PyErr_Format(PyExc_ValueError, "ring_size must be a power of two no larger than %u", JITTER_MAX_RING_SIZE);
+
+    ncpus = smp_init();
+    if (!ncpus)
+        return PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
+    cpus = smp_read_cpu_list();
+    if (!cpus)
+        return PyErr_Format(PyExc_RuntimeError, "Failed to read the CPU list.");
+
+    t = grub_zalloc(sizeof(*t));
+    if (!t)
+        return PyErr_NoMemory();
+    t->duration = duration;
+    t->threshold = threshold;
+    t->ring_size = ring_size;
+    t->wrap = wrap;
+
+    if (apicids_obj == Py_None)
+        t->nrings = ncpus - 1;
+    else {
+        apicids = parse_u64_sequence(apicids_obj, &t->nrings, 0xffffffff, "expected a sequence of APIC IDs");
+        if (!apicids) {
+            grub_free(t);
+            return NULL;
+        }
+    }
+    t->rings = grub_zalloc((t->nrings ? t->nrings : 1) * sizeof(*t->rings));
+    if (!t->rings) {
+        grub_free(apicids);
+        t->nrings = 0;
+        jitter_trace_free(t);
+        return PyErr_NoMemory();
+    }
+    for (i = 0; i < t->nrings; i++) {
+        struct jitter_ring *r = &t->rings[i];
+        if (apicids) {
+            if (!smp_lookup_cpu_index(apicids[i], &index)) {
+                PyErr_Format(PyExc_ValueError, "apicid 0x%llx not found", (unsigned long long)apicids[i]);
+                goto err;
+            }
+            if (index == 0) {
+                PyErr_Format(PyExc_ValueError, "cannot trace the BSP, which drains the rings");
+                goto err;
+            }
+        } else
+            index = i + 1;
+        r->apicid = cpus[index].apicid;
+        r->index = index;
+        r->trace = t;
+        r->records = grub_malloc((grub_size_t)ring_size * sizeof(*r->records));
+        if (!r->records) {
+            PyErr_NoMemory();
+            goto err;
+        }
+    }
+    grub_free(apicids);
+    apicids = NULL;
+
+    for (i = 0; i < t->nrings; i++) {
+        if (!smp_function_async_by_index(t->rings[i].index, jitter_trace_callback, &t->rings[i], &t->rings[i].handle)) {
+            PyErr_Format(PyExc_RuntimeError, "Failed to start tracing on apicid 0x%x; is it already busy?", t->rings[i].apicid);
+            goto err;
+        }
+        t->nstarted++;
+    }
+
+    capsule = PyCapsule_New(t, JITTER_TRACE_CAPSULE_NAME, jitter_trace_destructor);
+    if (!capsule)
+        jitter_trace_free(t);
+    return capsule;
+
+err:
+    grub_free(apicids);
+    jitter_trace_free(t);
     return NULL;
 }
 
+static PyObject *bits_jitter_trace_drain(PyObject *self, PyObject *args)
+{
+    PyObject *capsule, *list;
+    struct jitter_trace *t;
+    bool done = true;
+    U32 i;
+
+    if (!PyArg_ParseTuple(args, "O:jitter_trace_drain", &capsule))
+        return NULL;
+    t = PyCapsule_GetPointer(capsule, JITTER_TRACE_CAPSULE_NAME);
+    if (!t)
+        return NULL;
+
+    /* Check for completion first, so that a drain reported as done has
+     * picked up every record. */
+    for (i = 0; i < t->nrings; i++)
+        done = done && smp_poll(&t->rings[i].handle);
+
+    list = PyList_New(t->nrings);
+    if (!list)
+        return NULL;
+    for (i = 0; i < t->nrings; i++) {
+        struct jitter_ring *r = &t->rings[i];
+        PyObject *records, *ring_tuple;
+        U64 lost;
+        records = jitter_ring_drain(t, r);
+        if (!records) {
+            Py_DECREF(list);
+            return NULL;
+        }
+        lost = r->lost;
+        r->lost = 0;
+        ring_tuple = Py_BuildValue("INK", r->apicid, records, lost);
+        if (!ring_tuple) {
+            Py_DECREF(list);
+            return NULL;
+        }
+        PyList_SET_ITEM(list, i, ring_tuple);
+    }
+    return Py_BuildValue("NN", PyBool_FromLong(done), list);
+}
+
+static PyObject *bits_jitter_trace_stop(PyObject *self, PyObject *args)
+{
+    PyObject *capsule;
+    struct jitter_trace *t;
+
+    if (!PyArg_ParseTuple(args, "O:jitter_trace_stop", &capsule))
+        return NULL;
+    t = PyCapsule_GetPointer(capsule, JITTER_TRACE_CAPSULE_NAME);
+    if (!t)
+        return NULL;
+    t->stop = true;
+    return Py_BuildValue("");
+}
+
 static PyObject *bits_get_mwait(PyObject *self, PyObject *args)
 {
     U32 apicid;
     bool use_mwait;
-    U32 hint, int_break_event;
+    U32 hint, int_break_event, spin_ticks;
     if (!PyArg_ParseTuple(args, "I:get_mwait", &apicid))
         return NULL;
     if (!smp_init())
         return PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
-    if (!smp_get_mwait(apicid, &use_mwait, &hint, &int_break_event))
+    if (!smp_get_mwait(apicid, &use_mwait, &hint, &int_break_event, &spin_ticks))
         return PyErr_Format(PyExc_RuntimeError, "Failed to get mwait hint for apicid %u", apicid);
-    return Py_BuildValue("NIN", PyBool_FromLong(use_mwait), hint, PyBool_FromLong(int_break_event));
+    return Py_BuildValue("NINI", PyBool_FromLong(use_mwait), hint, PyBool_FromLong(int_break_event), spin_ticks);
 }
 
 static PyObject *bits_set_mwait(PyObject *self, PyObject *args)
 {
-    U32 apicid, hint = 0;
+    U32 apicid, hint = 0, spin_ticks = 0;
     PyObject *use_mwait_obj, *int_break_event_obj = NULL;
-    if (!PyArg_ParseTuple(args, "IO|IO:set_mwait", &apicid, &use_mwait_obj, &hint, &int_break_event_obj))
+    if (!PyArg_ParseTuple(args, "IO|IOI:set_mwait", &apicid, &use_mwait_obj, &hint, &int_break_event_obj, &spin_ticks))
         return NULL;
     if (!smp_init())
         return PyErr_Format(PyExc_RuntimeError, "SMP module failed to initialize.");
-    smp_set_mwait(apicid, PyObject_IsTrue(use_mwait_obj), hint, int_break_event_obj ? PyObject_IsTrue(int_break_event_obj) : 1);
+    smp_set_mwait(apicid, PyObject_IsTrue(use_mwait_obj), hint, int_break_event_obj ? PyObject_IsTrue(int_break_event_obj) : 1, spin_ticks);
     return Py_BuildValue("");
 }
 
 static PyMethodDef smpMethods[] = {
     {"bclk", bits_bclk, METH_NOARGS, "bclk() -> bclk (in MHz)"},
-    {"blocking_sleep", bits_blocking_sleep, METH_VARARGS, "sleep using mwait for the specified number of microseconds"},
+    {"blocking_sleep", (PyCFunction)bits_blocking_sleep, METH_KEYWORDS, "blocking_sleep(usec[, apicid=BSP]) -> sleep the specified CPU using mwait for the specified number of microseconds, and return the TSC ticks slept"},
     {"_cpuid", bits_cpuid, METH_VARARGS, "_cpuid(apicid, eax[, ecx]) -> eax, ebx, ecx, edx"},
+    {"cpuid_async", bits_cpuid_async, METH_VARARGS, "cpuid_async(apicid, eax[, ecx]) -> start CPUID on the specified CPU and return a pending call; wait() returns (eax, ebx, ecx, edx)"},
+    {"_cpuid_all", (PyCFunction)bits_cpuid_all, METH_KEYWORDS, "_cpuid_all(eax[, ecx[, layout=None]]) -> list of (eax, ebx, ecx, edx), run concurrently on all CPUs, in the same order as cpus(). With layout=\"aos\", a read-only buffer of little-endian 32-bit eax, ebx, ecx, edx per CPU; with layout=\"soa\", a tuple of four read-only buffers of one 32-bit value per CPU."},
+    {"cpuid_cached", bits_cpuid_cached, METH_VARARGS, "cpuid_cached(apicid, eax[, ecx]) -> (eax, ebx, ecx, edx) from the CPUID snapshot, or None if the snapshot does not include that leaf and subleaf. Takes the snapshot on first use."},
+    {"cpuid_cached_all", bits_cpuid_cached_all, METH_VARARGS, "cpuid_cached_all(eax[, ecx]) -> list of (eax, ebx, ecx, edx) from the CPUID snapshot, in the same order as cpus(), or None if the snapshot does not include that leaf and subleaf for every CPU. Takes the snapshot on first use."},
+    {"cpuid_snapshot", bits_cpuid_snapshot, METH_NOARGS, "cpuid_snapshot() -> number of entries. Capture every standard, extended, and ECX-indexed CPUID leaf on all CPUs concurrently, replacing any previous snapshot."},
     {"cpus",  bits_cpus, METH_NOARGS, "cpus() -> list of APIC IDs"},
-    {"get_mwait", bits_get_mwait, METH_VARARGS, "get_mwait(apicid) -> (use_mwait, hint, int_break_event)"},
+    {"dispatch_stats", bits_dispatch_stats, METH_NOARGS, "dispatch_stats() -> list of {stage: (count, total, max, log2_histogram)}, in the same order as cpus(). Stages are wake, start, run, and handback; all times in TSC counts. Also includes spin_wakes and mwait_wakes, the number of waits ended by each path."},
+    {"get_mwait", bits_get_mwait, METH_VARARGS, "get_mwait(apicid) -> (use_mwait, hint, int_break_event, spin_ticks)"},
     {"inb", (PyCFunction)bits_inb, METH_KEYWORDS, "inb(port[, apicid=BSP]) -> read byte from IO port on the specified CPU"},
     {"inw", (PyCFunction)bits_inw, METH_KEYWORDS, "inw(port[, apicid=BSP]) -> read word from IO port on the specified CPU"},
     {"inl", (PyCFunction)bits_inl, METH_KEYWORDS, "inl(port[, apicid=BSP]) -> read dword from IO port on the specified CPU"},
+    {"jitter_trace_drain", bits_jitter_trace_drain, METH_VARARGS, "jitter_trace_drain(trace) -> (done, [(apicid, records, lost)]). Collect the records each traced CPU has produced since the last drain, in the order the CPUs were given. records is a string of 16-byte records of little-endian 64-bit start_tsc and gap, oldest first; lost counts records overwritten or dropped since the last drain. done is True once every CPU has finished and this drain collected everything."},
+    {"jitter_trace_start", (PyCFunction)bits_jitter_trace_start, METH_KEYWORDS, "jitter_trace_start(apicids, duration, threshold[, ring_size=4096[, wrap=False]]) -> trace. Start every CPU in apicids (all APs if None; not the BSP) spinning on the TSC for duration TSC counts, recording every gap longer than threshold in a ring of ring_size records, a power of two no larger than 2^24. When a ring fills, wrap overwrites the oldest undrained records; otherwise new records are dropped until the next drain. Drain with jitter_trace_drain while the trace runs; dropping the last reference to trace stops the CPUs and waits for them."},
+    {"jitter_trace_stop", bits_jitter_trace_stop, METH_VARARGS, "jitter_trace_stop(trace) -> ask the traced CPUs to stop early; drain until done to collect the rest"},
+    {"membw", (PyCFunction)bits_membw, METH_KEYWORDS, "membw(kernel, jobs, size[, iterations=1]) -> list of (start_tsc, end_tsc), one per job. Run a memory bandwidth kernel concurrently on each CPU in jobs, a sequence of (apicid, a, b, c) buffer addresses, all leaving a barrier together. kernel is \"read\" (reads a), \"write\" (writes a), \"copy\" (copies b to a), or \"triad\" (a = b + 3.0 * c, in doubles); kernels ignore the buffers they do not use. Each buffer is size bytes, and each address and size must be a multiple of 64. Stores are non-temporal."},
+    {"msr_sweep", (PyCFunction)bits_msr_sweep, METH_KEYWORDS, "msr_sweep(ranges[, blacklist[, masks]]) -> list of (msr, ((value, apicids), ...)). Read every MSR in each (start, stop) range, less those in blacklist, on all CPUs, with each CPU scanning locally. Each value read is ANDed with masks[msr] if present. For each MSR, the CPUs are grouped by the value they read (None if GPF), as a tuple of APIC IDs; a consistent MSR has one group."},
     {"outb", (PyCFunction)bits_outb, METH_KEYWORDS, "outb(port, value[, apicid=BSP]) -> write byte to IO port on the specified CPU"},
     {"outw", (PyCFunction)bits_outw, METH_KEYWORDS, "outw(port, value[, apicid=BSP]) -> write word to IO port on the specified CPU"},
     {"outl", (PyCFunction)bits_outl, METH_KEYWORDS, "outl(port, value[, apicid=BSP]) -> write dword to IO port on the specified CPU"},
+    {"ping_pong", (PyCFunction)bits_ping_pong, METH_KEYWORDS, "ping_pong(apicid, other, round_trips) -> TSC counts. Bounce a cache line between two CPUs round_trips times with atomic exchanges, and return the time on apicid for all the round trips, after a few untimed ones."},
+    {"pointer_chase", (PyCFunction)bits_pointer_chase, METH_KEYWORDS, "pointer_chase(address, size, loads[, stride=64[, block=size[, seed=1[, apicid=BSP]]]]) -> TSC counts. On the specified CPU, link the size bytes at address into a random chain of pointers, one every stride bytes, then time loads dependent loads along it after one untimed pass. The chain visits every element of each block of block bytes before moving on to another block, in random order; a page-sized block bounds TLB misses. Overwrites the buffer."},
+    {"poll", bits_poll, METH_VARARGS, "poll(pending) -> True if the pending call has finished"},
+    {"poll_mmio", (PyCFunction)bits_poll_mmio, METH_KEYWORDS, "poll_mmio(address, mask, expected, timeout[, bytes=4[, apicid=BSP[, setup]]]) -> (elapsed, value). Read memory on the specified CPU until (value & mask) == expected or timeout TSC counts pass, and return the TSC counts elapsed and the last value read. setup is an optional register program, as for regprog(), run first on the same CPU. Returns None if setup GPFs."},
+    {"poll_msr", (PyCFunction)bits_poll_msr, METH_KEYWORDS, "poll_msr(msr, mask, expected, timeout[, apicid=BSP[, setup]]) -> (elapsed, value). As poll_mmio, reading an MSR. Returns None if reading the MSR or setup GPFs."},
+    {"poll_port", (PyCFunction)bits_poll_port, METH_KEYWORDS, "poll_port(port, mask, expected, timeout[, bytes=1[, apicid=BSP[, setup]]]) -> (elapsed, value). As poll_mmio, reading an IO port."},
     {"rdmsr",  bits_rdmsr, METH_VARARGS, "rdmsr(apicid, msr) -> long (None if GPF)"},
+    {"rdmsr_all",  (PyCFunction)bits_rdmsr_all, METH_KEYWORDS, "rdmsr_all(msr[, layout=None]) -> list of long (None if GPF), read concurrently on all CPUs, in the same order as cpus(). With layout=\"aos\", a read-only buffer of 16 bytes per CPU: little-endian 32-bit msr, 32-bit status (nonzero if GPF), 64-bit value; with layout=\"soa\", (values, status), read-only buffers of one 64-bit value and one 32-bit status per CPU."},
+    {"rdmsr_async",  bits_rdmsr_async, METH_VARARGS, "rdmsr_async(apicid, msr) -> start RDMSR on the specified CPU and return a pending call; wait() returns long (None if GPF)"},
+    {"rdmsr_many", bits_rdmsr_many, METH_VARARGS, "rdmsr_many(apicids, msrs) -> (values, gpf). Read every MSR in msrs on every CPU in apicids (all CPUs, in the same order as cpus(), if None), with one dispatch per CPU. values is a buffer of little-endian 64-bit values, one row of len(msrs) per CPU; gpf is a buffer with one row of (len(msrs) + 7) / 8 bytes per CPU, where bit j of a row is set if reading msrs[j] GPFd on that CPU."},
+    {"rdtsc", bits_rdtsc, METH_NOARGS, "rdtsc() -> read the TSC on the current CPU"},
     {"readb", (PyCFunction)bits_readb, METH_KEYWORDS, "readb(address[, apicid=BSP]) -> read byte from memory on the specified CPU"},
     {"readw", (PyCFunction)bits_readw, METH_KEYWORDS, "readw(address[, apicid=BSP]) -> read word from memory on the specified CPU"},
     {"readl", (PyCFunction)bits_readl, METH_KEYWORDS, "readl(address[, apicid=BSP]) -> read dword from memory on the specified CPU"},
     {"readq", (PyCFunction)bits_readq, METH_KEYWORDS, "readq(address[, apicid=BSP]) -> read qword from memory on the specified CPU"},
-    {"set_mwait", bits_set_mwait, METH_VARARGS, "set_mwait(apicid, use_mwait[, hint=0[, int_break_event=True]]) -> Enable/disable MWAIT, and set hints and flags"},
-    {"smi_latency", bits_smi_latency, METH_VARARGS, "smi_latency(duration, bin_maxes) -> (max_latency, smi_count_delta, [(bin_max, bin_total, bin_count, [latency])]). All times in TSC counts. smi_count_delta is None if reading MSR_SMI_COUNT GPFs."},
+    {"regprog", (PyCFunction)bits_regprog, METH_KEYWORDS, "regprog(program[, slots[, apicid=BSP]]) -> (completed, slots). Run a register program, a string of packed 32-byte operations as built by bits.regprog_op, on the specified CPU in a single dispatch. slots gives the initial values of the first len(slots) of the 16 result slots; the rest start at 0. completed is the number of operations run, less than the number in the program if an MSR access GPFd; slots is a tuple of the final slot values."},
+    {"rendezvous", (PyCFunction)bits_rendezvous, METH_KEYWORDS, "rendezvous([release_ticks[, layout=None]]) -> list of the TSC on each CPU as it left a barrier across all CPUs, in the same order as cpus(). With release_ticks, all CPUs leave together that many TSC counts after the last one arrives. With layout=\"aos\" or \"soa\", a read-only buffer of one little-endian 64-bit TSC per CPU, written directly by each CPU."},
+    {"reset_dispatch_stats", bits_reset_dispatch_stats, METH_NOARGS, "reset_dispatch_stats() -> clear the statistics returned by dispatch_stats()"},
+    {"set_mwait", bits_set_mwait, METH_VARARGS, "set_mwait(apicid, use_mwait[, hint=0[, int_break_event=True[, spin_ticks=0]]]) -> Enable/disable MWAIT, and set hints and flags. With MWAIT, spin for up to spin_ticks TSC counts before entering MWAIT."},
+    {"smi_latency", (PyCFunction)bits_smi_latency, METH_KEYWORDS, "smi_latency(duration, bin_maxes[, layout=None]) -> (max_latency, smi_count_delta, [(bin_max, bin_total, bin_count, [latency])]). All times in TSC counts. smi_count_delta is None if reading MSR_SMI_COUNT GPFs. With layout=\"aos\", the bins are a read-only buffer of 80 bytes per bin: little-endian 64-bit max, total, count, 32-bit recent_count, 32 reserved bits, then six 64-bit TSC values of the most recent samples in the bin, of which the first recent_count are valid. With layout=\"soa\", the bins are (max, total, count, recent_count, recent), read-only buffers of one 64-bit value per bin, one 32-bit value per bin, and six 64-bit values per bin."},
+    {"smi_latency_all", (PyCFunction)bits_smi_latency_all, METH_KEYWORDS, "smi_latency_all(duration, threshold[, ring_size=1024]) -> list of (max_latency, smi_count_delta, events, histogram, ring), in the same order as cpus(). ring_size is at most 2^24. All CPUs time gaps between TSC reads for duration TSC counts, starting together. smi_count_delta is None if reading MSR_SMI_COUNT GPFs on that CPU. histogram is a read-only buffer of 64 little-endian 64-bit (count, total) pairs, where bucket i covers gaps with floor(log2(gap)) == i. events is the number of gaps longer than threshold; ring is a read-only buffer of ring_size little-endian 64-bit (tsc, gap) pairs holding the last of them, where tsc is the TSC at the end of the gap. Once events exceeds ring_size, the ring has wrapped and the oldest entry is at index events % ring_size."},
+    {"start", bits_start, METH_NOARGS, "start() -> bool. Begin waking the APs in the background; the first call that needs them waits for them to finish."},
+    {"startup_timing", bits_startup_timing, METH_NOARGS, "startup_timing() -> (init, sipi, checkin) time spent in each phase of AP startup, in TSC counts"},
+    {"tsc_hz", bits_tsc_hz, METH_NOARGS, "tsc_hz() -> TSC frequency in Hz"},
+    {"wait", bits_wait, METH_VARARGS, "wait(pending) -> wait for the pending call to finish and return its result"},
+    {"wait_any", bits_wait_any, METH_VARARGS, "wait_any(pendings) -> wait for any of the pending calls to finish and return its index"},
     {"writeb", (PyCFunction)bits_writeb, METH_KEYWORDS, "writeb(address, value[, apicid=BSP]) -> write byte to memory on the specified CPU"},
     {"writew", (PyCFunction)bits_writew, METH_KEYWORDS, "writew(address, value[, apicid=BSP]) -> write word to memory on the specified CPU"},
     {"writel", (PyCFunction)bits_writel, METH_KEYWORDS, "writel(address, value[, apicid=BSP]) -> write dword to memory on the specified CPU"},
     {"writeq", (PyCFunction)bits_writeq, METH_KEYWORDS, "writeq(address, value[, apicid=BSP]) -> write qword to memory on the specified CPU"},
     {"wrmsr",  bits_wrmsr, METH_VARARGS, "wrmsr(apicid, msr, value) -> bool (False if GPF, True otherwise)"},
+    {"wrmsr_async",  bits_wrmsr_async, METH_VARARGS, "wrmsr_async(apicid, msr, value) -> start WRMSR on the specified CPU and return a pending call; wait() returns bool (False if GPF, True otherwise)"},
+    {"wrmsr_all",  bits_wrmsr_all, METH_VARARGS, "wrmsr_all(msr, value) -> list of bool (False if GPF, True otherwise), written concurrently on all CPUs, in the same order as cpus()"},
+    {"wrmsr_many", (PyCFunction)bits_wrmsr_many, METH_KEYWORDS, "wrmsr_many(apicids, msrs, values[, verify=False]) -> (gpf, mismatch, readback, readback_gpf). Write values[j] to msrs[j] on every CPU in apicids (all CPUs if None), with one dispatch per CPU. gpf is a bitmap of writes that GPFd, laid out as for rdmsr_many. With verify, each MSR written is read back; mismatch is a bitmap of MSRs that read back differently, readback a buffer of the values read (0 where the read GPFd), laid out as for rdmsr_many, and readback_gpf a bitmap of MSRs whose read back GPFd, such as write-only MSRs. Without verify, the last three are None."},
     {NULL, NULL, 0, NULL}        /* Sentinel */
 };
 
@@ -243,14 +243,12 @@ static U32 acpi_access(PPM_HOST * host)
 static void run_on_all_cpu(CALLBACK function, PPM_HOST * host)
 {
    U32 nproc;
-   const CPU_INFO *cpu;
    U32 i;
 
    nproc = smp_init();
-   cpu = smp_read_cpu_list();
 
    for (i = 0; i < nproc; i++)
-      smp_function(cpu[i].apicid, function, host);
+      smp_function_by_index(i, function, host);
 }
 
 //-----------------------------------------------------------------------------
@@ -32,3 +32,156 @@ void set_control(U32 * control, U32 value)
 {
     *control = value;
 }
+
+void atomic_increment(U32 * counter)
+{
+    __asm__ __volatile__ ("lock incl %[counter]" : [counter] "+m" (*counter) : : "memory", "cc");
+}
+
+/* Order earlier stores before later loads, which x86 does not otherwise guarantee. */
+void memory_fence(void)
+{
+    U32 dummy = 0;
+    __asm__ __volatile__ ("lock orl $0, %[dummy]" : [dummy] "+m" (dummy) : : "memory", "cc");
+}
+
+static U32 atomic_add_return(volatile U32 * counter, U32 value)
+{
+    U32 old = value;
+    __asm__ __volatile__ ("lock xaddl %[old], %[counter]" : [old] "+r" (old), [counter] "+m" (*counter) : : "memory", "cc");
+    return old + value;
+}
+
+static inline U64 read_tsc(void)
+{
+    U32 lo, hi;
+    __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((U64) hi << 32) | lo;
+}
+
+static inline void pause(void)
+{
+    __asm__ __volatile__ ("pause");
+}
+
+#define BARRIER_LINE 64
+#define BARRIER_DEPTH 3 // core, socket, root
+
+/* Arrivals and the release flag live on separate cache lines, so that CPUs
+ * still arriving do not disturb the ones already spinning. */
+struct barrier_node {
+    volatile U32 count;
+    U32 size;
+    struct barrier_node *parent;
+    U8 pad[BARRIER_LINE - 2 * sizeof(U32) - sizeof(void *)];
+    volatile U32 release;
+    U8 pad2[BARRIER_LINE - sizeof(U32)];
+};
+
+struct smp_barrier {
+    U64 release_ticks;
+    volatile U64 release_tsc;
+    struct barrier_node **leaf; // core node for each CPU index, or NULL
+    struct barrier_node *nodes;
+    U32 node_count;
+};
+
+unsigned long barrier_memory_size(U32 ncpus)
+{
+    // At most one core node and one socket node per CPU, plus the root, plus slack for alignment
+    return sizeof(struct smp_barrier) + ncpus * sizeof(struct barrier_node *) + (2 * ncpus + 2) * sizeof(struct barrier_node);
+}
+
+static struct barrier_node *new_node(SMP_BARRIER *barrier, struct barrier_node *parent)
+{
+    struct barrier_node *node = &barrier->nodes[barrier->node_count++];
+    node->count = 0;
+    node->size = 0;
+    node->release = 0;
+    node->parent = parent;
+    if (parent)
+        parent->size++;
+    return node;
+}
+
+SMP_BARRIER *barrier_init(void *memory, U32 ncpus, const CPU_INFO *cpu, U32 smt_shift, U32 package_shift, const U32 *mask, U64 release_ticks)
+{
+    SMP_BARRIER *barrier = memory;
+    struct barrier_node *root;
+    U32 i, j;
+
+    barrier->release_ticks = release_ticks;
+    barrier->release_tsc = 0;
+    barrier->leaf = (struct barrier_node **)(barrier + 1);
+    barrier->nodes = (struct barrier_node *)(((unsigned long)(barrier->leaf + ncpus) + BARRIER_LINE - 1) & ~(unsigned long)(BARRIER_LINE - 1));
+    barrier->node_count = 0;
+
+    root = new_node(barrier, NULL);
+    for (i = 0; i < ncpus; i++) {
+        struct barrier_node *core = NULL;
+        struct barrier_node *socket = NULL;
+
+        barrier->leaf[i] = NULL;
+        if (mask && !SMP_MASK_TEST(mask, i))
+            continue;
+
+        // Join the core or socket of an earlier CPU, if any
+        for (j = 0; j < i && !core; j++) {
+            if (!barrier->leaf[j])
+                continue;
+            if ((cpu[j].apicid >> smt_shift) == (cpu[i].apicid >> smt_shift))
+                core = barrier->leaf[j];
+            else if ((cpu[j].apicid >> package_shift) == (cpu[i].apicid >> package_shift))
+                socket = barrier->leaf[j]->parent;
+        }
+        if (!core) {
+            if (!socket)
+                socket = new_node(barrier, root);
+            core = new_node(barrier, socket);
+        }
+        core->size++;
+        barrier->leaf[i] = core;
+    }
+
+    return barrier;
+}
+
+void barrier_wait(SMP_BARRIER *barrier, U32 index)
+{
+    struct barrier_node *node = barrier->leaf[index];
+    struct barrier_node *won[BARRIER_DEPTH];
+    U32 generation[BARRIER_DEPTH];
+    U32 depth = 0;
+
+    if (!node)
+        return;
+
+    // The last CPU to arrive at each node carries on up the tree; the rest
+    // spin on that node's release flag.
+    for (;;) {
+        U32 next = node->release + 1;
+        if (atomic_add_return(&node->count, 1) != node->size) {
+            while (node->release != next)
+                pause();
+            break;
+        }
+        node->count = 0;
+        won[depth] = node;
+        generation[depth] = next;
+        depth++;
+        if (!node->parent) {
+            // Everyone has arrived; pick the moment they all leave
+            barrier->release_tsc = read_tsc() + barrier->release_ticks;
+            break;
+        }
+        node = node->parent;
+    }
+
+    // Release the nodes won on the way up, from the top down
+    while (depth--)
+        won[depth]->release = generation[depth];
+
+    if (barrier->release_ticks)
+        while (read_tsc() < barrier->release_tsc)
+            pause();
+}
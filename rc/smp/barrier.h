@@ -34,6 +34,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define BARRIER_H
 
 #include "datatype.h"
+#include "smprc.h"
 
 #define BSP_IN_CONTROL 0
 #define AP_IN_CONTROL 1
@@ -41,6 +42,17 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 /* Set control to the specified value. */
 void set_control(U32 * control, U32 value);
 
+/* Atomically increment *counter. */
+void atomic_increment(U32 * counter);
+void memory_fence(void);
+
+/* Tree barrier over the CPUs in cpu[0..ncpus) selected by mask (all if
+ * NULL), grouped by the APIC ID bits above smt_shift (core) and above
+ * package_shift (socket). */
+unsigned long barrier_memory_size(U32 ncpus);
+SMP_BARRIER *barrier_init(void *memory, U32 ncpus, const CPU_INFO *cpu, U32 smt_shift, U32 package_shift, const U32 *mask, U64 release_ticks);
+void barrier_wait(SMP_BARRIER *barrier, U32 index);
+
 /* wait_for_control defined as a function pointer elsewhere */
 
 #endif /* BARRIER_H */
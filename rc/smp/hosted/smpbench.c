@@ -0,0 +1,291 @@
+/*
+Copyright (c) 2013, Intel Corporation
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of Intel Corporation nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* smpbench: dispatch latency and throughput of the SMP engine, run against
+ * the hosted build so that changes to dispatch, queueing, and barriers can
+ * be measured without booting BITS.
+ *
+ * usage: smpbench [-h] [-c cpus] [-i iterations] [-s spin_ticks] [-S]
+ *   -h  print this usage and exit
+ *   -c  CPUs to emulate, counting the BSP (default: the host CPUs available)
+ *   -i  iterations of each test (default 100000)
+ *   -s  TSC ticks a waiting CPU spins before yielding (default 0)
+ *   -S  never yield; waiting CPUs spin, like use_mwait off
+ *
+ * Emulating more CPUs than the host has works, but then every wait that
+ * spins rather than yields (barriers, a full command ring) lasts a scheduler
+ * time slice, and the results measure the host scheduler.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "smprc.h"
+#include "smphosted.h"
+
+#define BURST 256
+
+static void *wm;
+static U64 tsc_hz;
+
+static void nop(void *param)
+{
+}
+
+static void count(void *param)
+{
+    (*(volatile U32 *)param)++;
+}
+
+struct barrier_run {
+    SMP_BARRIER *barrier;
+    U32 rounds;
+};
+
+static void barrier_rounds(void *param)
+{
+    struct barrier_run *run = param;
+    U32 i;
+
+    for (i = 0; i < run->rounds; i++)
+        smp_barrier_wait_with_memory(wm, run->barrier);
+}
+
+static double ns(U64 ticks, U64 n)
+{
+    return (double)ticks * 1e9 / tsc_hz / (n ? n : 1);
+}
+
+static void report(const char *name, U64 ticks, U64 n, const char *unit)
+{
+    printf("%-28s %10.1f ns/%-10s %12.0f %ss/s\n", name, ns(ticks, n), unit, n * (double)tsc_hz / (ticks ? ticks : 1), unit);
+}
+
+static void bench_function_by_index(U32 ncpus, U32 iterations)
+{
+    U64 start, ticks = 0;
+    U32 cpu, i;
+
+    for (cpu = 1; cpu < ncpus; cpu++) {
+        start = rdtsc64();
+        for (i = 0; i < iterations; i++)
+            smp_function_by_index_with_memory(wm, cpu, nop, NULL);
+        ticks += rdtsc64() - start;
+    }
+    report("smp_function_by_index", ticks, (U64)iterations * (ncpus - 1), "call");
+}
+
+static void bench_function_all(U32 iterations)
+{
+    U64 start;
+    U32 i;
+
+    start = rdtsc64();
+    for (i = 0; i < iterations; i++)
+        smp_function_all_with_memory(wm, nop, NULL);
+    report("smp_function_all", rdtsc64() - start, iterations, "call");
+}
+
+static void bench_queue_burst(U32 ncpus, U32 iterations)
+{
+    SMP_HANDLE *handles;
+    U32 *counters;
+    U64 start;
+    U32 cpu, i, n, done = 0;
+
+    handles = calloc(ncpus, sizeof(*handles));
+    counters = calloc(ncpus, sizeof(*counters));
+    if (!handles || !counters) {
+        free(handles);
+        free(counters);
+        return;
+    }
+
+    start = rdtsc64();
+    for (n = 0; n < iterations; n += BURST) {
+        for (cpu = 1; cpu < ncpus; cpu++)
+            for (i = 0; i < BURST; i++)
+                smp_queue_by_index_with_memory(wm, cpu, count, &counters[cpu], &handles[cpu]);
+        for (cpu = 1; cpu < ncpus; cpu++)
+            smp_doorbell_by_index_with_memory(wm, cpu);
+        for (cpu = 1; cpu < ncpus; cpu++)
+            smp_wait_with_memory(wm, &handles[cpu]);
+        done += BURST;
+    }
+    report("smp_queue burst", rdtsc64() - start, (U64)done * (ncpus - 1), "command");
+
+    for (cpu = 1; cpu < ncpus; cpu++)
+        if (counters[cpu] != done)
+            printf("CPU %u ran %u of %u queued commands\n", cpu, counters[cpu], done);
+
+    free(handles);
+    free(counters);
+}
+
+static void bench_barrier(U32 iterations)
+{
+    struct barrier_run run;
+    void *memory = NULL;
+    U64 start;
+
+    if (posix_memalign(&memory, SMP_MWAIT_ALIGN, smp_barrier_size_with_memory(wm)) != 0)
+        return;
+    run.barrier = smp_barrier_init_with_memory(wm, memory, NULL, 0);
+    run.rounds = iterations;
+    if (run.barrier) {
+        start = rdtsc64();
+        smp_function_all_with_memory(wm, barrier_rounds, &run);
+        report("smp_barrier_wait", rdtsc64() - start, iterations, "round");
+    }
+    free(memory);
+}
+
+static void print_stage(const char *name, const SMP_STAGE_STATS *stage)
+{
+    printf("  %-10s %12llu samples %10.1f ns avg %12.1f ns max\n", name,
+           (unsigned long long)stage->count, ns(stage->total, stage->count), ns(stage->max, 1));
+}
+
+static void add_stage(SMP_STAGE_STATS *sum, const SMP_STAGE_STATS *stage)
+{
+    U32 i;
+
+    sum->count += stage->count;
+    sum->total += stage->total;
+    if (stage->max > sum->max)
+        sum->max = stage->max;
+    for (i = 0; i < SMP_STATS_BUCKETS; i++)
+        sum->histogram[i] += stage->histogram[i];
+}
+
+static void print_dispatch_stats(U32 ncpus)
+{
+    SMP_DISPATCH_STATS sum, stats;
+    U32 cpu;
+
+    memset(&sum, 0, sizeof(sum));
+    for (cpu = 1; cpu < ncpus; cpu++) {
+        if (!smp_read_dispatch_stats_with_memory(wm, cpu, &stats))
+            continue;
+        add_stage(&sum.wake, &stats.wake);
+        add_stage(&sum.start, &stats.start);
+        add_stage(&sum.run, &stats.run);
+        add_stage(&sum.handback, &stats.handback);
+        sum.spin_wakes += stats.spin_wakes;
+        sum.mwait_wakes += stats.mwait_wakes;
+    }
+
+    printf("Dispatch stages over all APs (%llu spin wakes, %llu yield wakes):\n",
+           (unsigned long long)sum.spin_wakes, (unsigned long long)sum.mwait_wakes);
+    print_stage("wake", &sum.wake);
+    print_stage("start", &sum.start);
+    print_stage("run", &sum.run);
+    print_stage("handback", &sum.handback);
+}
+
+int main(int argc, char *argv[])
+{
+    U32 ncpus = smp_hosted_host_cpu_count();
+    U32 iterations = 100000;
+    U32 spin_ticks = 0;
+    bool spin = false;
+    unsigned long size;
+    const CPU_INFO *cpu;
+    U32 i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "hc:i:s:S")) != -1) {
+        switch (opt) {
+        case 'c':
+            ncpus = strtoul(optarg, NULL, 0);
+            break;
+        case 'i':
+            iterations = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            spin_ticks = strtoul(optarg, NULL, 0);
+            break;
+        case 'S':
+            spin = true;
+            break;
+        case 'h':
+            printf("usage: %s [-h] [-c cpus] [-i iterations] [-s spin_ticks] [-S]\n", argv[0]);
+            return 0;
+        default:
+            fprintf(stderr, "usage: %s [-h] [-c cpus] [-i iterations] [-s spin_ticks] [-S]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (ncpus < 2) {
+        fprintf(stderr, "%s: need at least 2 CPUs; use -c to emulate more than the host has\n", argv[0]);
+        return 1;
+    }
+
+    size = smp_working_memory_size(ncpus, SMP_DEFAULT_STACK_SIZE, SMP_DEFAULT_ARENA_SIZE);
+    if (posix_memalign(&wm, SMP_WORKING_MEMORY_ALIGN, size) != 0) {
+        fprintf(stderr, "%s: cannot allocate %lu bytes of working memory\n", argv[0], size);
+        return 1;
+    }
+    memset(wm, 0, size);
+
+    smp_hosted_set_cpu_count(ncpus);
+    ncpus = smp_init_with_memory(wm, ncpus, SMP_DEFAULT_STACK_SIZE, SMP_DEFAULT_ARENA_SIZE, NULL, NULL);
+    if (ncpus < 2) {
+        fprintf(stderr, "%s: smp_init_with_memory started %u CPUs\n", argv[0], ncpus);
+        return 1;
+    }
+    tsc_hz = smp_read_tsc_hz_with_memory(wm);
+
+    cpu = smp_read_cpu_list_with_memory(wm);
+    for (i = 0; i < ncpus; i++)
+        smp_set_mwait_with_memory(wm, cpu[i].apicid, !spin, 0, 1, spin_ticks);
+
+    printf("%u CPUs on %u host CPUs, TSC %.3f GHz, %s after %u ticks\n", ncpus, smp_hosted_host_cpu_count(),
+           tsc_hz / 1e9, spin ? "never yielding" : "yielding", spin_ticks);
+
+    // Reset the stats before each phase, so each report covers only that phase
+    smp_reset_dispatch_stats_with_memory(wm);
+    bench_function_by_index(ncpus, iterations);
+    print_dispatch_stats(ncpus);
+
+    smp_reset_dispatch_stats_with_memory(wm);
+    bench_function_all(iterations);
+    print_dispatch_stats(ncpus);
+
+    smp_reset_dispatch_stats_with_memory(wm);
+    bench_queue_burst(ncpus, iterations);
+    print_dispatch_stats(ncpus);
+
+    smp_reset_dispatch_stats_with_memory(wm);
+    bench_barrier(iterations);
+    print_dispatch_stats(ncpus);
+
+    return 0;
+}
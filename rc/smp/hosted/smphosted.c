@@ -0,0 +1,379 @@
+/*
+Copyright (c) 2013, Intel Corporation
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of Intel Corporation nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Hosted platform layer for the SMP engine: the dispatch code in
+ * smpdispatch.c runs unchanged, with pthreads pinned to host CPUs playing the
+ * APs.  There is no SIPI, IDT, or APIC timer here; APIC IDs, the MADT, and
+ * MSRs are mocked, while CPUID and the TSC are the host's own. */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "barrier.h"
+#include "portable.h"
+#include "smprc.h"
+#include "smpequ.h"
+#include "smphosted.h"
+#include "smpint.h"
+
+#define MSR_IA32_TSC 0x10
+#define MOCK_MSR_COUNT 32
+
+typedef struct mock_msr {
+    U32 msr;
+    U64 value;
+} MOCK_MSR;
+
+// Each host thread plays one CPU, with its own APIC ID and MSRs
+static __thread U32 this_apicid;
+static __thread MOCK_MSR mock_msrs[MOCK_MSR_COUNT];
+static __thread U32 mock_msr_count;
+
+static U32 hosted_cpu_count;
+static U8 hosted_page_below_1M[SMP_LOW_MEMORY_SIZE];
+
+void dprintf(const char *debug_context, const char *fmt, ...)
+{
+    const char *debug_env = getenv("debug");
+    unsigned long len = strlen(debug_context);
+    const char *p;
+    va_list args;
+
+    if (!debug_env)
+        return;
+    for (p = strstr(debug_env, debug_context); p; p = strstr(p + 1, debug_context))
+        if ((p == debug_env || p[-1] == ' ' || p[-1] == ',') && (p[len] == '\0' || p[len] == ' ' || p[len] == ','))
+            break;
+    if (!p)
+        return;
+
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+}
+
+void cpuid32(U32 func, U32 * eax, U32 * ebx, U32 * ecx, U32 * edx)
+{
+    cpuid32_indexed(func, 0, eax, ebx, ecx, edx);
+}
+
+void cpuid32_indexed(U32 func, U32 index, U32 * eax, U32 * ebx, U32 * ecx, U32 * edx)
+{
+    __asm__ __volatile__ ("cpuid" : "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx) : "a" (func), "c" (index));
+}
+
+U64 rdtsc64(void)
+{
+    U32 lo_data, hi_data;
+
+    __asm__ __volatile__ ("rdtsc" : "=a" (lo_data), "=d" (hi_data));
+    return ((U64) hi_data << 32) + lo_data;
+}
+
+/* MSRs read back whatever the same thread last wrote to them, apart from the
+ * TSC; reading one never written reports a GPF, as does running out of room. */
+void rdmsr64(U32 msr, U64 * data_addr, U32 * status)
+{
+    U32 i;
+
+    *status = 0;
+    if (msr == MSR_IA32_TSC) {
+        *data_addr = rdtsc64();
+        return;
+    }
+    for (i = 0; i < mock_msr_count; i++)
+        if (mock_msrs[i].msr == msr) {
+            *data_addr = mock_msrs[i].value;
+            return;
+        }
+    *data_addr = 0;
+    *status = -1;
+}
+
+void wrmsr64(U32 msr, U64 data, U32 * status)
+{
+    U32 i;
+
+    *status = 0;
+    for (i = 0; i < mock_msr_count; i++)
+        if (mock_msrs[i].msr == msr) {
+            mock_msrs[i].value = data;
+            return;
+        }
+    if (mock_msr_count == MOCK_MSR_COUNT) {
+        *status = -1;
+        return;
+    }
+    mock_msrs[mock_msr_count].msr = msr;
+    mock_msrs[mock_msr_count].value = data;
+    mock_msr_count++;
+}
+
+/* The host CPUs this process may run on, read before the BSP pins itself */
+static const cpu_set_t *host_cpus(void)
+{
+    static cpu_set_t set;
+    static bool read;
+
+    if (!read) {
+        if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+            CPU_ZERO(&set);
+            CPU_SET(sched_getcpu(), &set);
+        }
+        read = true;
+    }
+    return &set;
+}
+
+U32 smp_hosted_host_cpu_count(void)
+{
+    return CPU_COUNT(host_cpus());
+}
+
+void smp_hosted_set_cpu_count(U32 count)
+{
+    hosted_cpu_count = count;
+}
+
+U32 smp_madt_processor_count(void)
+{
+    if (!hosted_cpu_count)
+        hosted_cpu_count = smp_hosted_host_cpu_count();
+    return hosted_cpu_count;
+}
+
+/* Pin the calling thread to the host CPU for processor_id, wrapping around
+ * when there are more emulated CPUs than host CPUs. */
+static void pin_to_host_cpu(U32 processor_id)
+{
+    const cpu_set_t *allowed = host_cpus();
+    U32 n = processor_id % CPU_COUNT(allowed);
+    cpu_set_t set;
+    int cpu;
+
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu, allowed) && n-- == 0)
+            break;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+        dprintf("smp", "Could not pin processor %u to host CPU %d\n", processor_id, cpu);
+}
+
+/* Stands in for wait_for_control_asm.  A thread cannot MWAIT, and a futex
+ * would need a wake from every store to a control word, including the
+ * atomic_increment of a broadcast completion count, so once the spin budget
+ * runs out the "MWAIT" wait yields the host CPU between checks instead. */
+static asmlinkage U32 hosted_wait_for_control(U32 * control, U32 value, U32 use_mwait, U32 mwait_hint, U32 int_break_event, U32 spin_ticks)
+{
+    U64 start = rdtsc64();
+
+    while (*(volatile U32 *)control != value) {
+        if (use_mwait && rdtsc64() - start >= spin_ticks) {
+            while (*(volatile U32 *)control != value)
+                sched_yield();
+            return 1;
+        }
+        pause32();
+    }
+    return 0;
+}
+
+void read_apicid(void *param)
+{
+    *(U32 *) param = this_apicid;
+}
+
+void bsp_function(SMP_HOST * host, CALLBACK function, void *param)
+{
+    // No GPF handler to install; a faulting callback takes the process down
+    function(param);
+}
+
+bool mwait_supported(void)
+{
+    return true;
+}
+
+bool int_break_event_supported(void)
+{
+    return true;
+}
+
+static U64 monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (U64) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Count TSC ticks across 50ms of the host clock. */
+static void calibrate_timebase(SMP_HOST * host)
+{
+    U64 start_ns, start_tsc, ns;
+
+    start_ns = monotonic_ns();
+    start_tsc = rdtsc64();
+    while ((ns = monotonic_ns() - start_ns) < 50000000ULL)
+        pause32();
+    host->tsc_hz = (rdtsc64() - start_tsc) * 1000000000ULL / ns;
+    host->bclk = 0;
+    host->apic_timer_hz = 0;
+    dprintf("smp", "TSC: %llu Hz\n", (unsigned long long)host->tsc_hz);
+}
+
+static void *ap_thread(void *param)
+{
+    CPU_DATA *cpu_data = param;
+    SMP_HOST *host = cpu_data->host;
+    U32 processor_id = cpu_data->processor_id;
+
+    pin_to_host_cpu(processor_id);
+
+    // Mock APIC IDs are just the processor IDs
+    this_apicid = processor_id;
+    read_apicid(&host->cpu[processor_id].apicid);
+    host->cpu[processor_id].present = 1;
+    cpu_data->status = 1;
+
+    mp_worker(cpu_data);
+}
+
+static void wait_for_aps(SMP_HOST * host)
+{
+    U8 *addr = host->mem_region_below_1M;
+    U32 thread_count = host->expected_processor_count - 1; // We already have the BSP
+
+    if (!host->aps_started)
+        return;
+
+    while (*(volatile U32 *)(addr + ASLEEP) != thread_count)
+        sched_yield();
+
+    host->logical_processor_count = thread_count + 1;
+    host->startup_timing.checkin_ticks = rdtsc64() - host->sipi_done;
+}
+
+U32 smp_init_with_memory(void *working_memory, U32 max_cpus, U32 stack_size, U32 arena_size, void *page_below_1M, void *reserved_mwait_memory)
+{
+    struct smp_host *host = working_memory;
+
+    if (host->initialized == SMP_MAGIC)
+        return host->logical_processor_count;
+
+    if (host->initialized != SMP_STARTING && !smp_start_with_memory(working_memory, max_cpus, stack_size, arena_size, page_below_1M, reserved_mwait_memory))
+        return 0;
+
+    wait_for_aps(host);
+    build_apicid_index(host);
+    host->initialized = SMP_MAGIC;
+    return host->logical_processor_count;
+}
+
+/* The APs run on pthread stacks, since the per-CPU stacks in working memory
+ * are smaller than a thread may have; the AP code itself uses neither the
+ * page below 1M nor reserved MWAIT memory, though the check-in count still
+ * goes in the low page. */
+bool smp_start_with_memory(void *working_memory, U32 max_cpus, U32 stack_size, U32 arena_size, void *page_below_1M, void *reserved_mwait_memory)
+{
+    struct smp_host *host = working_memory;
+    pthread_attr_t attr;
+    U64 start;
+    U32 i;
+
+    if (host->initialized == SMP_MAGIC || host->initialized == SMP_STARTING)
+        return true;
+
+    host->expected_processor_count = smp_madt_processor_count();
+
+    dprintf("smp", "Processor count from mock MADT: %u\n", host->expected_processor_count);
+
+    if (host->expected_processor_count > max_cpus) {
+        dprintf("smp", "Working memory only sized for %u CPUs\n", max_cpus);
+        return false;
+    }
+
+    this_apicid = 0;
+    pin_to_host_cpu(0);
+
+    init_working_memory(host, max_cpus, stack_size, arena_size, reserved_mwait_memory);
+    host->mem_region_below_1M = page_below_1M ? page_below_1M : hosted_page_below_1M;
+    *(U32 *)((U8 *)host->mem_region_below_1M + ASLEEP) = 0;
+    host->wait_for_control = hosted_wait_for_control;
+
+    calibrate_timebase(host);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    start = rdtsc64();
+    for (i = 1; i < host->expected_processor_count; i++) {
+        pthread_t thread;
+        CPU_DATA *cpu_data = &host->cpu_data[i];
+
+        cpu_data->host = host;
+        cpu_data->processor_id = i;
+        if (pthread_create(&thread, &attr, ap_thread, cpu_data) != 0) {
+            dprintf("smp", "Could not create a thread for processor %u\n", i);
+            break;
+        }
+    }
+    pthread_attr_destroy(&attr);
+    host->expected_processor_count = i;
+    host->sipi_done = rdtsc64();
+
+    host->startup_timing.init_ticks = 0;
+    host->startup_timing.sipi_ticks = host->sipi_done - start;
+    host->aps_started = true;
+    host->initialized = SMP_STARTING;
+    return true;
+}
+
+U64 smp_sleep_with_memory(void *working_memory, U32 microseconds)
+{
+    struct timespec ts;
+    U64 start;
+
+    struct smp_host *host = working_memory;
+    if (!host || host->initialized != SMP_MAGIC)
+        return 0;
+
+    ts.tv_sec = microseconds / 1000000;
+    ts.tv_nsec = (microseconds % 1000000) * 1000L;
+    start = rdtsc64();
+    while (nanosleep(&ts, &ts) != 0)
+        ;
+    return rdtsc64() - start;
+}
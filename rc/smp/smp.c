@@ -31,8 +31,10 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "portable.h"
 
 #include <grub/dl.h>
+#include <grub/env.h>
 #include <grub/machine/memory.h>
 #include <grub/memory.h>
+#include <grub/misc.h>
 #include <grub/mm.h>
 
 GRUB_MOD_LICENSE("GPLv3+");
@@ -41,40 +43,99 @@ GRUB_MOD_DUAL_LICENSE("3-clause BSD");
 static void *global_working_memory = NULL;
 static void *global_page_below_1M = NULL;
 static void *global_reserved_mwait_memory = NULL;
+static U32 global_max_cpus = 0;
+static U32 global_stack_size = 0;
+static U32 global_arena_size = 0;
 
-U32 smp_init(void)
+/* Sizes set in the environment may not go below the defaults, which the
+ * callbacks in this tree need, or above these limits. */
+#define SMP_MAX_STACK_SIZE 0x10000
+#define SMP_MAX_ARENA_SIZE 0x100000
+
+static U32 env_size(const char *name, U32 default_size, U32 max_size)
+{
+    const char *env = grub_env_get(name);
+    char *end;
+    unsigned long size;
+
+    if (!env)
+        return default_size;
+    grub_errno = GRUB_ERR_NONE;
+    size = grub_strtoul(env, &end, 0);
+    if (grub_errno || end == env || *end || size < default_size || size > max_size) {
+        grub_errno = GRUB_ERR_NONE;
+        dprintf("smp", "Ignoring %s=\"%s\"; must be a number from %u to %u. Using %u.\n", name, env, default_size, max_size, default_size);
+        return default_size;
+    }
+    return size;
+}
+
+static bool alloc_memory(void)
 {
     int handle;
 
     if (!global_working_memory) {
-        global_working_memory = grub_memalign(SMP_WORKING_MEMORY_ALIGN, SMP_WORKING_MEMORY_SIZE);
+        unsigned long size;
+
+        // Size everything for the CPUs the MADT lists, rather than a fixed maximum
+        global_max_cpus = smp_madt_processor_count();
+        if (!global_max_cpus)
+            global_max_cpus = 1;
+
+        global_stack_size = env_size("smp_stack_size", SMP_DEFAULT_STACK_SIZE, SMP_MAX_STACK_SIZE);
+        global_arena_size = env_size("smp_arena_size", SMP_DEFAULT_ARENA_SIZE, SMP_MAX_ARENA_SIZE);
+        // Keep the stacks and arenas well within the address space
+        if ((U64)global_max_cpus * (global_stack_size + global_arena_size) > ~0UL / 2) {
+            dprintf("smp", "Stacks and arenas too large for %u CPUs; using the default sizes\n", global_max_cpus);
+            global_stack_size = SMP_DEFAULT_STACK_SIZE;
+            global_arena_size = SMP_DEFAULT_ARENA_SIZE;
+        }
+
+        size = smp_working_memory_size(global_max_cpus, global_stack_size, global_arena_size);
+        global_working_memory = grub_memalign(SMP_WORKING_MEMORY_ALIGN, size);
         if (!global_working_memory) {
             dprintf("smp", "Failed to allocate working memory\n");
-            return 0;
+            return false;
         }
-        grub_memset(global_working_memory, 0, SMP_WORKING_MEMORY_SIZE);
+        grub_memset(global_working_memory, 0, size);
+        dprintf("smp", "Allocated %lu bytes of working memory for %u CPUs (%u byte stacks, %u byte arenas)\n",
+                size, global_max_cpus, global_stack_size, global_arena_size);
     }
 
     if (!global_page_below_1M) {
         global_page_below_1M = grub_mmap_malign_and_register(SMP_LOW_MEMORY_ALIGN, SMP_LOW_MEMORY_SIZE, &handle, GRUB_MEMORY_AVAILABLE, GRUB_MMAP_MALLOC_LOW);
         if (!global_page_below_1M) {
             dprintf("smp", "Failed to allocate a page below 1M\n");
-            return 0;
+            return false;
         } else if ((grub_addr_t)global_page_below_1M >= 1048576) {
             dprintf("smp", "Attempted to allocate a page below 1M, but got %p\n", global_page_below_1M);
-            return 0;
+            return false;
         }
     }
 
     if (!global_reserved_mwait_memory) {
-        global_reserved_mwait_memory = grub_mmap_malign_and_register(SMP_RESERVED_MEMORY_ALIGN, SMP_RESERVED_MEMORY_SIZE, &handle, GRUB_MEMORY_RESERVED, 0);
+        global_reserved_mwait_memory = grub_mmap_malign_and_register(SMP_RESERVED_MEMORY_ALIGN, smp_reserved_memory_size(global_max_cpus), &handle, GRUB_MEMORY_RESERVED, 0);
         if (!global_reserved_mwait_memory) {
             dprintf("smp", "Failed to allocate reserved MWAIT memory\n");
-            return 0;
+            return false;
         }
     }
 
-    return smp_init_with_memory(global_working_memory, global_page_below_1M, global_reserved_mwait_memory);
+    return true;
+}
+
+U32 smp_init(void)
+{
+    if (!alloc_memory())
+        return 0;
+    return smp_init_with_memory(global_working_memory, global_max_cpus, global_stack_size, global_arena_size, global_page_below_1M, global_reserved_mwait_memory);
+}
+
+bool smp_start(void)
+{
+    if (!alloc_memory())
+        return false;
+    return smp_start_with_memory(global_working_memory, global_max_cpus, global_stack_size, global_arena_size, global_page_below_1M, global_reserved_mwait_memory);
 }
 
 U32 smp_read_bclk(void)
@@ -82,6 +143,26 @@ U32 smp_read_bclk(void)
     return smp_read_bclk_with_memory(global_working_memory);
 }
 
+U64 smp_read_tsc_hz(void)
+{
+    return smp_read_tsc_hz_with_memory(global_working_memory);
+}
+
+bool smp_read_startup_timing(SMP_STARTUP_TIMING *timing)
+{
+    return smp_read_startup_timing_with_memory(global_working_memory, timing);
+}
+
+void *smp_arena_alloc(unsigned long size)
+{
+    return smp_arena_alloc_with_memory(global_working_memory, size);
+}
+
+void smp_arena_reset_by_index(U32 index)
+{
+    smp_arena_reset_by_index_with_memory(global_working_memory, index);
+}
+
 const CPU_INFO *smp_read_cpu_list(void)
 {
     return smp_read_cpu_list_with_memory(global_working_memory);
@@ -92,14 +173,24 @@ void smp_phantom_init(void)
     smp_phantom_init_with_memory(global_working_memory);
 }
 
-bool smp_get_mwait(U32 apicid, bool *use_mwait, U32 *mwait_hint, U32 *int_break_event)
+bool smp_read_dispatch_stats(U32 index, SMP_DISPATCH_STATS *stats)
+{
+    return smp_read_dispatch_stats_with_memory(global_working_memory, index, stats);
+}
+
+void smp_reset_dispatch_stats(void)
 {
-    return smp_get_mwait_with_memory(global_working_memory, apicid, use_mwait, mwait_hint, int_break_event);
+    smp_reset_dispatch_stats_with_memory(global_working_memory);
 }
 
-void smp_set_mwait(U32 apicid, bool use_mwait, U32 mwait_hint, U32 int_break_event)
+bool smp_get_mwait(U32 apicid, bool *use_mwait, U32 *mwait_hint, U32 *int_break_event, U32 *spin_ticks)
 {
-    smp_set_mwait_with_memory(global_working_memory, apicid, use_mwait, mwait_hint, int_break_event);
+    return smp_get_mwait_with_memory(global_working_memory, apicid, use_mwait, mwait_hint, int_break_event, spin_ticks);
+}
+
+void smp_set_mwait(U32 apicid, bool use_mwait, U32 mwait_hint, U32 int_break_event, U32 spin_ticks)
+{
+    smp_set_mwait_with_memory(global_working_memory, apicid, use_mwait, mwait_hint, int_break_event, spin_ticks);
 }
 
 U32 smp_function(U32 apicid, CALLBACK function, void *param)
@@ -107,9 +198,94 @@ U32 smp_function(U32 apicid, CALLBACK function, void *param)
     return smp_function_with_memory(global_working_memory, apicid, function, param);
 }
 
-void smp_sleep(U32 microseconds)
+U32 smp_function_by_index(U32 index, CALLBACK function, void *param)
+{
+    return smp_function_by_index_with_memory(global_working_memory, index, function, param);
+}
+
+U32 smp_function_mask(const U32 *mask, CALLBACK function, void *param)
+{
+    return smp_function_mask_with_memory(global_working_memory, mask, function, param);
+}
+
+U32 smp_function_all(CALLBACK function, void *param)
+{
+    return smp_function_all_with_memory(global_working_memory, function, param);
+}
+
+bool smp_queue(U32 apicid, CALLBACK function, void *param, SMP_HANDLE *handle)
+{
+    return smp_queue_with_memory(global_working_memory, apicid, function, param, handle);
+}
+
+bool smp_doorbell(U32 apicid)
+{
+    return smp_doorbell_with_memory(global_working_memory, apicid);
+}
+
+bool smp_function_async(U32 apicid, CALLBACK function, void *param, SMP_HANDLE *handle)
+{
+    return smp_function_async_with_memory(global_working_memory, apicid, function, param, handle);
+}
+
+bool smp_queue_by_index(U32 index, CALLBACK function, void *param, SMP_HANDLE *handle)
+{
+    return smp_queue_by_index_with_memory(global_working_memory, index, function, param, handle);
+}
+
+bool smp_doorbell_by_index(U32 index)
+{
+    return smp_doorbell_by_index_with_memory(global_working_memory, index);
+}
+
+bool smp_function_async_by_index(U32 index, CALLBACK function, void *param, SMP_HANDLE *handle)
+{
+    return smp_function_async_by_index_with_memory(global_working_memory, index, function, param, handle);
+}
+
+bool smp_poll(const SMP_HANDLE *handle)
+{
+    return smp_poll_with_memory(global_working_memory, handle);
+}
+
+void smp_wait(const SMP_HANDLE *handle)
+{
+    smp_wait_with_memory(global_working_memory, handle);
+}
+
+U32 smp_wait_any(const SMP_HANDLE *handles, U32 count)
+{
+    return smp_wait_any_with_memory(global_working_memory, handles, count);
+}
+
+bool smp_read_cpu_index(U32 *index)
+{
+    return smp_read_cpu_index_with_memory(global_working_memory, index);
+}
+
+bool smp_lookup_cpu_index(U32 apicid, U32 *index)
+{
+    return smp_lookup_cpu_index_with_memory(global_working_memory, apicid, index);
+}
+
+unsigned long smp_barrier_size(void)
+{
+    return smp_barrier_size_with_memory(global_working_memory);
+}
+
+SMP_BARRIER *smp_barrier_init(void *barrier_memory, const U32 *mask, U64 release_ticks)
+{
+    return smp_barrier_init_with_memory(global_working_memory, barrier_memory, mask, release_ticks);
+}
+
+bool smp_barrier_wait(SMP_BARRIER *barrier)
+{
+    return smp_barrier_wait_with_memory(global_working_memory, barrier);
+}
+
+U64 smp_sleep(U32 microseconds)
 {
-    smp_sleep_with_memory(global_working_memory, microseconds);
+    return smp_sleep_with_memory(global_working_memory, microseconds);
 }
 
 GRUB_MOD_INIT(smp)
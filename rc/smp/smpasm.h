@@ -42,13 +42,17 @@ typedef struct dword_regs {
 
 typedef asmlinkage void (*ASM_CALLBACK)(void *);
 
+/* Entry point for APs started by ApStart, which passes the ticket each AP
+ * took as its processor ID. */
+typedef asmlinkage void (*AP_ENTRY)(void *param, U32 processor_id);
+
 asmlinkage void gpfHandler(void);
 asmlinkage void intHandler_asm(void);
 asmlinkage void switch_stack_and_call(void *function, void *param, void *stack_addr) attr_noreturn;
 asmlinkage void ApStart(void);
 asmlinkage void pm32(void);
 extern U32 pm32_size;
-asmlinkage void wait_for_control_asm(U32 * control, U32 value, U32 use_mwait, U32 mwait_hint, U32 int_break_event);
+asmlinkage U32 wait_for_control_asm(U32 * control, U32 value, U32 use_mwait, U32 mwait_hint, U32 int_break_event, U32 spin_ticks);
 extern U32 wait_for_control_asm_size;
 
 #endif /* smpasm_h */
@@ -0,0 +1,762 @@
+/*
+Copyright (c) 2013, Intel Corporation
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of Intel Corporation nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "barrier.h"
+#include "portable.h"
+#include "smprc.h"
+#include "smpequ.h"
+#include "smpint.h"
+
+void smp_layout(U32 max_cpus, U32 stack_size, U32 arena_size, struct smp_layout *layout)
+{
+    layout->stack_size = SMP_LAYOUT_ALIGN(stack_size);
+    layout->arena_size = SMP_LAYOUT_ALIGN(arena_size);
+
+    // Keep the APIC ID table at most half full
+    layout->apicid_hash_bits = 1;
+    while ((1UL << layout->apicid_hash_bits) < 2UL * max_cpus)
+        layout->apicid_hash_bits++;
+
+    layout->cpu = SMP_LAYOUT_ALIGN(sizeof(SMP_HOST));
+    layout->apicid_index = SMP_LAYOUT_ALIGN(layout->cpu + max_cpus * sizeof(CPU_INFO));
+    layout->cpu_data = SMP_LAYOUT_ALIGN(layout->apicid_index + (sizeof(U32) << layout->apicid_hash_bits));
+    layout->control_region = SMP_LAYOUT_ALIGN(layout->cpu_data + max_cpus * sizeof(CPU_DATA));
+    layout->stacks = SMP_LAYOUT_ALIGN(layout->control_region + (max_cpus + 1) * SMP_MWAIT_ALIGN);
+    layout->arenas = layout->stacks + max_cpus * layout->stack_size;
+    layout->size = layout->arenas + max_cpus * layout->arena_size;
+}
+
+unsigned long smp_working_memory_size(U32 max_cpus, U32 stack_size, U32 arena_size)
+{
+    struct smp_layout layout;
+    smp_layout(max_cpus, stack_size, arena_size, &layout);
+    return layout.size;
+}
+
+unsigned long smp_reserved_memory_size(U32 max_cpus)
+{
+    return max_cpus * SMP_MWAIT_ALIGN + SMP_RESERVED_CODE_SIZE;
+}
+
+/* Carve working memory into the per-CPU arrays and leave every CPU idle with
+ * an empty command ring.  The control words go in reserved_mwait_memory if
+ * the caller has some; the platform layer still has to fill in
+ * wait_for_control and mem_region_below_1M. */
+void init_working_memory(SMP_HOST * host, U32 max_cpus, U32 stack_size, U32 arena_size, void *reserved_mwait_memory)
+{
+    struct smp_layout layout;
+    U8 *working_memory = (U8 *)host;
+    U32 i;
+
+    smp_layout(max_cpus, stack_size, arena_size, &layout);
+    host->max_processor_count = max_cpus;
+    host->stack_size = layout.stack_size;
+    host->arena_size = layout.arena_size;
+    host->apicid_hash_bits = layout.apicid_hash_bits;
+    host->cpu = (CPU_INFO *)(working_memory + layout.cpu);
+    host->apicid_index = (U32 *)(working_memory + layout.apicid_index);
+    host->cpu_data = (CPU_DATA *)(working_memory + layout.cpu_data);
+    host->control_region = working_memory + layout.control_region;
+    host->stacks = working_memory + layout.stacks;
+    host->arenas = working_memory + layout.arenas;
+
+    host->logical_processor_count = 1;
+    host->completion = (U32 *)(((unsigned long)host->completion_region + SMP_MWAIT_ALIGN - 1) & ~(unsigned long)(SMP_MWAIT_ALIGN - 1));
+    if (reserved_mwait_memory)
+        host->control = reserved_mwait_memory;
+    else
+        host->control = (U8 *)(((unsigned long)host->control_region + SMP_MWAIT_ALIGN - 1) & ~(unsigned long)(SMP_MWAIT_ALIGN - 1));
+
+    for (i = 0; i < max_cpus; i++) {
+        host->cpu[i].present = 0;
+        set_control((U32 *) (host->control + i * SMP_MWAIT_ALIGN), BSP_IN_CONTROL);
+        host->cpu_data[i].use_mwait = true;
+        host->cpu_data[i].mwait_hint = 0;
+        host->cpu_data[i].int_break_event = 1;
+        host->cpu_data[i].spin_ticks = 0;
+        host->cpu_data[i].arena = host->arenas + i * host->arena_size;
+        host->cpu_data[i].arena_used = 0;
+        host->cpu_data[i].dispatched = 0;
+        host->cpu_data[i].completed = 0;
+    }
+
+    host->cpu[0].present = 1;
+    read_apicid(&host->cpu[0].apicid);
+    host->cpu_data[0].host = host;
+    host->cpu_data[0].processor_id = 0;
+}
+
+bool smp_get_mwait_with_memory(void *working_memory, U32 apicid, bool *use_mwait, U32 *mwait_hint, U32 *int_break_event, U32 *spin_ticks)
+{
+    U32 processor_id;
+    CPU_DATA *cpu_data;
+
+    struct smp_host *host = working_memory;
+    if (!host || host->initialized != SMP_MAGIC)
+        return false;
+
+    if (find_processor_id_for_this_apicid(apicid, &processor_id, host) == 0)
+        return false;
+
+    cpu_data = &host->cpu_data[processor_id];
+
+    *use_mwait = cpu_data->use_mwait;
+    *mwait_hint = cpu_data->mwait_hint;
+    *int_break_event = cpu_data->int_break_event;
+    *spin_ticks = cpu_data->spin_ticks;
+
+    return true;
+}
+
+void smp_set_mwait_with_memory(void *working_memory, U32 apicid, bool use_mwait, U32 mwait_hint, U32 int_break_event, U32 spin_ticks)
+{
+    U32 processor_id;
+    CPU_DATA *cpu_data;
+
+    struct smp_host *host = working_memory;
+    if (!host || host->initialized != SMP_MAGIC)
+        return;
+
+    if (find_processor_id_for_this_apicid(apicid, &processor_id, host) == 0)
+        return;
+
+    cpu_data = &host->cpu_data[processor_id];
+
+    cpu_data->use_mwait = use_mwait;
+    cpu_data->mwait_hint = mwait_hint;
+    cpu_data->int_break_event = int_break_event;
+    cpu_data->spin_ticks = spin_ticks;
+}
+
+/* Wait for *control == value using the policy configured for the CPU that owns
+ * cpu_data.  Returns true if the wait ended in MWAIT rather than spinning. */
+bool wait_for_control(SMP_HOST *host, CPU_DATA *cpu_data, U32 *control, U32 value, U32 spin_ticks)
+{
+    /* Detect the ability to use mwait every time, just in case a function does something to disable it. */
+    return host->wait_for_control(control, value,
+                                  cpu_data->use_mwait && mwait_supported(), cpu_data->mwait_hint,
+                                  cpu_data->int_break_event && int_break_event_supported(), spin_ticks) != 0;
+}
+
+U32 bsr64(U64 value)
+{
+    U32 hi = (U32)(value >> 32);
+    U32 lo = (U32) value;
+    U32 bit;
+
+    if (hi) {
+        __asm__ ("bsrl %[hi], %[bit]" : [bit] "=r" (bit) : [hi] "rm" (hi) : "cc");
+        bit += 32;
+    } else if (lo)
+        __asm__ ("bsrl %[lo], %[bit]" : [bit] "=r" (bit) : [lo] "rm" (lo) : "cc");
+    else
+        bit = 0;
+
+    return bit;
+}
+
+static U32 log2_bucket(U64 ticks)
+{
+    U32 bit = bsr64(ticks);
+    return bit < SMP_STATS_BUCKETS ? bit : SMP_STATS_BUCKETS - 1;
+}
+
+static void record_stage(SMP_STAGE_STATS *stage, U64 ticks)
+{
+    // Cross-CPU intervals can come out negative if the TSCs are not synchronized
+    if ((ticks >> 63) != 0)
+        ticks = 0;
+    stage->count++;
+    stage->total += ticks;
+    if (ticks > stage->max)
+        stage->max = ticks;
+    stage->histogram[log2_bucket(ticks)]++;
+}
+
+//-----------------------------------------------------------------------------
+asmlinkage void mp_worker(void *param)
+{
+    CPU_DATA *cpu_data = param;
+    SMP_HOST *host = cpu_data->host;
+    U32 *my_control;
+
+    // Check in with the BSP waiting in do_callback
+    atomic_increment((U32 *)((U8 *)host->mem_region_below_1M + ASLEEP));
+
+    my_control = (U32 *) (host->control + cpu_data->processor_id * SMP_MWAIT_ALIGN);
+
+    for (;;) {
+        SMP_COMMAND *next;
+
+        // Only waits for dispatched work count in the stats; the BSP and
+        // smp_sleep wait for other reasons.
+        if (wait_for_control(host, cpu_data, my_control, AP_IN_CONTROL, cpu_data->spin_ticks))
+            cpu_data->stats.mwait_wakes++;
+        else
+            cpu_data->stats.spin_wakes++;
+        next = &cpu_data->ring[cpu_data->completed % SMP_RING_SIZE];
+        if (cpu_data->completed != *(volatile U32 *)&cpu_data->dispatched && next->doorbell_tsc)
+            record_stage(&cpu_data->stats.wake, rdtsc64() - next->doorbell_tsc);
+
+        for (;;) {
+            U32 tail;
+
+            // Drain the ring without handing control back between commands
+            while ((tail = cpu_data->completed) != *(volatile U32 *)&cpu_data->dispatched) {
+                SMP_COMMAND *cmd = &cpu_data->ring[tail % SMP_RING_SIZE];
+                U32 *done = cmd->done;
+                U64 start;
+
+                start = rdtsc64();
+                record_stage(&cpu_data->stats.start, start - cmd->queued_tsc);
+
+                // Save results, modify flags, etc is done by the function
+                cmd->function(cmd->param);
+
+                cmd->done_tsc = rdtsc64();
+                record_stage(&cpu_data->stats.run, cmd->done_tsc - start);
+
+                set_control(&cpu_data->completed, tail + 1);
+
+                // A broadcast dispatch waits on a shared completion count instead
+                if (done)
+                    atomic_increment(done);
+            }
+
+            set_control(my_control, BSP_IN_CONTROL);
+
+            // The BSP does not ring the doorbell while we are awake, so look
+            // again for commands queued after the ring appeared empty.
+            memory_fence();
+            if (*(volatile U32 *)&cpu_data->dispatched == cpu_data->completed)
+                break;
+            set_control(my_control, AP_IN_CONTROL);
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+static U32 apicid_hash(SMP_HOST * host, U32 apicid)
+{
+    // Fibonacci hashing spreads the clustered x2APIC IDs across the table
+    return (apicid * 0x9E3779B1U) >> (32 - host->apicid_hash_bits);
+}
+
+void build_apicid_index(SMP_HOST * host)
+{
+    U32 i, slot;
+    U32 mask = (1U << host->apicid_hash_bits) - 1;
+
+    memset(host->apicid_index, 0, sizeof(U32) << host->apicid_hash_bits);
+    for (i = 0; i < host->logical_processor_count; i++) {
+        for (slot = apicid_hash(host, host->cpu[i].apicid); host->apicid_index[slot]; slot = (slot + 1) & mask)
+            ;
+        host->apicid_index[slot] = i + 1;
+    }
+}
+
+//-----------------------------------------------------------------------------
+U32 find_processor_id_for_this_apicid(U32 apicid, U32 * processor_id, SMP_HOST * host)
+{
+    U32 slot, entry;
+    U32 mask = (1U << host->apicid_hash_bits) - 1;
+
+    for (slot = apicid_hash(host, apicid); (entry = host->apicid_index[slot]) != 0; slot = (slot + 1) & mask)
+        if (host->cpu[entry - 1].apicid == apicid) {
+            *processor_id = entry - 1;
+            return 1;
+        }
+
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+U32 find_processor_id_for_this_cpu(U32 * processor_id, SMP_HOST * host)
+{
+    U32 apicid;
+
+    read_apicid(&apicid);
+
+    return find_processor_id_for_this_apicid(apicid, processor_id, host);
+}
+
+U32 smp_read_bclk_with_memory(void *working_memory)
+{
+    struct smp_host *host = working_memory;
+    if (!host || host->initialized != SMP_MAGIC)
+        return 0;
+    return host->bclk;
+}
+
+U64 smp_read_tsc_hz_with_memory(void *working_memory)
+{
+    struct smp_host *host = working_memory;
+    if (!host || host->initialized != SMP_MAGIC)
+        return 0;
+    return host->tsc_hz;
+}
+
+bool smp_read_startup_timing_with_memory(void *working_memory, SMP_STARTUP_TIMING *timing)
+{
+    struct smp_host *host = working_memory;
+    if (!host || host->initialized != SMP_MAGIC)
+        return false;
+    *timing = host->startup_timing;
+    return true;
+}
+
+const CPU_INFO *smp_read_cpu_list_with_memory(void *working_memory)
+{
+    struct smp_host *host = working_memory;
+    if (!host || host->initialized != SMP_MAGIC)
+        return NULL;
+    return host->cpu;
+}
+
+/* Wake an AP if it is asleep with commands waiting in its ring. */
+static void ring_doorbell(struct smp_host *host, U32 processor_id)
+{
+    CPU_DATA *cpu_data = &host->cpu_data[processor_id];
+    U32 *my_control = (U32 *) (host->control + processor_id * SMP_MWAIT_ALIGN);
+    U32 tail;
+
+    if (processor_id == 0)
+        return;
+
+    // Pairs with the fence in mp_worker: either the AP sees the new commands
+    // before it sleeps, or we see that it has handed control back.
+    memory_fence();
+    if (*(volatile U32 *)my_control == BSP_IN_CONTROL && (tail = *(volatile U32 *)&cpu_data->completed) != cpu_data->dispatched) {
+        // The AP is asleep, so it reads the stamp only after it wakes
+        cpu_data->ring[tail % SMP_RING_SIZE].doorbell_tsc = rdtsc64();
+        set_control(my_control, AP_IN_CONTROL);
+    }
+}
+
+/* Append function(param) to an AP's ring without waking it; if the ring is
+ * full, wake the AP and wait for a free slot. */
+static void queue_ap_function(struct smp_host *host, U32 processor_id, CALLBACK function, void *param, U32 *done)
+{
+    CPU_DATA *cpu_data = &host->cpu_data[processor_id];
+    U32 head = cpu_data->dispatched;
+    SMP_COMMAND *cmd;
+
+    if (head - *(volatile U32 *)&cpu_data->completed >= SMP_RING_SIZE) {
+        ring_doorbell(host, processor_id);
+        while (head - *(volatile U32 *)&cpu_data->completed >= SMP_RING_SIZE)
+            pause32();
+    }
+
+    cmd = &cpu_data->ring[head % SMP_RING_SIZE];
+    cmd->function = function;
+    cmd->param = param;
+    cmd->done = done;
+    cmd->doorbell_tsc = 0;
+    cmd->queued_tsc = rdtsc64();
+
+    // Publish the command only once it is complete
+    set_control(&cpu_data->dispatched, head + 1);
+}
+
+static bool lookup_processor_id(struct smp_host *host, U32 apicid, U32 *processor_id, const char *caller)
+{
+    if (!host || host->initialized != SMP_MAGIC) {
+        dprintf("smp", "%s failed because working memory not initialized\n", caller);
+        return false;
+    }
+
+    if (find_processor_id_for_this_apicid(apicid, processor_id, host) == 0) {
+        dprintf("smp", "%s failed because APIC ID %#x not found\n", caller, apicid);
+        return false;
+    }
+
+    return true;
+}
+
+U32 smp_function_with_memory(void *working_memory, U32 apicid, CALLBACK function, void *param)
+{
+    U32 processor_id;
+
+    if (!lookup_processor_id(working_memory, apicid, &processor_id, "smp_function"))
+        return 0;
+    return smp_function_by_index_with_memory(working_memory, processor_id, function, param);
+}
+
+U32 smp_function_by_index_with_memory(void *working_memory, U32 index, CALLBACK function, void *param)
+{
+    SMP_HANDLE handle;
+
+    struct smp_host *host = working_memory;
+    if (!host || host->initialized != SMP_MAGIC) {
+        dprintf("smp", "smp_function returning 0 because working memory not initialized\n");
+        return 0;
+    }
+
+    if (!function) {
+        dprintf("smp", "smp_function returning 0 because !function\n");
+        return 0;
+    }
+
+    if (index == 0) {
+        bsp_function(host, function, param);
+        return 1;
+    }
+
+    if (!smp_function_async_by_index_with_memory(working_memory, index, function, param, &handle)) {
+        dprintf("smp", "smp_function returning 0 because CPU index %u not found\n", index);
+        return 0;
+    }
+    smp_wait_with_memory(working_memory, &handle);
+
+    return 1;
+}
+
+U32 smp_function_mask_with_memory(void *working_memory, const U32 *mask, CALLBACK function, void *param)
+{
+    U32 i;
+    U32 ap_count = 0;
+    CPU_DATA *bsp_data;
+    struct smp_host *host = working_memory;
+    if (!host || host->initialized != SMP_MAGIC) {
+        dprintf("smp", "smp_function_mask returning 0 because working memory not initialized\n");
+        return 0;
+    }
+
+    if (!function) {
+        dprintf("smp", "smp_function_mask returning 0 because !function\n");
+        return 0;
+    }
+
+    set_control(host->completion, 0);
+
+    // Queue on every selected AP first so that the wake-ups go out back to back
+    for (i = 1; i < host->logical_processor_count; i++) {
+        if (mask && !SMP_MASK_TEST(mask, i))
+            continue;
+        queue_ap_function(host, i, function, param, host->completion);
+        ap_count++;
+    }
+    for (i = 1; i < host->logical_processor_count; i++)
+        if (!mask || SMP_MASK_TEST(mask, i))
+            ring_doorbell(host, i);
+
+    // The BSP does its share while the APs run
+    if (!mask || SMP_MASK_TEST(mask, 0))
+        bsp_function(host, function, param);
+
+    if (ap_count) {
+        bsp_data = &host->cpu_data[0];
+        wait_for_control(host, bsp_data, host->completion, ap_count, bsp_data->spin_ticks);
+    }
+
+    return ap_count + ((!mask || SMP_MASK_TEST(mask, 0)) ? 1 : 0);
+}
+
+U32 smp_function_all_with_memory(void *working_memory, CALLBACK function, void *param)
+{
+    return smp_function_mask_with_memory(working_memory, NULL, function, param);
+}
+
+bool smp_queue_with_memory(void *working_memory, U32 apicid, CALLBACK function, void *param, SMP_HANDLE *handle)
+{
+    U32 processor_id;
+
+    if (!lookup_processor_id(working_memory, apicid, &processor_id, "smp_queue"))
+        return false;
+    return smp_queue_by_index_with_memory(working_memory, processor_id, function, param, handle);
+}
+
+bool smp_queue_by_index_with_memory(void *working_memory, U32 index, CALLBACK function, void *param, SMP_HANDLE *handle)
+{
+    CPU_DATA *cpu_data;
+
+    struct smp_host *host = working_memory;
+    if (!host || host->initialized != SMP_MAGIC) {
+        dprintf("smp", "smp_queue returning false because working memory not initialized\n");
+        return false;
+    }
+
+    if (!function) {
+        dprintf("smp", "smp_queue returning false because !function\n");
+        return false;
+    }
+
+    if (index >= host->logical_processor_count) {
+        dprintf("smp", "smp_queue returning false because CPU index %u not found\n", index);
+        return false;
+    }
+
+    cpu_data = &host->cpu_data[index];
+
+    if (index == 0) {
+        // The BSP has nobody to hand the call to, so it completes right away
+        cpu_data->dispatched++;
+        bsp_function(host, function, param);
+        cpu_data->completed++;
+    } else
+        queue_ap_function(host, index, function, param, NULL);
+
+    if (handle) {
+        handle->processor_id = index;
+        handle->sequence = cpu_data->dispatched;
+    }
+    return true;
+}
+
+bool smp_doorbell_with_memory(void *working_memory, U32 apicid)
+{
+    U32 processor_id;
+
+    if (!lookup_processor_id(working_memory, apicid, &processor_id, "smp_doorbell"))
+        return false;
+    return smp_doorbell_by_index_with_memory(working_memory, processor_id);
+}
+
+bool smp_doorbell_by_index_with_memory(void *working_memory, U32 index)
+{
+    struct smp_host *host = working_memory;
+    if (!host || host->initialized != SMP_MAGIC || index >= host->logical_processor_count)
+        return false;
+
+    ring_doorbell(host, index);
+    return true;
+}
+
+bool smp_function_async_with_memory(void *working_memory, U32 apicid, CALLBACK function, void *param, SMP_HANDLE *handle)
+{
+    U32 processor_id;
+
+    if (!lookup_processor_id(working_memory, apicid, &processor_id, "smp_function_async"))
+        return false;
+    return smp_function_async_by_index_with_memory(working_memory, processor_id, function, param, handle);
+}
+
+bool smp_function_async_by_index_with_memory(void *working_memory, U32 index, CALLBACK function, void *param, SMP_HANDLE *handle)
+{
+    if (!smp_queue_by_index_with_memory(working_memory, index, function, param, handle))
+        return false;
+    ring_doorbell(working_memory, index);
+    return true;
+}
+
+bool smp_poll_with_memory(void *working_memory, const SMP_HANDLE *handle)
+{
+    U32 completed;
+
+    struct smp_host *host = working_memory;
+    if (!host || host->initialized != SMP_MAGIC || handle->processor_id >= host->logical_processor_count)
+        return false;
+
+    // Sequence numbers wrap, so compare the distance rather than the values
+    completed = *(volatile U32 *)&host->cpu_data[handle->processor_id].completed;
+    return completed - handle->sequence < 0x80000000U;
+}
+
+void smp_wait_with_memory(void *working_memory, const SMP_HANDLE *handle)
+{
+    CPU_DATA *bsp_data;
+    U32 *control;
+
+    struct smp_host *host = working_memory;
+    if (!host || host->initialized != SMP_MAGIC || handle->processor_id >= host->logical_processor_count)
+        return;
+
+    // The AP hands control back once its ring is empty, which covers this call
+    bsp_data = &host->cpu_data[0];
+    control = (U32 *) (host->control + handle->processor_id * SMP_MWAIT_ALIGN);
+    while (!smp_poll_with_memory(working_memory, handle)) {
+        ring_doorbell(host, handle->processor_id);
+        wait_for_control(host, bsp_data, control, BSP_IN_CONTROL, bsp_data->spin_ticks);
+        if (smp_poll_with_memory(working_memory, handle)) {
+            CPU_DATA *cpu_data = &host->cpu_data[handle->processor_id];
+            // Time from this call finishing, unless its slot has been reused
+            if (cpu_data->dispatched - handle->sequence < SMP_RING_SIZE)
+                record_stage(&cpu_data->stats.handback, rdtsc64() - *(volatile U64 *)&cpu_data->ring[(handle->sequence - 1) % SMP_RING_SIZE].done_tsc);
+        }
+    }
+}
+
+void *smp_arena_alloc_with_memory(void *working_memory, unsigned long size)
+{
+    U32 processor_id;
+    CPU_DATA *cpu_data;
+    void *p;
+
+    struct smp_host *host = working_memory;
+    if (!host || host->initialized != SMP_MAGIC)
+        return NULL;
+    if (find_processor_id_for_this_cpu(&processor_id, host) == 0)
+        return NULL;
+
+    // Only the owning CPU allocates from its arena, so no locking is needed
+    cpu_data = &host->cpu_data[processor_id];
+    // Check before aligning too, since aligning a huge size wraps it
+    if (size > host->arena_size - cpu_data->arena_used)
+        return NULL;
+    size = SMP_LAYOUT_ALIGN(size);
+    if (size > host->arena_size - cpu_data->arena_used)
+        return NULL;
+    p = cpu_data->arena + cpu_data->arena_used;
+    cpu_data->arena_used += size;
+    return p;
+}
+
+void smp_arena_reset_by_index_with_memory(void *working_memory, U32 index)
+{
+    struct smp_host *host = working_memory;
+    if (!host || host->initialized != SMP_MAGIC || index >= host->logical_processor_count)
+        return;
+    host->cpu_data[index].arena_used = 0;
+}
+
+bool smp_read_dispatch_stats_with_memory(void *working_memory, U32 index, SMP_DISPATCH_STATS *stats)
+{
+    struct smp_host *host = working_memory;
+    if (!host || host->initialized != SMP_MAGIC || index >= host->logical_processor_count)
+        return false;
+    *stats = host->cpu_data[index].stats;
+    return true;
+}
+
+void smp_reset_dispatch_stats_with_memory(void *working_memory)
+{
+    U32 i;
+
+    struct smp_host *host = working_memory;
+    if (!host || host->initialized != SMP_MAGIC)
+        return;
+    for (i = 0; i < host->logical_processor_count; i++)
+        memset(&host->cpu_data[i].stats, 0, sizeof(host->cpu_data[i].stats));
+}
+
+U32 smp_wait_any_with_memory(void *working_memory, const SMP_HANDLE *handles, U32 count)
+{
+    U32 i;
+
+    struct smp_host *host = working_memory;
+    if (!host || host->initialized != SMP_MAGIC || !count)
+        return count;
+
+    for (i = 0; i < count; i++) {
+        if (handles[i].processor_id >= host->logical_processor_count)
+            return count;
+        ring_doorbell(host, handles[i].processor_id);
+    }
+
+    // Several control words cannot share one MONITOR, so spin over them
+    for (;;) {
+        for (i = 0; i < count; i++)
+            if (smp_poll_with_memory(working_memory, &handles[i]))
+                return i;
+        pause32();
+    }
+}
+
+bool smp_read_cpu_index_with_memory(void *working_memory, U32 *index)
+{
+    struct smp_host *host = working_memory;
+    if (!host || host->initialized != SMP_MAGIC)
+        return false;
+    return find_processor_id_for_this_cpu(index, host) != 0;
+}
+
+bool smp_lookup_cpu_index_with_memory(void *working_memory, U32 apicid, U32 *index)
+{
+    struct smp_host *host = working_memory;
+    if (!host || host->initialized != SMP_MAGIC)
+        return false;
+    return find_processor_id_for_this_apicid(apicid, index, host) != 0;
+}
+
+/* Find how many low bits of the APIC ID select the thread within a core and
+ * the core within a socket. */
+static void topology_shifts(U32 *smt_shift, U32 *package_shift)
+{
+    U32 eax, ebx, ecx, edx, max_leaf, level;
+
+    *smt_shift = 0;
+    *package_shift = 0;
+
+    cpuid32(0, &max_leaf, &ebx, &ecx, &edx);
+    if (max_leaf >= 0xb) {
+        cpuid32_indexed(0xb, 0, &eax, &ebx, &ecx, &edx);
+        if (ebx) {
+            for (level = 0; ebx; cpuid32_indexed(0xb, ++level, &eax, &ebx, &ecx, &edx)) {
+                U32 type = (ecx >> 8) & 0xff;
+                if (type == 1) // SMT
+                    *smt_shift = eax & 0x1f;
+                else if (type == 2) // Core
+                    *package_shift = eax & 0x1f;
+            }
+            if (*package_shift < *smt_shift)
+                *package_shift = *smt_shift;
+            return;
+        }
+    }
+
+    // Without leaf 0xB, leaf 1 still gives the logical processors per package
+    cpuid32(1, &eax, &ebx, &ecx, &edx);
+    if (edx & (1 << 28)) {
+        U32 count = (ebx >> 16) & 0xff;
+        while ((1U << *package_shift) < count)
+            (*package_shift)++;
+    }
+}
+
+unsigned long smp_barrier_size_with_memory(void *working_memory)
+{
+    struct smp_host *host = working_memory;
+    if (!host || host->initialized != SMP_MAGIC)
+        return 0;
+    return barrier_memory_size(host->logical_processor_count);
+}
+
+SMP_BARRIER *smp_barrier_init_with_memory(void *working_memory, void *barrier_memory, const U32 *mask, U64 release_ticks)
+{
+    U32 smt_shift, package_shift;
+
+    struct smp_host *host = working_memory;
+    if (!host || host->initialized != SMP_MAGIC || !barrier_memory)
+        return NULL;
+
+    topology_shifts(&smt_shift, &package_shift);
+    return barrier_init(barrier_memory, host->logical_processor_count, host->cpu, smt_shift, package_shift, mask, release_ticks);
+}
+
+bool smp_barrier_wait_with_memory(void *working_memory, SMP_BARRIER *barrier)
+{
+    U32 index;
+
+    struct smp_host *host = working_memory;
+    if (!host || host->initialized != SMP_MAGIC || !barrier)
+        return false;
+    if (find_processor_id_for_this_cpu(&index, host) == 0)
+        return false;
+    barrier_wait(barrier, index);
+    return true;
+}
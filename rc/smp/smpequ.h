@@ -32,11 +32,13 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define SIZEOF_POINTER 4
 #endif
 
-#define  AP_STACK    0x1000
-#define  AP_DATA     (AP_STACK - 0x800)
-#define  BLOCK       (AP_DATA - 4)
-#define  ASLEEP      (BLOCK - 4)
+#define  AP_DATA     0x800
+#define  TICKET      (AP_DATA - 4)
+#define  ASLEEP      (TICKET - 4)
 #define  FUNCTIONPTR (ASLEEP - SIZEOF_POINTER)
 #define  PARAM       (FUNCTIONPTR - SIZEOF_POINTER)
 #define  PAGETABLE   (PARAM - 4)
-#define  AP_CODE_MAX PAGETABLE
+#define  STACKSTRIDE (PAGETABLE - 4)
+#define  STACKBASE   (STACKSTRIDE - SIZEOF_POINTER)
+#define  MAXTICKET   (STACKBASE - 4)
+#define  AP_CODE_MAX MAXTICKET
@@ -0,0 +1,164 @@
+/*
+Copyright (c) 2013, Intel Corporation
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of Intel Corporation nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* smpint.h describes the working memory shared by the dispatch engine in
+ * smpdispatch.c and the platform layer that brings the CPUs up: smprc.c on
+ * real hardware, or hosted/smphosted.c with pthreads standing in for APs. */
+
+#ifndef smpint_h
+#define smpint_h
+
+#include "datatype.h"
+#include "portable.h"
+#include "smprc.h"
+
+#define SMP_RING_SIZE 64 // must be a power of 2
+
+typedef struct smp_command {
+    CALLBACK function;
+    void *param;
+    U32 *done;
+    U64 queued_tsc;   // written by the BSP
+    U64 doorbell_tsc; // written by the BSP if this is the first command a doorbell wakes the AP for, else 0
+    U64 done_tsc;     // written by the AP
+} SMP_COMMAND;
+
+typedef struct cpu_data {
+    struct smp_host *host;
+    U32 processor_id;
+    U32 use_mwait;
+    U32 mwait_hint;
+    U32 int_break_event;
+    U32 spin_ticks;
+    U32 *sleep_control; // set while in smp_sleep, for the timer interrupt
+    U8 *arena;
+    unsigned long arena_used;
+    U32 status;
+    // Single-producer/single-consumer command ring.  The BSP only writes
+    // dispatched and the AP only writes completed; both count forever and
+    // double as the ring head and tail.
+    U32 dispatched;
+    U32 completed;
+    SMP_DISPATCH_STATS stats; // written by the AP, for the commands it runs
+    SMP_COMMAND ring[SMP_RING_SIZE];
+} CPU_DATA;
+
+struct gate {
+    U16 offset_15_0;
+    U16 selector;
+    U16 flags;
+    U16 offset_31_16;
+#ifdef GRUB_TARGET_CPU_X86_64
+    U32 offset_63_32;
+    U32 reserved;
+#endif
+};
+
+
+typedef struct idtr {
+    U16 limit;
+    struct gate *base;
+} attr_packed IDTR;
+
+typedef struct exception_info {
+    U16 gpf_idtr_installed;
+    IDTR idt_descriptor;
+    struct gate idt_table[0x40];
+} EXCEPTION_INFO;
+
+#define SMP_MAGIC 0x69534D50
+#define SMP_STARTING 0x53534D50
+
+typedef struct smp_host {
+    U32 initialized;
+    void *mem_region_below_1M;
+    U32 logical_processor_count;
+    U32 expected_processor_count;
+    U32 max_processor_count;
+    U32 apicid_hash_bits;
+    U32 stack_size;
+    U32 arena_size;
+    SMP_STARTUP_TIMING startup_timing;
+    U64 sipi_done;
+    bool aps_started;
+    U32 bclk;
+    U32 apic_timer_hz;
+    U64 tsc_hz;
+    EXCEPTION_INFO bsp_exception_info;
+    EXCEPTION_INFO ap_exception_info;
+    asmlinkage U32 (*wait_for_control)(U32 *, U32, U32, U32, U32, U32);
+    U8 *control;
+    U32 *completion;
+    U8 completion_region[2 * SMP_MWAIT_ALIGN];
+    // The per-CPU arrays follow this structure in working memory, sized for
+    // max_processor_count CPUs; see smp_layout.
+    CPU_INFO *cpu;
+    // Open-addressed APIC ID lookup; each entry holds processor_id + 1, or 0 if empty
+    U32 *apicid_index;
+    CPU_DATA *cpu_data;
+    U8 *control_region;
+    U8 *stacks;
+    U8 *arenas;
+} SMP_HOST;
+
+/* Offsets of the per-CPU arrays within working memory. */
+struct smp_layout {
+    unsigned long cpu;
+    unsigned long apicid_index;
+    unsigned long cpu_data;
+    unsigned long control_region;
+    unsigned long stacks;
+    unsigned long arenas;
+    unsigned long size;
+    U32 apicid_hash_bits;
+    U32 stack_size;
+    U32 arena_size;
+};
+
+#define SMP_LAYOUT_ALIGN(x) (((x) + SMP_WORKING_MEMORY_ALIGN - 1) & ~(unsigned long)(SMP_WORKING_MEMORY_ALIGN - 1))
+/* Provided by smpdispatch.c */
+void smp_layout(U32 max_cpus, U32 stack_size, U32 arena_size, struct smp_layout *layout);
+void init_working_memory(SMP_HOST * host, U32 max_cpus, U32 stack_size, U32 arena_size, void *reserved_mwait_memory);
+void build_apicid_index(SMP_HOST * host);
+U32 find_processor_id_for_this_apicid(U32 apicid, U32 * processor_id, SMP_HOST * host);
+U32 find_processor_id_for_this_cpu(U32 * processor_id, SMP_HOST * host);
+bool wait_for_control(SMP_HOST *host, CPU_DATA *cpu_data, U32 *control, U32 value, U32 spin_ticks);
+asmlinkage void mp_worker(void *param) attr_noreturn;
+
+/* Provided by the platform layer */
+void read_apicid(void *param);
+void bsp_function(SMP_HOST *host, CALLBACK function, void *param);
+bool mwait_supported(void);
+bool int_break_event_supported(void);
+
+static inline void pause32(void)
+{
+    __asm__ __volatile__ ("pause");
+}
+
+#endif /* smpint_h */
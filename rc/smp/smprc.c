@@ -34,11 +34,10 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "smprc.h"
 #include "smpasm.h"
 #include "smpequ.h"
+#include "smpint.h"
 
 #include "acpica.h"
 
-#define MAX_STACK_SIZE 512
-
 // Memory-mapped APIC Offsets
 #define APIC_LOCAL_APIC_ID 0x020
 #define APIC_EOI 0xB0
@@ -59,66 +58,14 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define MSR_APIC_TMR_INITIAL_CNT 0x838
 #define MSR_APIC_TMR_CURRENT_CNT 0x839
 #define MSR_APIC_TMR_DIVIDE_CFG 0x83E
+#define MSR_IA32_TSC_DEADLINE 0x6E0
 
-typedef struct cpu_data {
-    U32 stack[MAX_STACK_SIZE];
-    U32 use_mwait;
-    U32 mwait_hint;
-    U32 int_break_event;
-    U32 status;
-    CALLBACK function;
-    void *param;
-} CPU_DATA;
-
-struct gate {
-    U16 offset_15_0;
-    U16 selector;
-    U16 flags;
-    U16 offset_31_16;
-#ifdef GRUB_TARGET_CPU_X86_64
-    U32 offset_63_32;
-    U32 reserved;
-#endif
-};
+#define APIC_TMR_TSC_DEADLINE_MODE (2 << 17)
 
 static const struct gate EMPTY_GATE;
 
-typedef struct idtr {
-    U16 limit;
-    struct gate *base;
-} attr_packed IDTR;
-
-typedef struct exception_info {
-    U16 gpf_idtr_installed;
-    IDTR idt_descriptor;
-    struct gate idt_table[0x40];
-} EXCEPTION_INFO;
-
-#define SMP_MAGIC 0x69534D50
-
-typedef struct smp_host {
-    U32 initialized;
-    void *mem_region_below_1M;
-    U32 logical_processor_count;
-    U32 expected_processor_count;
-    U32 bclk;
-    EXCEPTION_INFO bsp_exception_info;
-    EXCEPTION_INFO ap_exception_info;
-    asmlinkage void (*wait_for_control)(U32 *, U32, U32, U32, U32);
-    U8 *control;
-    CPU_INFO cpu[SMP_MAX_LOGICAL_CPU];
-    CPU_DATA cpu_data[SMP_MAX_LOGICAL_CPU];
-    U8 control_region[SMP_MWAIT_ALIGN * SMP_MAX_LOGICAL_CPU + SMP_MWAIT_ALIGN];
-} SMP_HOST;
-
-static void read_apicid(void *param);
-static asmlinkage void find_logical_processors(void *param) attr_noreturn;
-static asmlinkage void mp_worker(void *param) attr_noreturn;
-static void prepare_mp_worker(void *param) attr_noreturn;
-static void ap_park(void *param);
-
-static U32 find_processor_id_for_this_cpu(U32 * processor_id, SMP_HOST * host);
-static U32 find_processor_id_for_this_apicid(U32 apicid, U32 * processor_id, SMP_HOST * host);
+static asmlinkage void find_logical_processors(void *param, U32 processor_id) attr_noreturn;
+static void prepare_mp_worker(SMP_HOST * host, U32 processor_id) attr_noreturn;
 
 static const IDTR real_mode_idtr = { .limit = 0x3ff, .base = 0 };
 
@@ -131,15 +78,18 @@ static U64 get_cr3(void)
 }
 #endif
 
-static void InitSipiCode(void *output_address, void *function, void *param)
+static void InitSipiCode(void *output_address, AP_ENTRY function, void *param, void *stack_base, U32 stack_stride, U32 max_ticket)
 {
     // Move SIPI code below 1M
     memcpy(output_address, pm32, pm32_size);
 
     *(volatile void **)((char *)output_address + FUNCTIONPTR) = function;
     *(volatile void **)((char *)output_address + PARAM) = param;
-    *(volatile U32 *)((char *)output_address + BLOCK) = 0;
+    *(volatile U32 *)((char *)output_address + TICKET) = 1; // The BSP is processor 0
     *(volatile U32 *)((char *)output_address + ASLEEP) = 0;
+    *(volatile void **)((char *)output_address + STACKBASE) = stack_base;
+    *(volatile U32 *)((char *)output_address + STACKSTRIDE) = stack_stride;
+    *(volatile U32 *)((char *)output_address + MAXTICKET) = max_ticket;
 #ifdef GRUB_TARGET_CPU_X86_64
     *(volatile U32 *)((char *)output_address + PAGETABLE) = (U32)get_cr3();
 #endif
@@ -278,17 +228,6 @@ void wrmsr64(U32 msr, U64 data, U32 * status)
     wrmsr32(msr, (U32) data, (U32) (data >> 32), status);
 }
 
-static void drop_ap_lock(void *output_addr)
-{
-    __asm__ __volatile__ (
-        "lock incl %[asleep]\n"
-        "xorl %%eax, %%eax\n"
-        "xchgl %%eax, %[block]\n"
-        : [asleep] "=m" (*(U32 *)((unsigned long)output_addr + ASLEEP)),
-          [block]  "=m" (*(U32 *)((unsigned long)output_addr + BLOCK))
-        : : "eax", "memory", "cc");
-}
-
 static U32 x2apic_enabled(void)
 {
     U64 temp64;
@@ -354,10 +293,22 @@ static void send_apic_eoi(void)
         *(volatile U32 *)(unsigned long)(get_apicbase() + APIC_EOI) = 0;
 }
 
-static void setup_apic(bool mask, U8 vector)
+// Set APIC Timer Divide Value as 2, which start_apic_timer and the PIT
+// calibration assume, rather than relying on what firmware left there.
+static void set_apic_timer_divide(void)
 {
     U32 status;
-    U32 lvt = (mask ? 1 << 16 : 0) | vector;
+    if (x2apic_enabled())
+        wrmsr32(MSR_APIC_TMR_DIVIDE_CFG, 0, 0, &status);
+    else
+        *(volatile U32 *)(unsigned long)(get_apicbase() + APIC_TMR_DIVIDE_CFG) = 0UL;
+}
+
+static void setup_apic(bool mask, bool tsc_deadline, U8 vector)
+{
+    U32 status;
+    U32 lvt = (mask ? 1 << 16 : 0) | (tsc_deadline ? APIC_TMR_TSC_DEADLINE_MODE : 0) | vector;
+    set_apic_timer_divide();
     if (x2apic_enabled())
         wrmsr32(MSR_APIC_TMR_LVT, lvt, 0, &status);
     else
@@ -386,13 +337,12 @@ static bool mask_lint0(bool mask)
 //-----------------------------------------------------------------------------
 static void start_apic_timer(struct smp_host *host, U32 timeout_in_usecs)
 {
-    // APIC Timer runs at bclk MHz and by default decrements
+    // APIC Timer runs at apic_timer_hz and by default decrements
     // the current count register at once per two clocks.
-    // t = time in milliseconds
+    // t = time in microseconds
     // c = APIC Timer Initial Value
-    // c = (t * 10^(-6) sec) * (bclk * 10^6 count/sec) * (1/2 clocks)
-    // Notice seconds and exponents cancel out leaving count value
-    // c = (t * bclk / 2)
+    // c = (t * 10^(-6) sec) * (apic_timer_hz count/sec) * (1/2 clocks)
+    // c = (t * apic_timer_hz / (2 * 10^6))
 
     // Prepare to use APIC Timer
     // 1. Get APIC memory base address
@@ -401,11 +351,12 @@ static void start_apic_timer(struct smp_host *host, U32 timeout_in_usecs)
     //    as the time in usecs * APIC timer rate / 2
 
     U32 status;
+    U32 count = (U32) grub_divmod64((U64)timeout_in_usecs * host->apic_timer_hz, 2 * 1000000, NULL);
 
     if (x2apic_enabled())
-        wrmsr32(MSR_APIC_TMR_INITIAL_CNT, (U32) (timeout_in_usecs * host->bclk / 2), 0, &status);
+        wrmsr32(MSR_APIC_TMR_INITIAL_CNT, count, 0, &status);
     else
-        *(volatile U32 *)(unsigned long)(get_apicbase() + APIC_TMR_INITIAL_CNT) = timeout_in_usecs * host->bclk / 2;
+        *(volatile U32 *)(unsigned long)(get_apicbase() + APIC_TMR_INITIAL_CNT) = count;
 
     return;
 }
@@ -421,7 +372,27 @@ static U32 get_apic_timer(void)
         return (*(volatile U32 *)(unsigned long)(get_apicbase() + APIC_TMR_CURRENT_CNT));
 }
 
-static void send_broadcast_init(struct smp_host *host)
+/* INIT-SIPI-SIPI delays from the MP specification are only needed by old
+ * processors; like Linux, skip them on Intel family 6 and later and on AMD
+ * family 0Fh and later. */
+static bool fast_startup_supported(void)
+{
+    U32 eax, vendor, dummy, family;
+
+    cpuid32(0, &dummy, &vendor, &dummy, &dummy);
+    cpuid32(1, &eax, &dummy, &dummy, &dummy);
+    family = (eax >> 8) & 0xf;
+    if (family == 0xf)
+        family += (eax >> 20) & 0xff;
+
+    if (vendor == 0x756e6547) // "Genu"ineIntel
+        return family >= 6;
+    if (vendor == 0x68747541) // "Auth"enticAMD
+        return family >= 0xf;
+    return false;
+}
+
+static void send_broadcast_init(struct smp_host *host, bool fast)
 {
     U32 temp32;
     U32 saved_cnt;
@@ -464,6 +435,9 @@ static void send_broadcast_init(struct smp_host *host)
         } while ((get_apic_ICRLow() & (1 << 12)) && current_cnt && (current_cnt <= saved_cnt));
     }
 
+    if (fast)
+        return;
+
     // wait for 10ms for INIT processing to complete
     //start timer 10ms
     start_apic_timer(host, 10000);
@@ -475,7 +449,7 @@ static void send_broadcast_init(struct smp_host *host)
     return;
 }
 
-static void send_broadcast_sipi(struct smp_host *host, void *addr)
+static void send_broadcast_sipi(struct smp_host *host, void *addr, bool fast)
 {
     U32 temp32;
     U32 saved_cnt;
@@ -500,8 +474,8 @@ static void send_broadcast_sipi(struct smp_host *host, void *addr)
     }
 
     // While timeout not expired
-    // start timer 20us
-    start_apic_timer(host, 20);
+    // start timer 20us, or 10us on processors that accept SIPIs quickly
+    start_apic_timer(host, fast ? 10 : 20);
     saved_cnt = get_apic_timer();
     do  {
         current_cnt = get_apic_timer();
@@ -535,38 +509,63 @@ static U32 apic_enabled(void)
     return (U32) (temp64 & (1 << 11)) ? 1 : 0;
 }
 
-static inline void pause32(void)
-{
-    __asm__ __volatile__ ("pause");
-}
-
 //-----------------------------------------------------------------------------
-static U32 do_callback(struct smp_host *host, ASM_CALLBACK function, void *param)
+/* Wake the APs and return without waiting for them; wait_for_aps joins them. */
+static void start_aps(struct smp_host *host, AP_ENTRY function, void *param)
 {
     char *addr;
     U32 thread_count = host->expected_processor_count;
+    bool fast;
+    U64 start, init_done;
+
+    host->aps_started = false;
 
     if (!apic_enabled()) {
-        dprintf("smp", "APIC is not enabled, returning 1 as status\n");
-        return 1;
+        dprintf("smp", "APIC is not enabled, not starting APs\n");
+        return;
     }
 
     addr = host->mem_region_below_1M;
 
     if (thread_count == 1)
-        return 1;
+        return;
 
-    InitSipiCode(addr, function, param);
-    send_broadcast_init(host);
-    send_broadcast_sipi(host, addr);
+    // Each AP starts directly on its own stack
+    InitSipiCode(addr, function, param, host->stacks + host->stack_size, host->stack_size, thread_count);
+
+    fast = fast_startup_supported();
+    start = rdtsc64();
+    send_broadcast_init(host, fast);
+    init_done = rdtsc64();
+    send_broadcast_sipi(host, addr, fast);
+    host->sipi_done = rdtsc64();
+
+    host->startup_timing.init_ticks = init_done - start;
+    host->startup_timing.sipi_ticks = host->sipi_done - init_done;
+    host->aps_started = true;
+    dprintf("smp", "AP startup (%s timing) in TSC ticks: INIT %llu, SIPI %llu\n",
+            fast ? "fast" : "MP spec",
+            (unsigned long long)host->startup_timing.init_ticks,
+            (unsigned long long)host->startup_timing.sipi_ticks);
+}
 
-    thread_count--; // We already have the BSP
+static void wait_for_aps(struct smp_host *host)
+{
+    char *addr = host->mem_region_below_1M;
+    U32 thread_count = host->expected_processor_count - 1; // We already have the BSP
+
+    if (!host->aps_started)
+        return;
 
     // We already know how many processors we have, so wait for that many to check in.
     while (*(volatile U32 *)(addr + ASLEEP) != thread_count)
         pause32();
 
-    return (1);
+    host->logical_processor_count = thread_count + 1;
+
+    // Includes whatever the BSP did between smp_start and smp_init
+    host->startup_timing.checkin_ticks = rdtsc64() - host->sipi_done;
+    dprintf("smp", "APs checked in after %llu TSC ticks\n", (unsigned long long)host->startup_timing.checkin_ticks);
 }
 
 //-----------------------------------------------------------------------------
@@ -632,26 +631,21 @@ static void init_ap_exception_handling(struct smp_host *host)
 }
 
 //-----------------------------------------------------------------------------
-asmlinkage void find_logical_processors(void *param)
+asmlinkage void find_logical_processors(void *param, U32 processor_id)
 {
     SMP_HOST *host = param;
-    U32 processor_id = 0;
 
     init_ap_exception_handling(host);
 
-    if (host->logical_processor_count == host->expected_processor_count)
-        while (1) {
-        }
-
-    processor_id = host->logical_processor_count++;
+    // ApStart hands out processor IDs below expected_processor_count
     read_apicid(&host->cpu[processor_id].apicid);
 
     host->cpu[processor_id].present = 1;
 
-    prepare_mp_worker(param);
+    prepare_mp_worker(host, processor_id);
 }
 
-static bool mwait_supported(void)
+bool mwait_supported(void)
 {
     U32 eax, ecx, dummy;
     cpuid32(0, &eax, &dummy, &dummy, &dummy);
@@ -663,7 +657,7 @@ static bool mwait_supported(void)
     return true;
 }
 
-static bool int_break_event_supported(void)
+bool int_break_event_supported(void)
 {
     U32 ecx, dummy;
     if (!mwait_supported())
@@ -672,128 +666,22 @@ static bool int_break_event_supported(void)
     return ecx & (1 << 1) ? true : false;
 }
 
-bool smp_get_mwait_with_memory(void *working_memory, U32 apicid, bool *use_mwait, U32 *mwait_hint, U32 *int_break_event)
-{
-    U32 processor_id;
-    CPU_DATA *cpu_data;
-
-    struct smp_host *host = working_memory;
-    if (!host || host->initialized != SMP_MAGIC)
-        return false;
-
-    if (find_processor_id_for_this_apicid(apicid, &processor_id, host) == 0)
-        return false;
-
-    cpu_data = &host->cpu_data[processor_id];
-
-    *use_mwait = cpu_data->use_mwait;
-    *mwait_hint = cpu_data->mwait_hint;
-    *int_break_event = cpu_data->int_break_event;
-
-    return true;
-}
-
-void smp_set_mwait_with_memory(void *working_memory, U32 apicid, bool use_mwait, U32 mwait_hint, U32 int_break_event)
-{
-    U32 processor_id;
-    CPU_DATA *cpu_data;
-
-    struct smp_host *host = working_memory;
-    if (!host || host->initialized != SMP_MAGIC)
-        return;
-
-    if (find_processor_id_for_this_apicid(apicid, &processor_id, host) == 0)
-        return;
-
-    cpu_data = &host->cpu_data[processor_id];
-
-    cpu_data->use_mwait = use_mwait;
-    cpu_data->mwait_hint = mwait_hint;
-    cpu_data->int_break_event = int_break_event;
-}
-
 //-----------------------------------------------------------------------------
-asmlinkage void mp_worker(void *param)
+void prepare_mp_worker(SMP_HOST * host, U32 processor_id)
 {
-    SMP_HOST *host = param;
-    U32 processor_id = 0;
-    U32 *my_control;
-    CPU_DATA *cpu_data;
-
-    drop_ap_lock(host->mem_region_below_1M);
-
-    if (find_processor_id_for_this_cpu(&processor_id, host) == 0)
-        for (;;)
-            pause32();
-
-    cpu_data = &host->cpu_data[processor_id];
-    my_control = (U32 *) (host->control + processor_id * SMP_MWAIT_ALIGN);
-
-    for (;;) {
-        /* Detect the ability to use mwait every time, just in case the function does something to disable it. */
-        host->wait_for_control(my_control, AP_IN_CONTROL,
-                               cpu_data->use_mwait && mwait_supported(), cpu_data->mwait_hint,
-                               cpu_data->int_break_event && int_break_event_supported());
-
-        // Do assigned function
-        cpu_data->function(cpu_data->param);
-
-        // Save results, modify flags, etc is done by the function
-
-        set_control(my_control, BSP_IN_CONTROL);
-    }
-}
-
-//-----------------------------------------------------------------------------
-void prepare_mp_worker(void *param)
-{
-    SMP_HOST *host = param;
-    U32 processor_id = 0;
     CPU_DATA *cpu_data;
     void *stack_top;
 
-    if (find_processor_id_for_this_cpu(&processor_id, host) == 0)
-        for (;;)
-            pause32();
-
     cpu_data = &host->cpu_data[processor_id];
 
+    cpu_data->host = host;
+    cpu_data->processor_id = processor_id;
     cpu_data->status = 1;
 
     // Switch stacks
-    stack_top = &host->cpu_data[processor_id].stack[MAX_STACK_SIZE];
-
-    switch_stack_and_call(mp_worker, param, stack_top);
-}
-
-//-----------------------------------------------------------------------------
-U32 find_processor_id_for_this_apicid(U32 apicid, U32 * processor_id, SMP_HOST * host)
-{
-    U32 i;
-
-    for (i = 0; i < host->logical_processor_count; i++)
-        if (host->cpu[i].apicid == apicid) {
-            *processor_id = i;
-            return 1;
-        }
-
-    return 0;
-}
-
-//-----------------------------------------------------------------------------
-U32 find_processor_id_for_this_cpu(U32 * processor_id, SMP_HOST * host)
-{
-    U32 apicid;
+    stack_top = host->stacks + (processor_id + 1) * host->stack_size;
 
-    read_apicid(&apicid);
-
-    return find_processor_id_for_this_apicid(apicid, processor_id, host);
-}
-
-//-----------------------------------------------------------------------------
-void ap_park(void *param)
-{
-    (void)param;
+    switch_stack_and_call(mp_worker, cpu_data, stack_top);
 }
 
 static U32 process_madt(struct acpi_table_madt *madt)
@@ -834,51 +722,47 @@ static U32 process_madt(struct acpi_table_madt *madt)
     return count;
 }
 
-static U32 madt_processor_count(void)
+U32 smp_madt_processor_count(void)
 {
     grub_err_t err;
     struct acpi_table_madt *madt;
 
     err = acpica_early_init();
     if (err != GRUB_ERR_NONE)
-        return err;
+        return 0;
 
     if (AcpiGetTable((char *)"APIC", 1, (ACPI_TABLE_HEADER **)&madt) != AE_OK)
-        return GRUB_ERR_IO;
+        return 0;
 
     return process_madt(madt);
 }
 
-static U32 compute_bclk(void)
-{
-    U32 status, dummy;
-    U32 start, stop;
-    U8 temp8;
-    U16 delay_count;
-    U32 bclk;
-
-#define DELAY_IN_US 1000
-
-    // Compute fixed delay as time
-    // delay count = desired time * PIT frequency
-    // PIT frequency = 1.193182 MHz
-    delay_count = 1193182 / DELAY_IN_US;
+#define PIT_HZ 1193182
 
-    // PIT channel 2 gate is controlled by IO port 0x61, bit 0
+// PIT channel 2 gate is controlled by IO port 0x61, bit 0
 #define PIT_CH2_LATCH_REG 0x61
 #define CH2_SPEAKER (1 << 1) // bit 1 -- 1 = speaker enabled 0 = speaker disabled
 #define CH2_GATE_IN (1 << 0) // bit 0 -- 1 = gate enabled, 0 = gate disabled
 #define CH2_GATE_OUT (1 << 5) // bit 5 -- 1 = gate latched, 0 = gate not latched
 
-    // PIT Command register
+// PIT Command register
 #define PIT_MODE_COMMAND_REG 0x43
 #define SELECT_CH2 (2 << 6)
 #define ACCESS_MODE_LOBYTE_HIBYTE (3 << 4)
 #define MODE0_INTERRUPT_ON_TERMINAL_COUNT 0 // Despite name, no interrupts on CH2
 
-    // PIT Channel 2 data port
+// PIT Channel 2 data port
 #define PIT_CH2_DATA 0x42
 
+// Run PIT channel 2 for delay_count PIT ticks, and count the TSC ticks and
+// APIC timer ticks (at divide by 2) that elapse meanwhile.
+static void pit_sample(U16 delay_count, U32 *tsc_ticks, U32 *apic_ticks)
+{
+    U32 status, dummy;
+    U32 start, stop;
+    U64 tsc_start, tsc_stop;
+    U8 temp8;
+
     // Disable the PIT channel 2 speaker and gate
     temp8 = input_u8(PIT_CH2_LATCH_REG);
     temp8 &= ~(CH2_SPEAKER | CH2_GATE_IN);
@@ -896,28 +780,25 @@ static U32 compute_bclk(void)
     temp8 &= ~CH2_SPEAKER;
     temp8 |= CH2_GATE_IN;
 
+    set_apic_timer_divide();
     if (x2apic_enabled()) {
-        // Set APIC Timer Divide Value as 2
-        wrmsr32(MSR_APIC_TMR_DIVIDE_CFG, 0, 0, &status);
-
         // start APIC timer with a known value
         start = ~0U;
         wrmsr32(MSR_APIC_TMR_INITIAL_CNT, start, 0, &status);
     }
     else {
-        // Set APIC Timer Divide Value as 2
-        *(volatile U32 *)(unsigned long)(get_apicbase() + APIC_TMR_DIVIDE_CFG) = 0UL;
-
         // start APIC timer with a known value
         start = ~0U;
         *(volatile U32 *)(unsigned long)(get_apicbase() + APIC_TMR_INITIAL_CNT) = start;
     }
 
     // Actually start the PIT channel 2
+    tsc_start = rdtsc64();
     output_u8(PIT_CH2_LATCH_REG, temp8);
 
     // Wait for the fixed delay
     while (!(input_u8(PIT_CH2_LATCH_REG) & CH2_GATE_OUT));
+    tsc_stop = rdtsc64();
 
     if (x2apic_enabled()) {
         // read the APIC timer to determine the change that occurred over this fixed delay
@@ -939,169 +820,190 @@ static U32 compute_bclk(void)
     temp8 &= ~(CH2_SPEAKER | CH2_GATE_IN);
     output_u8(PIT_CH2_LATCH_REG, temp8);
 
-    bclk = (start - stop) * 2 / DELAY_IN_US;
+    *tsc_ticks = (U32) (tsc_stop - tsc_start);
+    *apic_ticks = start - stop;
+}
 
-    // Round bclk to the nearest 100/12 integer value
-    bclk = ((((bclk * 24) + 100) / 200) * 200) / 24;
-    dprintf("smp", "Compute bclk: %uMHz\n", bclk);
-    return bclk;
+// Fit the TSC and APIC timer rates against the PIT.  Each sample includes a
+// fixed overhead for starting and polling the PIT, which cancels out in the
+// difference between a short and a long delay; the minimum over several
+// samples discards ones stretched by an SMI.
+static void pit_calibrate(U64 *tsc_hz, U32 *apic_timer_hz)
+{
+#define CALIBRATION_SAMPLES 3
+#define SHORT_DELAY_IN_MS 1
+#define LONG_DELAY_IN_MS 5
+    U32 i, tsc_ticks, apic_ticks;
+    U32 short_tsc = ~0U, short_apic = ~0U, long_tsc = ~0U, long_apic = ~0U;
+
+    for (i = 0; i < CALIBRATION_SAMPLES; i++) {
+        pit_sample(PIT_HZ * SHORT_DELAY_IN_MS / 1000, &tsc_ticks, &apic_ticks);
+        if (tsc_ticks < short_tsc)
+            short_tsc = tsc_ticks;
+        if (apic_ticks < short_apic)
+            short_apic = apic_ticks;
+        pit_sample(PIT_HZ * LONG_DELAY_IN_MS / 1000, &tsc_ticks, &apic_ticks);
+        if (tsc_ticks < long_tsc)
+            long_tsc = tsc_ticks;
+        if (apic_ticks < long_apic)
+            long_apic = apic_ticks;
+    }
+
+    *tsc_hz = (U64) ((long_tsc - short_tsc) / (LONG_DELAY_IN_MS - SHORT_DELAY_IN_MS)) * 1000;
+    // The APIC timer counts once per two clocks
+    *apic_timer_hz = (long_apic - short_apic) / (LONG_DELAY_IN_MS - SHORT_DELAY_IN_MS) * 2 * 1000;
 }
 
-U32 smp_init_with_memory(void *working_memory, void *page_below_1M, void *reserved_mwait_memory)
+// Determine the TSC frequency, the APIC timer frequency, and bclk once, from
+// CPUID leaves 0x15 and 0x16 where they enumerate them, and otherwise from the PIT.
+static void calibrate_timebase(struct smp_host *host)
+{
+    U32 max_leaf, eax, ebx, ecx, edx;
+    U32 ratio_denominator = 0, ratio_numerator = 0, crystal_hz = 0;
+    U64 pit_tsc_hz;
+    U32 pit_apic_timer_hz;
+
+    host->tsc_hz = 0;
+    host->apic_timer_hz = 0;
+    host->bclk = 0;
+
+    // The BSP times the INIT/SIPI delays with the APIC timer even when CPUID
+    // supplies every rate and the PIT calibration below does not run
+    set_apic_timer_divide();
+
+    cpuid32(0, &max_leaf, &ebx, &ecx, &edx);
+    if (max_leaf >= 0x15)
+        cpuid32(0x15, &ratio_denominator, &ratio_numerator, &crystal_hz, &edx);
+    if (max_leaf >= 0x16) {
+        // Base and bus frequencies in MHz
+        cpuid32(0x16, &eax, &ebx, &ecx, &edx);
+        // Parts that enumerate the TSC/crystal ratio but not the crystal run
+        // the TSC at the base frequency, which gives the crystal.  Elsewhere
+        // the base frequency says nothing about the TSC.
+        if (!crystal_hz && ratio_denominator && ratio_numerator)
+            crystal_hz = grub_divmod64((U64)(eax & 0xffff) * 1000000 * ratio_denominator, ratio_numerator, NULL);
+        host->bclk = ecx & 0xffff;
+    }
+    // TSC frequency = crystal frequency * ebx / eax.  The APIC timer runs at
+    // the crystal frequency when the crystal frequency is known.
+    if (crystal_hz && ratio_denominator && ratio_numerator)
+        host->tsc_hz = grub_divmod64((U64)crystal_hz * ratio_numerator, ratio_denominator, NULL);
+    host->apic_timer_hz = crystal_hz;
+
+    if (!host->tsc_hz || !host->apic_timer_hz || !host->bclk) {
+        pit_calibrate(&pit_tsc_hz, &pit_apic_timer_hz);
+        if (!host->tsc_hz)
+            host->tsc_hz = pit_tsc_hz;
+        if (!host->apic_timer_hz)
+            host->apic_timer_hz = pit_apic_timer_hz;
+        if (!host->bclk) {
+            // Round bclk to the nearest 100/12 integer value
+            host->bclk = pit_apic_timer_hz / 1000000;
+            host->bclk = ((((host->bclk * 24) + 100) / 200) * 200) / 24;
+        }
+    }
+
+    dprintf("smp", "Timebase: TSC %lluHz, APIC timer %uHz, bclk %uMHz\n",
+            (unsigned long long)host->tsc_hz, host->apic_timer_hz, host->bclk);
+}
+
+U32 smp_init_with_memory(void *working_memory, U32 max_cpus, U32 stack_size, U32 arena_size, void *page_below_1M, void *reserved_mwait_memory)
+{
+    struct smp_host *host = working_memory;
+
+    if (host->initialized == SMP_MAGIC)
+        return host->logical_processor_count;
+
+    if (host->initialized != SMP_STARTING && !smp_start_with_memory(working_memory, max_cpus, stack_size, arena_size, page_below_1M, reserved_mwait_memory))
+        return 0;
+
+    wait_for_aps(host);
+    build_apicid_index(host);
+    host->initialized = SMP_MAGIC;
+    return host->logical_processor_count;
+}
+
+bool smp_start_with_memory(void *working_memory, U32 max_cpus, U32 stack_size, U32 arena_size, void *page_below_1M, void *reserved_mwait_memory)
 {
     struct smp_host *host = working_memory;
 
     /* Sanity checks on the amounts of memory our public interface claims we
        can work within. */
-    if (sizeof(struct smp_host) > SMP_WORKING_MEMORY_SIZE) {
-        dprintf("smp", "Internal error: SMP_WORKING_MEMORY_SIZE too small; need %u\n", sizeof(struct smp_host));
-        return 0;
-    }
-    if (SMP_RESERVED_MEMORY_SIZE < SMP_MAX_LOGICAL_CPU * SMP_MWAIT_ALIGN + wait_for_control_asm_size) {
-        dprintf("smp", "Internal error: SMP_RESERVED_MEMORY_SIZE too small; need %u\n", SMP_MAX_LOGICAL_CPU * SMP_MWAIT_ALIGN + wait_for_control_asm_size);
-        return 0;
+    if (wait_for_control_asm_size > SMP_RESERVED_CODE_SIZE) {
+        dprintf("smp", "Internal error: SMP_RESERVED_CODE_SIZE too small; need %u\n", wait_for_control_asm_size);
+        return false;
     }
     if (pm32_size > AP_CODE_MAX) {
         dprintf("smp", "Internal error: relocatable SIPI target code too large: %u > %u\n", pm32_size, AP_CODE_MAX);
-        return 0;
+        return false;
     }
 #ifdef GRUB_TARGET_CPU_X86_64
     if (get_cr3() > ~0U) {
         dprintf("smp", "Internal error: 64-bit page table above 4GB: %p\n", get_cr3());
-        return 0;
+        return false;
     }
 #endif
 
-    if (host->initialized == SMP_MAGIC)
-        return host->logical_processor_count;
+    if (host->initialized == SMP_MAGIC || host->initialized == SMP_STARTING)
+        return true;
 
-    host->expected_processor_count = madt_processor_count();
+    host->expected_processor_count = smp_madt_processor_count();
     if (host->expected_processor_count == 0)
         host->expected_processor_count = 1;
 
     dprintf("smp", "Processor count from MADT: %u\n", host->expected_processor_count);
 
-    if (host->expected_processor_count > SMP_MAX_LOGICAL_CPU)
-        return 0;
+    if (host->expected_processor_count > max_cpus) {
+        dprintf("smp", "Working memory only sized for %u CPUs\n", max_cpus);
+        return false;
+    }
 
+    init_working_memory(host, max_cpus, stack_size, arena_size, reserved_mwait_memory);
     host->mem_region_below_1M = page_below_1M;
-    host->logical_processor_count = 1;
     if (reserved_mwait_memory) {
-        host->control = reserved_mwait_memory;
-        host->wait_for_control = (void *)(((U8 *) reserved_mwait_memory) + SMP_MWAIT_ALIGN * SMP_MAX_LOGICAL_CPU);
+        host->wait_for_control = (void *)(((U8 *) reserved_mwait_memory) + SMP_MWAIT_ALIGN * max_cpus);
         memcpy(host->wait_for_control, wait_for_control_asm, wait_for_control_asm_size);
-    } else {
-        host->control = (U8 *)(((unsigned long)host->control_region - 1) & (SMP_MWAIT_ALIGN - 1)) + 1;
+    } else
         host->wait_for_control = wait_for_control_asm;
-    }
-
-    // Init the host structure
-    {
-        U32 i;
-        for (i = 0; i < SMP_MAX_LOGICAL_CPU; i++) {
-            host->cpu[i].present = 0;
-            set_control((U32 *) (host->control + i * SMP_MWAIT_ALIGN), BSP_IN_CONTROL);
-            host->cpu_data[i].use_mwait = true;
-            host->cpu_data[i].mwait_hint = 0;
-            host->cpu_data[i].int_break_event = 1;
-            host->cpu_data[i].function = ap_park;
-            host->cpu_data[i].param = NULL;
-        }
-    }
 
-    host->cpu[0].present = 1;
-    read_apicid(&host->cpu[0].apicid);
-
-    host->bclk = compute_bclk();
+    calibrate_timebase(host);
 
     host->bsp_exception_info.gpf_idtr_installed = 0;
     host->ap_exception_info.gpf_idtr_installed = 0;
     init_bsp_exception_handling(host);
 
-    if (do_callback(host, find_logical_processors, host)) {
-        host->initialized = SMP_MAGIC;
-        return host->logical_processor_count;
-    } else
-        return 0;
+    start_aps(host, find_logical_processors, host);
+    host->initialized = SMP_STARTING;
+    return true;
 }
 
 void smp_phantom_init_with_memory(void *working_memory)
 {
     struct smp_host *host = working_memory;
-    if (!host || host->initialized != SMP_MAGIC)
+    if (!host)
+        return;
+    // Let any APs still starting up check in before forgetting about them
+    if (host->initialized == SMP_STARTING)
+        wait_for_aps(host);
+    else if (host->initialized != SMP_MAGIC)
         return;
     host->initialized = 0;
 }
 
-U32 smp_read_bclk_with_memory(void *working_memory)
-{
-    struct smp_host *host = working_memory;
-    if (!host || host->initialized != SMP_MAGIC)
-        return 0;
-    return host->bclk;
-}
-
-const CPU_INFO *smp_read_cpu_list_with_memory(void *working_memory)
+void bsp_function(struct smp_host *host, CALLBACK function, void *param)
 {
-    struct smp_host *host = working_memory;
-    if (!host || host->initialized != SMP_MAGIC)
-        return NULL;
-    return host->cpu;
-}
-
-U32 smp_function_with_memory(void *working_memory, U32 apicid, CALLBACK function, void *param)
-{
-    struct smp_host *host = working_memory;
-    if (!host || host->initialized != SMP_MAGIC) {
-        dprintf("smp", "smp_function returning 0 because working memory not initialized\n");
-        return 0;
-    }
-
-    if (!function) {
-        dprintf("smp", "smp_function returning 0 because !function\n");
-        return 0;
-    }
-
-    if (apicid == host->cpu[0].apicid) {
-        struct exception_info *e = &host->bsp_exception_info;
-        if (e->gpf_idtr_installed) {
-            set_idtr(&host->bsp_exception_info.idt_descriptor);
-            function(param);
-            set_idtr(&real_mode_idtr);
-        } else {
-            struct gate old_gate;
-            get_gate(0xd, &old_gate);
-            set_protected_mode_exception_handler(0xd, gpfHandler);
-            function(param);
-            set_gate(0xd, &old_gate);
-        }
+    struct exception_info *e = &host->bsp_exception_info;
+    if (e->gpf_idtr_installed) {
+        set_idtr(&host->bsp_exception_info.idt_descriptor);
+        function(param);
+        set_idtr(&real_mode_idtr);
     } else {
-        U32 processor_id;
-        CPU_DATA *cpu_data;
-        U32 *my_control;
-
-        if (find_processor_id_for_this_apicid(apicid, &processor_id, host) == 0) {
-            dprintf("smp", "smp_function returning 0 because APIC ID not found\n");
-            return 0;
-        }
-
-        cpu_data = &host->cpu_data[processor_id];
-        my_control = (U32 *) (host->control + processor_id * SMP_MWAIT_ALIGN);
-
-        // Check if AP is available - FIXME: this should be an assert
-        if (*my_control != BSP_IN_CONTROL) {
-            dprintf("smp", "smp_function returning 0 because BSP not in control\n");
-            return 0;
-        }
-        // Assign the function and its parameter
-        cpu_data->function = function;
-        cpu_data->param = param;
-
-        set_control(my_control, AP_IN_CONTROL);
-        host->wait_for_control(my_control, BSP_IN_CONTROL, cpu_data[0].use_mwait && mwait_supported(), cpu_data[0].mwait_hint, cpu_data[0].int_break_event && int_break_event_supported());
+        struct gate old_gate;
+        get_gate(0xd, &old_gate);
+        set_protected_mode_exception_handler(0xd, gpfHandler);
+        function(param);
+        set_gate(0xd, &old_gate);
     }
-
-    return 1;
 }
 
 /* Called from smpasm directly, which won't use a C prototype, so just give one here to silence the warning. */
@@ -1120,9 +1022,22 @@ asmlinkage void intHandler(void)
     func(param);
 }
 
-static void set_control_callback(void *param)
+// Timer interrupt callback for smp_sleep.  Several CPUs can share an IDT
+// while sleeping at once, so find the sleeping CPU from its APIC ID.
+static void sleep_wake_callback(void *param)
+{
+    struct smp_host *host = param;
+    U32 processor_id;
+
+    if (find_processor_id_for_this_cpu(&processor_id, host))
+        set_control(host->cpu_data[processor_id].sleep_control, 0);
+}
+
+static bool tsc_deadline_supported(void)
 {
-    set_control(param, 0);
+    U32 ecx, dummy;
+    cpuid32(1, &dummy, &dummy, &ecx, &dummy);
+    return ecx & (1 << 24) ? true : false;
 }
 
 static inline void disable_interrupts(void)
@@ -1135,7 +1050,7 @@ static inline void enable_interrupts(void)
     __asm__ __volatile__ ("sti");
 }
 
-void smp_sleep_with_memory(void *working_memory, U32 microseconds)
+U64 smp_sleep_with_memory(void *working_memory, U32 microseconds)
 {
     struct smp_host *host = working_memory;
     U32 processor_id;
@@ -1143,36 +1058,55 @@ void smp_sleep_with_memory(void *working_memory, U32 microseconds)
     struct gate gate = EMPTY_GATE;
     U32 my_control[SMP_MWAIT_ALIGN / sizeof(U32)];
     bool oldmask;
+    bool tsc_deadline;
+    U32 status;
+    U64 start, deadline, stop;
 
     if (!host || host->initialized != SMP_MAGIC)
-        return;
+        return 0;
 
     if (find_processor_id_for_this_cpu(&processor_id, host) == 0)
-        return;
+        return 0;
 
     cpu_data = &host->cpu_data[processor_id];
+    cpu_data->sleep_control = my_control;
+    tsc_deadline = tsc_deadline_supported();
 
     set_protected_mode_exception_handler(0x30, intHandler_asm);
-    set_gate_offset(&gate, set_control_callback);
+    set_gate_offset(&gate, sleep_wake_callback);
     set_gate(0x31, &gate);
-    set_gate_offset(&gate, my_control);
+    set_gate_offset(&gate, host);
     set_gate(0x32, &gate);
 
     set_control(my_control, 1);
 
-    /* Set up the timer that puts the BSP back in control */
+    /* Set up the timer that puts this CPU back in control */
     oldmask = mask_lint0(1); /* Need to prevent other interrupts while sti'd */
     enable_interrupts();
 
-    setup_apic(0, 0x30);
-    start_apic_timer(host, microseconds);
+    setup_apic(0, tsc_deadline, 0x30);
+    start = rdtsc64();
+    deadline = start + (U64)(microseconds / 1000000) * host->tsc_hz
+        + grub_divmod64((U64)(microseconds % 1000000) * host->tsc_hz, 1000000, NULL);
+    if (tsc_deadline) {
+        // In xAPIC mode, the LVT write must reach the APIC before arming the deadline
+        memory_fence();
+        wrmsr64(MSR_IA32_TSC_DEADLINE, deadline, &status);
+    } else
+        start_apic_timer(host, microseconds);
+
+    // Sleeping should not burn the spin budget
+    wait_for_control(host, cpu_data, my_control, 0, 0);
 
-    host->wait_for_control(my_control, 0,
-                           cpu_data->use_mwait && mwait_supported(), cpu_data->mwait_hint,
-                           cpu_data->int_break_event && int_break_event_supported());
+    // The one-shot APIC timer runs at a different clock; don't return before the deadline
+    while ((stop = rdtsc64()) < deadline)
+        pause32();
 
-    setup_apic(1, 0xff);
+    setup_apic(1, false, 0xff);
 
     disable_interrupts();
     mask_lint0(oldmask);
+    cpu_data->sleep_control = NULL;
+
+    return stop - start;
 }
@@ -81,16 +81,6 @@ static U32 viewpoint_env(void)
     return num;
 }
 
-static U32 first_cpu(U32 cpu_num)
-{
-    return cpu_num == ALL_CPUS ? 0 : cpu_num;
-}
-
-static U32 last_cpu(U32 cpu_num)
-{
-    return cpu_num == ALL_CPUS ? ncpus : cpu_num + 1;
-}
-
 static grub_err_t init(void)
 {
     ncpus = smp_init();
@@ -159,7 +149,7 @@ static const struct grub_arg_option cpu_ping_options[] = {
 
 static grub_err_t grub_cmd_cpu_ping(struct grub_extcmd_context *context, int argc, char **args)
 {
-    U32 i, j;
+    U32 j;
     U32 cpuNum;
     U32 repeat_count;
     U64 start, stop;
@@ -189,16 +179,79 @@ static grub_err_t grub_cmd_cpu_ping(struct grub_extcmd_context *context, int arg
             seconds++;
             grub_printf("\r%u second%s (%u%%)", seconds, seconds == 1 ? "" : "s", (j * 100) / repeat_count);
         }
-        for (i = first_cpu(cpuNum); i != last_cpu(cpuNum); i++)
-            smp_function(cpu[i].apicid, noop_callback, NULL);
+        if (cpuNum == ALL_CPUS)
+            smp_function_all(noop_callback, NULL);
+        else
+            smp_function_by_index(cpuNum, noop_callback, NULL);
     }
     grub_printf("\r");
 
     return GRUB_ERR_NONE;
 }
 
+static const struct grub_arg_option cpu_dispatch_stats_options[] = {
+#undef OPTION_RESET
+#define OPTION_RESET 0
+    {"reset", 'r', 0, "Reset the statistics after displaying them", 0, 0},
+#undef OPTION_QUIET
+#define OPTION_QUIET 1
+    {"quiet", 'q', 0, "Don't display the statistics", 0, 0},
+    {0, 0, 0, 0, 0, 0}
+};
+
+static void print_stage(const char *name, const SMP_STAGE_STATS *stage)
+{
+    U32 i;
+
+    if (!stage->count)
+        return;
+    grub_printf("  %s: count=%llu mean=%llu max=%llu log2:", name,
+                (unsigned long long)stage->count,
+                (unsigned long long)grub_divmod64(stage->total, stage->count, NULL),
+                (unsigned long long)stage->max);
+    for (i = 0; i < SMP_STATS_BUCKETS; i++)
+        if (stage->histogram[i])
+            grub_printf(" %u:%u", i, stage->histogram[i]);
+    grub_printf("\n");
+}
+
+static grub_err_t grub_cmd_cpu_dispatch_stats(struct grub_extcmd_context *context, int argc, char **args)
+{
+    U32 i;
+    SMP_DISPATCH_STATS stats;
+    (void)args;
+
+    if (init() != GRUB_ERR_NONE)
+        return grub_errno;
+
+    if (argc != 0)
+        return grub_error(GRUB_ERR_BAD_ARGUMENT, "Unexpected argument");
+
+    if (!context->state[OPTION_QUIET].set) {
+        grub_printf("Dispatch latency in TSC ticks (log2 bucket:count)\n");
+        for (i = 0; i < ncpus; i++) {
+            if (!smp_read_dispatch_stats(i, &stats))
+                return grub_error(GRUB_ERR_IO, "Failed to read dispatch statistics for CPU %u", i);
+            if (!stats.spin_wakes && !stats.mwait_wakes)
+                continue;
+            grub_printf("CPU %u (APIC ID 0x%x): woke %llu times spinning, %llu from MWAIT\n", i, cpu[i].apicid,
+                        (unsigned long long)stats.spin_wakes, (unsigned long long)stats.mwait_wakes);
+            print_stage("wake", &stats.wake);
+            print_stage("start", &stats.start);
+            print_stage("run", &stats.run);
+            print_stage("handback", &stats.handback);
+        }
+    }
+
+    if (context->state[OPTION_RESET].set)
+        smp_reset_dispatch_stats();
+
+    return GRUB_ERR_NONE;
+}
+
 static grub_command_t cmd_c;
 static grub_extcmd_t cmd_cpu_ping;
+static grub_extcmd_t cmd_cpu_dispatch_stats;
 
 GRUB_MOD_INIT(testsuite)
 {
@@ -207,10 +260,15 @@ GRUB_MOD_INIT(testsuite)
                                       "[-c cpu_num] count",
                                       "Ping CPU",
                                       cpu_ping_options);
+  cmd_cpu_dispatch_stats = grub_register_extcmd("cpu_dispatch_stats", grub_cmd_cpu_dispatch_stats, 0,
+                                                "[-r] [-q]",
+                                                "Show per-CPU dispatch latency statistics",
+                                                cpu_dispatch_stats_options);
 }
 
 GRUB_MOD_FINI(testsuite)
 {
+    grub_unregister_extcmd(cmd_cpu_dispatch_stats);
     grub_unregister_extcmd(cmd_cpu_ping);
     grub_unregister_command(cmd_c);
 }